@@ -18,14 +18,18 @@
 #define MAX_CACHE_REQUEST_LEN 6200
 #define MAX_SIMPLE_CACHE_QUEUE_SIZE 826
 
+// time a request may take from the proxy's request to the last chunk, a
+// side that waits longer for its peer gives up and the segment is reused
+#define CACHE_DEADLINE_MS 30000
+
 
 typedef struct seg_info
 {
   void* seg;
   // int seg_fd;
-  char seg_name[10];
-  char sem1_name[10];
-  char sem2_name[10];
+  char seg_name[16];
+  char sem1_name[16];
+  char sem2_name[16];
   sem_t *sem1;
   sem_t *sem2;
   size_t segsize;
@@ -35,17 +39,25 @@ typedef struct seg_info
 typedef struct request_info
 {
   char path[BUFSIZE];
-  char seg_name[10];
-  char sem1_name[10];
-  char sem2_name[10];
+  char seg_name[16];
+  char sem1_name[16];
+  char sem2_name[16];
   size_t segsize;
+  unsigned long id;
+  long long queued_ms;  // set by simplecached on receipt, see shm_now_ms
 } request_info;
 
+// start of every segment, shared by the proxy and the cache for one
+// request.  Either side sets cancel and posts the other's semaphore when
+// it gives up; both check cancel, id and deadline_ms between chunks.
 typedef struct response_info
 {
   size_t file_len;
   ssize_t content_len;
-  char buffer[BUFSIZE];
+  volatile int cancel;
+  volatile unsigned long id; // of the request using the segment now
+  long long deadline_ms;     // CLOCK_REALTIME, see shm_now_ms
+  char buffer[]; // fills the rest of the segment
 } response_info;
 
 
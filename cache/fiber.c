@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "fiber.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+static __thread fiber_sched_t *cur_sched = NULL;
+static __thread fiber_t *cur_fiber = NULL;
+
+#if defined(__SANITIZE_ADDRESS__)
+// ASan has to be told which stack is in use, or it reports the other
+// stack's frames as overflows and keeps stale shadow memory
+static __thread const void *sched_stack;
+static __thread size_t sched_stack_size;
+
+static void _asan_enter(fiber_t *fiber, void **fake_stack)
+{
+	__sanitizer_start_switch_fiber(fake_stack, fiber->stack, FIBER_STACK_SIZE);
+}
+
+static void _asan_entered(void *fake_stack)
+{
+	__sanitizer_finish_switch_fiber(fake_stack, &sched_stack, &sched_stack_size);
+}
+
+static void _asan_leave(void **fake_stack)
+{
+	__sanitizer_start_switch_fiber(fake_stack, sched_stack, sched_stack_size);
+}
+
+static void _asan_left(void *fake_stack)
+{
+	__sanitizer_finish_switch_fiber(fake_stack, NULL, NULL);
+}
+#else
+#define _asan_entered(fake_stack)
+#endif
+
+// hands the thread back to the scheduler until the fiber is resumed
+static void _fiber_park(fiber_t *fiber, int exiting)
+{
+#if defined(__SANITIZE_ADDRESS__)
+	void *fake_stack = NULL;
+
+	// an exiting fiber's stack is recycled, nothing to save for it
+	_asan_leave(exiting ? NULL : &fake_stack);
+	swapcontext(&fiber->ctx, &cur_sched->main_ctx);
+	_asan_entered(fake_stack);
+#else
+	(void)exiting;
+	swapcontext(&fiber->ctx, &cur_sched->main_ctx);
+#endif
+}
+
+static int _ts_before(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void _fiber_main()
+{
+	fiber_t *fiber = cur_fiber;
+
+	_asan_entered(NULL);
+	fiber->func(fiber->arg);
+	fiber->done = 1;
+
+	// never returns, the scheduler recycles the fiber
+	_fiber_park(fiber, 1);
+}
+
+static fiber_t *_fiber_alloc(fiber_sched_t *sched)
+{
+	fiber_t *fiber = sched->free_fibers;
+
+	if (fiber != NULL)
+	{
+		sched->free_fibers = fiber->next;
+		return fiber;
+	}
+
+	// lazily grow up to max_fibers, afterwards fibers are only recycled
+	fiber = malloc(sizeof(fiber_t));
+	if (fiber == NULL)
+	{
+		return NULL;
+	}
+
+	fiber->stack = mmap(NULL, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (fiber->stack == MAP_FAILED)
+	{
+		perror("mmap");
+		free(fiber);
+		return NULL;
+	}
+
+	return fiber;
+}
+
+void fiber_sched_init(fiber_sched_t *sched, int max_fibers)
+{
+	steque_ring_init(&sched->runq, max_fibers);
+	sched->free_fibers = NULL;
+	sched->nfibers = 0;
+	sched->max_fibers = max_fibers;
+	sched->has_sleepers = 0;
+	pthread_mutex_init(&sched->kick_lock, NULL);
+	sched->blocked_on = NULL;
+	sched->kicked = 0;
+	cur_sched = sched;
+}
+
+int fiber_spawn(fiber_sched_t *sched, fiber_func_t func, void *arg)
+{
+	fiber_t *fiber;
+
+	if (sched->nfibers >= sched->max_fibers)
+	{
+		return -1;
+	}
+
+	if ((fiber = _fiber_alloc(sched)) == NULL)
+	{
+		return -1;
+	}
+
+	getcontext(&fiber->ctx);
+	fiber->ctx.uc_stack.ss_sp = fiber->stack;
+	fiber->ctx.uc_stack.ss_size = FIBER_STACK_SIZE;
+	fiber->ctx.uc_link = NULL;
+	makecontext(&fiber->ctx, _fiber_main, 0);
+
+	fiber->func = func;
+	fiber->arg = arg;
+	fiber->done = 0;
+	fiber->wait_sem = NULL;
+	fiber->wait_until.tv_sec = 0;
+	fiber->timed_out = 0;
+	fiber->wake_at.tv_sec = 0;
+	fiber->wake_at.tv_nsec = 0;
+
+	sched->nfibers++;
+	steque_ring_enqueue(&sched->runq, fiber);
+
+	return 0;
+}
+
+int fiber_sched_step(fiber_sched_t *sched)
+{
+	int progress = 0;
+	int n = steque_ring_size(&sched->runq);
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sched->has_sleepers = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+		fiber_t *fiber = steque_ring_pop(&sched->runq);
+
+		// still parked, keep its place in the queue
+		if (fiber->wait_sem != NULL)
+		{
+			if (sem_trywait(fiber->wait_sem) != 0)
+			{
+				if (fiber->wait_until.tv_sec == 0 || _ts_before(&now, &fiber->wait_until))
+				{
+					steque_ring_enqueue(&sched->runq, fiber);
+					continue;
+				}
+				fiber->timed_out = 1;
+			}
+			fiber->wait_sem = NULL;
+			fiber->wait_until.tv_sec = 0;
+		}
+		else if (fiber->wake_at.tv_sec != 0 && _ts_before(&now, &fiber->wake_at))
+		{
+			if (!sched->has_sleepers || _ts_before(&fiber->wake_at, &sched->next_wake))
+			{
+				sched->next_wake = fiber->wake_at;
+			}
+			sched->has_sleepers = 1;
+			steque_ring_enqueue(&sched->runq, fiber);
+			continue;
+		}
+		fiber->wake_at.tv_sec = 0;
+
+		cur_fiber = fiber;
+#if defined(__SANITIZE_ADDRESS__)
+		void *fake_stack = NULL;
+		_asan_enter(fiber, &fake_stack);
+		swapcontext(&sched->main_ctx, &fiber->ctx);
+		_asan_left(fake_stack);
+#else
+		swapcontext(&sched->main_ctx, &fiber->ctx);
+#endif
+		cur_fiber = NULL;
+		progress++;
+
+		if (fiber->done)
+		{
+			fiber->next = sched->free_fibers;
+			sched->free_fibers = fiber;
+			sched->nfibers--;
+		}
+		else
+		{
+			steque_ring_enqueue(&sched->runq, fiber);
+		}
+	}
+
+	return progress;
+}
+
+int fiber_sched_wait(fiber_sched_t *sched, unsigned long usec)
+{
+	fiber_t *fiber = NULL;
+	int n = steque_ring_size(&sched->runq);
+	struct timespec deadline;
+	int rc, kicked;
+
+	// the queue keeps its order, so the first parked fiber waited longest
+	for (int i = 0; i < n; i++)
+	{
+		fiber_t *f = steque_ring_pop(&sched->runq);
+		if (fiber == NULL && f->wait_sem != NULL)
+			fiber = f;
+		steque_ring_enqueue(&sched->runq, f);
+	}
+	if (fiber == NULL)
+	{
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += usec / 1000000;
+	deadline.tv_nsec += (usec % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	if (fiber->wait_until.tv_sec != 0 && _ts_before(&fiber->wait_until, &deadline))
+		deadline = fiber->wait_until;
+	if (sched->has_sleepers && _ts_before(&sched->next_wake, &deadline))
+		deadline = sched->next_wake;
+
+	pthread_mutex_lock(&sched->kick_lock);
+	if (sched->kicked)
+	{
+		sched->kicked = 0;
+		pthread_mutex_unlock(&sched->kick_lock);
+		return 0;
+	}
+	sched->blocked_on = fiber->wait_sem;
+	pthread_mutex_unlock(&sched->kick_lock);
+
+	while ((rc = sem_clockwait(fiber->wait_sem, CLOCK_MONOTONIC, &deadline)) < 0 && errno == EINTR)
+		;
+
+	pthread_mutex_lock(&sched->kick_lock);
+	sched->blocked_on = NULL;
+	kicked = sched->kicked;
+	sched->kicked = 0;
+	pthread_mutex_unlock(&sched->kick_lock);
+
+	if (kicked)
+	{
+		// a kick posts once, whichever post was taken the other one is
+		// left for the fiber; one that was not taken is the kick's
+		if (rc < 0)
+			sem_trywait(fiber->wait_sem);
+	}
+	else if (rc == 0)
+	{
+		// acquired on the fiber's behalf, the next step resumes it
+		fiber->wait_sem = NULL;
+		fiber->wait_until.tv_sec = 0;
+	}
+
+	return 0;
+}
+
+void fiber_sched_kick(fiber_sched_t *sched)
+{
+	pthread_mutex_lock(&sched->kick_lock);
+	if (!sched->kicked)
+	{
+		sched->kicked = 1;
+		if (sched->blocked_on != NULL)
+			sem_post(sched->blocked_on);
+	}
+	pthread_mutex_unlock(&sched->kick_lock);
+}
+
+void fiber_sched_destroy(fiber_sched_t *sched)
+{
+	while (sched->free_fibers != NULL)
+	{
+		fiber_t *fiber = sched->free_fibers;
+		sched->free_fibers = fiber->next;
+		munmap(fiber->stack, FIBER_STACK_SIZE);
+		free(fiber);
+	}
+	steque_ring_destroy(&sched->runq);
+	pthread_mutex_destroy(&sched->kick_lock);
+	cur_sched = NULL;
+}
+
+int fiber_active()
+{
+	return cur_fiber != NULL;
+}
+
+void fiber_yield()
+{
+	fiber_t *fiber = cur_fiber;
+
+	if (fiber == NULL)
+	{
+		sched_yield();
+		return;
+	}
+
+	_fiber_park(fiber, 0);
+}
+
+void fiber_usleep(unsigned long usec)
+{
+	fiber_t *fiber = cur_fiber;
+
+	if (fiber == NULL)
+	{
+		usleep(usec);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &fiber->wake_at);
+	fiber->wake_at.tv_sec += usec / 1000000;
+	fiber->wake_at.tv_nsec += (usec % 1000000) * 1000;
+	if (fiber->wake_at.tv_nsec >= 1000000000)
+	{
+		fiber->wake_at.tv_sec++;
+		fiber->wake_at.tv_nsec -= 1000000000;
+	}
+
+	_fiber_park(fiber, 0);
+}
+
+void fiber_sem_wait(sem_t *sem)
+{
+	fiber_t *fiber = cur_fiber;
+
+	if (fiber == NULL)
+	{
+		while (sem_wait(sem) == -1 && errno == EINTR)
+			;
+		return;
+	}
+
+	if (sem_trywait(sem) == 0)
+	{
+		return;
+	}
+
+	// the scheduler acquires the semaphore on our behalf before resuming us
+	fiber->wait_sem = sem;
+	_fiber_park(fiber, 0);
+}
+
+int fiber_sem_timedwait(sem_t *sem, const struct timespec *abs_timeout)
+{
+	fiber_t *fiber = cur_fiber;
+	struct timespec now;
+	long long left_ns;
+
+	if (fiber == NULL)
+	{
+		while (sem_timedwait(sem, abs_timeout) == -1)
+		{
+			if (errno != EINTR)
+				return -1;
+		}
+		return 0;
+	}
+
+	if (sem_trywait(sem) == 0)
+	{
+		return 0;
+	}
+
+	// the scheduler runs on CLOCK_MONOTONIC
+	clock_gettime(CLOCK_REALTIME, &now);
+	left_ns = (abs_timeout->tv_sec - now.tv_sec) * 1000000000LL + abs_timeout->tv_nsec - now.tv_nsec;
+	if (left_ns <= 0)
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &fiber->wait_until);
+	fiber->wait_until.tv_sec += left_ns / 1000000000LL;
+	fiber->wait_until.tv_nsec += left_ns % 1000000000LL;
+	if (fiber->wait_until.tv_nsec >= 1000000000)
+	{
+		fiber->wait_until.tv_sec++;
+		fiber->wait_until.tv_nsec -= 1000000000;
+	}
+
+	fiber->timed_out = 0;
+	fiber->wait_sem = sem;
+	_fiber_park(fiber, 0);
+	if (fiber->timed_out)
+	{
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+// User-space fibers for simplecached
+//
+// Each scheduler thread owns a fiber_sched_t and runs its fibers round robin.
+// Fibers never migrate between threads, so they can freely use thread locals.
+//
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+#include <ucontext.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include "steque.h"
+
+// stacks are small on purpose, an in-flight request should cost a few pages
+// instead of a whole thread stack; ASan instrumented frames need more room
+#if defined(__SANITIZE_ADDRESS__)
+#define FIBER_STACK_SIZE (64 * 1024)
+#else
+#define FIBER_STACK_SIZE (16 * 1024)
+#endif
+
+typedef void (*fiber_func_t)(void *arg);
+
+typedef struct fiber_t
+{
+	ucontext_t ctx;
+	void *stack;
+	fiber_func_t func;
+	void *arg;
+	int done;
+	sem_t *wait_sem;          // semaphore the fiber is parked on
+	struct timespec wait_until; // CLOCK_MONOTONIC, gives up on wait_sem then
+	int timed_out;
+	struct timespec wake_at;  // deadline the fiber is sleeping until
+	struct fiber_t *next;     // free list link
+} fiber_t;
+
+typedef struct fiber_sched_t
+{
+	ucontext_t main_ctx;
+	steque_ring_t runq;
+	fiber_t *free_fibers;
+	int nfibers;
+	int max_fibers;
+	struct timespec next_wake; // earliest sleeper deadline seen in the last round
+	int has_sleepers;
+	pthread_mutex_t kick_lock;
+	sem_t *blocked_on;        // semaphore fiber_sched_wait is blocked in
+	int kicked;
+} fiber_sched_t;
+
+// sets up a scheduler for the calling thread running at most max_fibers at once
+void fiber_sched_init(fiber_sched_t *sched, int max_fibers);
+
+// starts func(arg) on a new fiber, returns -1 when the scheduler is full
+int fiber_spawn(fiber_sched_t *sched, fiber_func_t func, void *arg);
+
+// resumes every runnable fiber once, returns the number that made progress
+int fiber_sched_step(fiber_sched_t *sched);
+
+// blocks on the semaphore of the fiber parked longest until it is posted,
+// usec passed, a deadline of a fiber is due or fiber_sched_kick is called;
+// returns -1 right away when no fiber is parked on a semaphore
+int fiber_sched_wait(fiber_sched_t *sched, unsigned long usec);
+
+// ends the current or the next fiber_sched_wait early, from any thread
+void fiber_sched_kick(fiber_sched_t *sched);
+
+// releases all fiber stacks, no fiber may be alive
+void fiber_sched_destroy(fiber_sched_t *sched);
+
+// returns 1 when called from inside a fiber
+int fiber_active();
+
+// the calls below park the current fiber, outside of a fiber they block the thread
+void fiber_yield();
+void fiber_usleep(unsigned long usec);
+void fiber_sem_wait(sem_t *sem);
+// like sem_timedwait, abs_timeout is CLOCK_REALTIME; -1 with ETIMEDOUT
+int fiber_sem_timedwait(sem_t *sem, const struct timespec *abs_timeout);
+
+#endif // __FIBER_H__
@@ -1,17 +1,492 @@
 #include "gfserver.h"
 #include "cache-student.h"
+#include "shm_channel.h"
+#include "uring_io.h"
 #include <mqueue.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
 #define BUFSIZE (834)
 #define QUEUE_NAME "/cache_queue"
 
-extern pthread_mutex_t seg_mutex;
-extern pthread_cond_t seg_cleanup_cond;
-extern pthread_cond_t seg_cond;
-extern steque_t *seg_queue;
-extern int exit_flag;
+extern seg_pool_t *seg_pool;
+extern volatile int exit_flag;
+extern int uring_mode;
 
 struct timespec timeout = {10, 0};
+unsigned long nbytes_forwarded = 0;
+// segments this process currently holds, a forked proxy drains them on exit
+int nsegs_held = 0;
+// requests whose segment went back before their client had the whole file
+unsigned long nspilled = 0;
+// requests given up on, because the client left or the cache ran late
+unsigned long ncancelled = 0;
+static unsigned long request_seq = 0;
+// requests answered with an error right away, simplecached was down
+unsigned long nunavailable = 0;
+
+// the queue to simplecached, opened once and shared by all threads
+#define CACHE_RETRY_MIN_MS 10
+#define CACHE_RETRY_MAX_MS 1000
+#define CACHE_POLL_MS 200
+static mqd_t cache_mq = (mqd_t)-1;
+static int cache_up = 0;
+static unsigned long cache_gen = 0;  // bumped whenever the daemon goes away
+static int cache_backoff_ms = 0;
+static long long cache_retry_ms = 0;
+static pthread_mutex_t cache_mq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// returns the queue, or -1 while simplecached is down.  The daemon removes
+// the queue on exit, which shows up as a link count of zero; reconnecting
+// is retried with exponential back-off rather than on every request.  A
+// new queue is dup2'ed over the old descriptor so threads still holding
+// it never see it closed.
+static mqd_t _cache_mq(unsigned long *gen)
+{
+	struct stat st;
+	mqd_t mq;
+
+	pthread_mutex_lock(&cache_mq_lock);
+	if (cache_up && fstat(cache_mq, &st) == 0 && st.st_nlink == 0)
+	{
+		printf("Cache went away\n");
+		cache_up = 0;
+		cache_gen++;
+	}
+	if (!cache_up && shm_now_ms() >= cache_retry_ms)
+	{
+		if ((mq = mq_open(QUEUE_NAME, O_WRONLY)) == (mqd_t)-1)
+		{
+			cache_backoff_ms = cache_backoff_ms == 0 ? CACHE_RETRY_MIN_MS : cache_backoff_ms * 2;
+			if (cache_backoff_ms > CACHE_RETRY_MAX_MS)
+				cache_backoff_ms = CACHE_RETRY_MAX_MS;
+			cache_retry_ms = shm_now_ms() + cache_backoff_ms;
+		}
+		else
+		{
+			printf("New Message Queue\n");
+			if (cache_mq == (mqd_t)-1)
+			{
+				cache_mq = mq;
+			}
+			else
+			{
+				dup2(mq, cache_mq);
+				mq_close(mq);
+			}
+			cache_up = 1;
+			cache_backoff_ms = 0;
+		}
+	}
+	mq = cache_up ? cache_mq : (mqd_t)-1;
+	if (gen != NULL)
+		*gen = cache_gen;
+	pthread_mutex_unlock(&cache_mq_lock);
+
+	return mq;
+}
+
+// waits for the cache to fill the segment, -1 once the deadline passed,
+// the cache gave up or the daemon holding the request went away
+static int _seg_wait(seg_info *seg, response_info *res, unsigned long gen)
+{
+	unsigned long now_gen;
+
+	while (1)
+	{
+		long long now = shm_now_ms();
+		struct timespec slice;
+
+		if (now >= res->deadline_ms)
+			return -1;
+		slice = shm_deadline(now + CACHE_POLL_MS < res->deadline_ms ? now + CACHE_POLL_MS : res->deadline_ms);
+		if (sem_timedwait(seg->sem1, &slice) == 0)
+			break;
+		if (errno != EINTR && errno != ETIMEDOUT)
+			return -1;
+		if (errno == ETIMEDOUT && (_cache_mq(&now_gen) == (mqd_t)-1 || now_gen != gen))
+			return -1;
+	}
+
+	return res->cancel ? -1 : 0;
+}
+
+// tells the cache to stop, it checks before reading the next chunk
+static void _seg_cancel(seg_info *seg, response_info *res)
+{
+	if (!res->cancel)
+	{
+		res->cancel = 1;
+		sem_post(seg->sem2);
+	}
+	__sync_fetch_and_add(&ncancelled, 1);
+}
+
+// per thread io_uring state, chunks are staged into one buffer while the
+// other one is being sent
+typedef struct send_ring_t
+{
+	uring_t ring;
+	char *bufs[2];
+	size_t bufsize;
+	int cur;
+	size_t staged;
+	char *inflight;
+	size_t inflight_len;
+} send_ring_t;
+
+static __thread send_ring_t *send_ring = NULL;
+static __thread int send_ring_state = 0; // 0 untried, 1 ready, -1 unavailable
+// tears the ring down when a worker of a shrinking pool exits
+static pthread_key_t send_ring_key;
+static pthread_once_t send_ring_once = PTHREAD_ONCE_INIT;
+
+static void _send_ring_free(void *arg)
+{
+	send_ring_t *sr = arg;
+
+	uring_destroy(&sr->ring);
+	free(sr->bufs[0]);
+	free(sr->bufs[1]);
+	free(sr);
+}
+
+static void _send_ring_key_init(void)
+{
+	pthread_key_create(&send_ring_key, _send_ring_free);
+}
+
+static send_ring_t *_send_ring_get(size_t segsize)
+{
+	if (send_ring_state == 0)
+	{
+		send_ring_state = -1;
+		send_ring = malloc(sizeof(send_ring_t));
+		// a staging buffer must at least hold one segment
+		send_ring->bufsize = segsize > URING_BATCH_SIZE ? segsize : URING_BATCH_SIZE;
+		send_ring->bufs[0] = malloc(send_ring->bufsize);
+		send_ring->bufs[1] = malloc(send_ring->bufsize);
+
+		if (uring_init(&send_ring->ring, 8, uring_mode == 2) < 0)
+		{
+			perror("io_uring_setup");
+			printf("io_uring unavailable, falling back to send\n");
+			free(send_ring->bufs[0]);
+			free(send_ring->bufs[1]);
+			free(send_ring);
+			send_ring = NULL;
+		}
+		else
+		{
+			send_ring_state = 1;
+			pthread_once(&send_ring_once, _send_ring_key_init);
+			pthread_setspecific(send_ring_key, send_ring);
+		}
+	}
+
+	return send_ring;
+}
+
+// waits for the outstanding send, a short send is finished synchronously
+static int _send_ring_reap(send_ring_t *sr, gfcontext_t *ctx)
+{
+	struct io_uring_cqe *cqe;
+	int res;
+
+	if (sr->inflight == NULL)
+	{
+		return 0;
+	}
+
+	if ((cqe = uring_wait_cqe(&sr->ring)) == NULL)
+	{
+		sr->inflight = NULL;
+		return -1;
+	}
+	res = cqe->res;
+	uring_cqe_seen(&sr->ring);
+
+	if (res < 0)
+	{
+		sr->inflight = NULL;
+		return -1;
+	}
+
+	ctx->bytes_transferred += res;
+	if (res < sr->inflight_len && gfs_send(ctx, sr->inflight + res, sr->inflight_len - res) != sr->inflight_len - res)
+	{
+		sr->inflight = NULL;
+		return -1;
+	}
+	sr->inflight = NULL;
+
+	return 0;
+}
+
+// hands the staged buffer to the kernel, only one send is in flight at a
+// time so the response stays in order
+static int _send_ring_flush(send_ring_t *sr, gfcontext_t *ctx)
+{
+	struct io_uring_sqe *sqe;
+
+	if (_send_ring_reap(sr, ctx) < 0)
+	{
+		return -1;
+	}
+
+	if (sr->staged == 0)
+	{
+		return 0;
+	}
+
+	sqe = uring_get_sqe(&sr->ring);
+	uring_prep_send(sqe, ctx->socket, sr->bufs[sr->cur], sr->staged, MSG_WAITALL | MSG_NOSIGNAL, 0);
+	uring_submit(&sr->ring, 0);
+
+	sr->inflight = sr->bufs[sr->cur];
+	sr->inflight_len = sr->staged;
+	sr->cur ^= 1;
+	sr->staged = 0;
+
+	return 0;
+}
+
+// copies each chunk out of the segment so the cache can refill it right
+// away and sends the file in URING_BATCH_SIZE batches
+static size_t _forward_with_uring(gfcontext_t *ctx, seg_info *seg, response_info *file_buffer, size_t file_len, unsigned long gen,
+								  send_ring_t *sr)
+{
+	size_t received = 0;
+	int failed = 0;
+
+	sr->cur = 0;
+	sr->staged = 0;
+	sr->inflight = NULL;
+
+	while (received < file_len)
+	{
+		if (_seg_wait(seg, file_buffer, gen) < 0)
+		{
+			_seg_cancel(seg, file_buffer);
+			break;
+		}
+
+		ssize_t len = file_buffer->content_len;
+		if (len <= 0)
+		{
+			printf("Error reading file\n");
+			break;
+		}
+
+		// the rest of the file is of no use once the client is gone
+		if (sr->staged + len > sr->bufsize && _send_ring_flush(sr, ctx) < 0)
+		{
+			failed = 1;
+			_seg_cancel(seg, file_buffer);
+			break;
+		}
+		memcpy(sr->bufs[sr->cur] + sr->staged, file_buffer->buffer, len);
+		sr->staged += len;
+		received += len;
+
+		sem_post(seg->sem2);
+	}
+
+	if (!failed)
+	{
+		_send_ring_flush(sr, ctx);
+	}
+	_send_ring_reap(sr, ctx);
+
+	return ctx->bytes_transferred;
+}
+
+// bytes a slow client can't take yet wait here, so the segment goes back
+// to the pool once the cache has written the file rather than once the
+// client has read it.  The first SPILL_MEM_MAX bytes are kept in memory,
+// up to SPILL_MAX in a temp file; past that the segment waits after all.
+#define SPILL_MEM_MAX (256 * 1024)
+#define SPILL_MAX (64 << 20)
+
+// memory parts of the spills, at most one per worker thread
+static slab_t spill_slab;
+
+void handle_with_cache_init(int nworkerthreads)
+{
+	slab_init(&spill_slab, SPILL_MEM_MAX, 1, nworkerthreads);
+}
+
+typedef struct spill_t
+{
+	char *mem;
+	size_t mem_len;
+	size_t mem_off;           // bytes of mem already sent
+	int fd;                   // temp file, -1 until mem overflows
+	off_t file_len;
+	off_t file_off;
+} spill_t;
+
+static size_t _spill_len(spill_t *sp)
+{
+	return sp->mem_len - sp->mem_off + sp->file_len - sp->file_off;
+}
+
+// the memory part always holds older bytes than the file part
+static int _spill_append(spill_t *sp, const char *data, size_t len)
+{
+	char tmpname[] = "/tmp/spillXXXXXX";
+
+	if (sp->file_off == sp->file_len && sp->mem_len + len <= SPILL_MEM_MAX)
+	{
+		// without a buffer the client holds the segment as before
+		if (sp->mem == NULL && (sp->mem = slab_tryalloc(&spill_slab)) == NULL)
+			return -1;
+		memcpy(sp->mem + sp->mem_len, data, len);
+		sp->mem_len += len;
+		return 0;
+	}
+
+	if (_spill_len(sp) + len > SPILL_MAX)
+	{
+		return -1;
+	}
+	if (sp->fd < 0)
+	{
+		if ((sp->fd = mkstemp(tmpname)) < 0)
+		{
+			perror("mkstemp");
+			return -1;
+		}
+		unlink(tmpname);
+	}
+	if (pwrite(sp->fd, data, len, sp->file_len) != len)
+	{
+		perror("spill write");
+		return -1;
+	}
+	sp->file_len += len;
+
+	return 0;
+}
+
+// sends spilled bytes, all of them with block, else what the socket takes
+// right away; returns the bytes sent or -1 once the client is gone
+static ssize_t _spill_flush(spill_t *sp, int sock, int block)
+{
+	int flags = MSG_NOSIGNAL | (block ? 0 : MSG_DONTWAIT);
+	size_t sent = 0;
+	ssize_t n;
+
+	while (sp->mem_off < sp->mem_len)
+	{
+		if ((n = send(sock, sp->mem + sp->mem_off, sp->mem_len - sp->mem_off, flags)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? sent : -1;
+		}
+		sp->mem_off += n;
+		sent += n;
+	}
+	sp->mem_off = sp->mem_len = 0;
+
+	while (sp->file_off < sp->file_len)
+	{
+		char buf[65536];
+		size_t want = sp->file_len - sp->file_off < sizeof(buf) ? sp->file_len - sp->file_off : sizeof(buf);
+
+		if (block)
+		{
+			n = sendfile(sock, sp->fd, &sp->file_off, sp->file_len - sp->file_off);
+		}
+		else if ((n = pread(sp->fd, buf, want, sp->file_off)) > 0 && (n = send(sock, buf, n, flags)) > 0)
+		{
+			sp->file_off += n;
+		}
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? sent : -1;
+		}
+		if (n == 0)
+			return -1;
+		sent += n;
+	}
+	sp->file_off = sp->file_len = 0;
+
+	return sent;
+}
+
+// takes the file out of the segment chunk by chunk, sending what the
+// client takes and spilling the rest; returns the bytes sent once the
+// whole file has left the segment, *sp holds what is still to be sent
+static size_t _forward_spilled(gfcontext_t *ctx, seg_info *seg, response_info *file_buffer, size_t file_len, unsigned long gen,
+							   spill_t *sp, int *failed)
+{
+	size_t received = 0;
+	size_t sent = 0;
+
+	while (received < file_len)
+	{
+		ssize_t len, n = 0;
+
+		if (_seg_wait(seg, file_buffer, gen) < 0)
+		{
+			*failed = 1;
+			_seg_cancel(seg, file_buffer);
+			break;
+		}
+		if ((len = file_buffer->content_len) <= 0)
+		{
+			printf("Error reading file\n");
+			*failed = 1;
+			break;
+		}
+		received += len;
+
+		if (!*failed && _spill_len(sp) == 0)
+		{
+			while ((n = send(ctx->socket, file_buffer->buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0 && errno == EINTR)
+				;
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				*failed = 1;
+			n = n < 0 ? 0 : n;
+			sent += n;
+		}
+		if (!*failed && n < len && _spill_append(sp, file_buffer->buffer + n, len - n) < 0)
+		{
+			ssize_t flushed;
+
+			// spill full, this client holds the segment after all
+			if ((flushed = _spill_flush(sp, ctx->socket, 1)) < 0 ||
+				gfs_send(ctx, file_buffer->buffer + n, len - n) != len - n)
+				*failed = 1;
+			else
+				sent += flushed + len - n;
+		}
+
+		if (!*failed && _spill_len(sp) > 0)
+		{
+			if ((n = _spill_flush(sp, ctx->socket, 0)) < 0)
+				*failed = 1;
+			else
+				sent += n;
+		}
+
+		// the rest of the file is of no use once the client is gone
+		if (*failed)
+		{
+			_seg_cancel(seg, file_buffer);
+			break;
+		}
+		sem_post(seg->sem2);
+	}
+
+	return sent;
+}
 
 // ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void *arg)
 // {
@@ -76,35 +551,27 @@ ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void *arg)
 	size_t bytes_sent;
 	request_info req_info;
 	mqd_t mqdes;
+	unsigned long gen;
 	seg_info *seg;
+	spill_t spill = {NULL, 0, 0, -1, 0, 0};
+	int failed = 0;
 	
 
-	// initialize message queue
-	mqdes = mq_open(QUEUE_NAME, O_WRONLY);
-	// printf("thread id : %lu\n", pthread_self());
-	// dynmically check if queue exists in case proxy server is restarted
-	while (mqdes == (mqd_t)-1)
+	// while simplecached is down requests fail right away instead of
+	// piling up behind it
+	if ((mqdes = _cache_mq(&gen)) == (mqd_t)-1)
 	{
-		// printf("Reconnecting to message queue\n");
-		mqdes = mq_open(QUEUE_NAME, O_WRONLY);
+		printf("Cache unavailable : %s\n", path);
+		__sync_fetch_and_add(&nunavailable, 1);
+		return SERVER_FAILURE;
 	}
-	
-	printf("New Message Queue\n");
 
-	// acquire lock and pop seg info from queue
-	pthread_mutex_lock(&seg_mutex);
-	while (steque_isempty(seg_queue))
+	// acquire a segment, the pool is shared with the other proxy processes
+	if ((seg = seg_pool_get(seg_pool, &exit_flag)) == NULL)
 	{
-		if (exit_flag)
-        {
-          pthread_mutex_unlock(&seg_mutex);
-          pthread_cond_signal(&seg_cleanup_cond);
-          return 0;
-        }
-		pthread_cond_wait(&seg_cond, &seg_mutex);
+		return 0;
 	}
-	seg = steque_pop(seg_queue);
-	pthread_mutex_unlock(&seg_mutex);
+	__sync_fetch_and_add(&nsegs_held, 1);
 
 	strcpy(req_info.path, path);
 	strcpy(req_info.seg_name, seg->seg_name);
@@ -120,36 +587,51 @@ ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void *arg)
     //   exit(1);
     // }
 
-	if ((seg->sem1 = sem_open(seg->sem1_name, O_CREAT, 0644, 0)) == SEM_FAILED)
+	// fresh semaphores every request, a cache worker that gave up late may
+	// have posted the old ones
+	sem_unlink(seg->sem1_name);
+	sem_unlink(seg->sem2_name);
+	if ((seg->sem1 = sem_open(seg->sem1_name, O_CREAT | O_EXCL, 0644, 0)) == SEM_FAILED)
     {
       perror("sem_open");
       exit(1);
     }
 
-    if ((seg->sem2 = sem_open(seg->sem2_name, O_CREAT, 0644, 1)) == SEM_FAILED)
+    if ((seg->sem2 = sem_open(seg->sem2_name, O_CREAT | O_EXCL, 0644, 1)) == SEM_FAILED)
     {
       perror("sem_open");
       exit(1);
     }
 	
+	// a previous request's cache side that wakes up late sees another id
+	response_info *file_buffer = (response_info*) seg->seg;
+	req_info.id = ((unsigned long)getpid() << 32) | __sync_add_and_fetch(&request_seq, 1);
+	file_buffer->id = req_info.id;
+	file_buffer->cancel = 0;
+	file_buffer->deadline_ms = shm_now_ms() + CACHE_DEADLINE_MS;
+
 	printf("message sent : %s\n", req_info.seg_name);
 	printf("Sending Path : %s\n", req_info.path);
-	mq_send(mqdes, (const char *)&req_info, sizeof(req_info), 0);
+	struct timespec deadline = shm_deadline(file_buffer->deadline_ms);
 
 	// Wait for signal to read segment
-	// int value;
-	// sem_getvalue(seg->sem1, &value);
-	// printf("Proxy Sem 1 before: %i\n", value);
-	sem_wait(seg->sem1);
-	// sem_timedwait(seg->sem1, &timeout);
-	// sem_getvalue(seg->sem1, &value);
-	// printf("Proxy Sem 1 after: %i\n", value);
+	if (mq_timedsend(mqdes, (const char *)&req_info, sizeof(req_info), 0, &deadline) < 0 ||
+		_seg_wait(seg, file_buffer, gen) < 0)
+	{
+		printf("Cache gave no answer : %s\n", req_info.path);
+		_seg_cancel(seg, file_buffer);
+		sem_close(seg->sem1);
+		sem_close(seg->sem2);
+		sem_unlink(seg->sem1_name);
+		sem_unlink(seg->sem2_name);
+		seg_pool_put(seg_pool, seg);
+		__sync_fetch_and_sub(&nsegs_held, 1);
+
+		return SERVER_FAILURE;
+	}
 
 	// Get file len (status)
-	response_info *file_buffer = (response_info*) seg->seg;
 	file_len = file_buffer->file_len;
-	// printf("Seg name : %s\n", seg->seg_name);
-	// printf("seg before : %p\n", seg->seg);
 	printf("File length %li\n", file_buffer->file_len);
 
 	// Send header
@@ -158,7 +640,6 @@ ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void *arg)
 		printf("FILE NOT FOUND\n");
 		gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
 		// cleanup
-		mq_close(mqdes);
 		sem_close(seg->sem1);
 		sem_close(seg->sem2);
 		sem_unlink(seg->sem1_name);
@@ -166,10 +647,8 @@ ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void *arg)
 		// munmap(seg_map, seg->segsize);
 
 
-		pthread_mutex_lock(&seg_mutex);
-		steque_enqueue(seg_queue, seg);
-		pthread_mutex_unlock(&seg_mutex);
-		pthread_cond_signal(&seg_cond);
+		seg_pool_put(seg_pool, seg);
+		__sync_fetch_and_sub(&nsegs_held, 1);
 
 		return 0;
 	}
@@ -180,46 +659,48 @@ ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void *arg)
 	// Get File Content
 	bytes_sent = 0;
 
-	while (bytes_sent < file_len)
-	{	
-		// Signal cache to write first chunk of file content
-		// Wait for cache to signal that it is ready to read file content
-		sem_wait(seg->sem1);
-;
-		if (file_buffer->content_len <= 0)
-		{
-			printf("Error reading file\n");
-			// gfs_send(ctx, file_buffer->buffer, 0);
-			break;
-		}
-
-		bytes_sent += gfs_send(ctx, file_buffer->buffer, file_buffer->content_len);
-
-		// Signal cache to read next chunk of file content
-		sem_post(seg->sem2);
+	send_ring_t *sr = uring_mode ? _send_ring_get(seg->segsize) : NULL;
+	if (sr != NULL)
+	{
+		bytes_sent = _forward_with_uring(ctx, seg, file_buffer, file_len, gen, sr);
+	}
 
+	if (sr == NULL)
+	{
+		bytes_sent = _forward_spilled(ctx, seg, file_buffer, file_len, gen, &spill, &failed);
 	}
 
-	printf("Bytes sent: %ld\n", bytes_sent);
 	printf("Finished Path : %s\n", req_info.path);
 	printf("Finished Segment : %s\n", req_info.seg_name);
 
-
-	ctx->bytes_transferred = bytes_sent;
-	
 	// cleanup
-	mq_close(mqdes);
 	sem_close(seg->sem1);
 	sem_close(seg->sem2);
 	sem_unlink(seg->sem1_name);
 	sem_unlink(seg->sem2_name);
 	// munmap(seg_map, seg->segsize);
 
-	// recycle segment by adding it back to queue
-	pthread_mutex_lock(&seg_mutex);
-	steque_enqueue(seg_queue, seg);
-	pthread_mutex_unlock(&seg_mutex);
-	pthread_cond_signal(&seg_cond);
+	// recycle segment by adding it back to the pool
+	seg_pool_put(seg_pool, seg);
+	__sync_fetch_and_sub(&nsegs_held, 1);
+
+	// the rest goes to the slow client without holding a segment
+	if (_spill_len(&spill) > 0)
+	{
+		ssize_t n = failed ? -1 : _spill_flush(&spill, ctx->socket, 1);
+
+		__sync_fetch_and_add(&nspilled, 1);
+		if (n > 0)
+			bytes_sent += n;
+	}
+	if (spill.mem != NULL)
+		slab_free(&spill_slab, spill.mem);
+	if (spill.fd >= 0)
+		close(spill.fd);
+
+	printf("Bytes sent: %ld\n", bytes_sent);
+	ctx->bytes_transferred = bytes_sent;
+	__sync_fetch_and_add(&nbytes_forwarded, bytes_sent);
 
 	return bytes_sent;
-}
\ No newline at end of file
+}
@@ -1,3 +1,279 @@
 // In case you want to implement the shared memory IPC as a library
 // This is optional but may help with code reuse
 //
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shm_channel.h"
+
+unsigned long slab_nallocs = 0;
+
+// how often a segment waiter checks its cancel flag
+#define SEG_POOL_POLL_MS 100
+
+// called with the lock held, or before the slab is shared
+static void _slab_grow(slab_t *slab)
+{
+	int n = slab->max - slab->count < slab->grow ? slab->max - slab->count : slab->grow;
+	char *chunk = malloc(sizeof(char *) + n * slab->objsize);
+
+	if (chunk == NULL)
+	{
+		perror("malloc");
+		exit(1);
+	}
+	__sync_fetch_and_add(&slab_nallocs, 1);
+
+	*(char **)chunk = slab->chunks;
+	slab->chunks = chunk;
+	for (int i = 0; i < n; i++)
+	{
+		steque_ring_enqueue(&slab->free_objs, chunk + sizeof(char *) + i * slab->objsize);
+	}
+	slab->count += n;
+}
+
+void slab_init(slab_t *slab, size_t objsize, int count, int max)
+{
+	// keep objects pointer aligned
+	objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	slab->chunks = NULL;
+	slab->objsize = objsize;
+	slab->count = 0;
+	slab->grow = count;
+	slab->max = max;
+	steque_ring_init(&slab->free_objs, max);
+	_slab_grow(slab);
+
+	pthread_mutex_init(&slab->lock, NULL);
+	pthread_cond_init(&slab->avail, NULL);
+}
+
+void *slab_alloc(slab_t *slab)
+{
+	void *obj;
+
+	pthread_mutex_lock(&slab->lock);
+	if (steque_ring_isempty(&slab->free_objs) && slab->count < slab->max)
+	{
+		_slab_grow(slab);
+	}
+	while (steque_ring_isempty(&slab->free_objs))
+	{
+		pthread_cond_wait(&slab->avail, &slab->lock);
+	}
+	obj = steque_ring_pop(&slab->free_objs);
+	pthread_mutex_unlock(&slab->lock);
+
+	return obj;
+}
+
+void *slab_tryalloc(slab_t *slab)
+{
+	void *obj = NULL;
+
+	pthread_mutex_lock(&slab->lock);
+	if (steque_ring_isempty(&slab->free_objs) && slab->count < slab->max)
+	{
+		_slab_grow(slab);
+	}
+	if (!steque_ring_isempty(&slab->free_objs))
+	{
+		obj = steque_ring_pop(&slab->free_objs);
+	}
+	pthread_mutex_unlock(&slab->lock);
+
+	return obj;
+}
+
+void slab_free(slab_t *slab, void *obj)
+{
+	pthread_mutex_lock(&slab->lock);
+	steque_ring_push(&slab->free_objs, obj);
+	pthread_mutex_unlock(&slab->lock);
+	pthread_cond_signal(&slab->avail);
+}
+
+void slab_destroy(slab_t *slab)
+{
+	steque_ring_destroy(&slab->free_objs);
+	pthread_mutex_destroy(&slab->lock);
+	pthread_cond_destroy(&slab->avail);
+	while (slab->chunks != NULL)
+	{
+		char *prev = *(char **)slab->chunks;
+		free(slab->chunks);
+		slab->chunks = prev;
+	}
+}
+
+seg_pool_t *seg_pool_create(int capacity)
+{
+	pthread_mutexattr_t mattr;
+	size_t size = sizeof(seg_pool_t) + capacity * (2 * sizeof(void *) + sizeof(pid_t));
+	seg_pool_t *pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (pool == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&pool->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	sem_init(&pool->nfree, 1, 0);
+
+	pool->capacity = capacity;
+	pool->head = 0;
+	pool->n = 0;
+	// the mapping is zeroed, so no slot has a holder yet
+	pool->held = pool->items + capacity;
+	pool->holders = (pid_t *)(pool->held + capacity);
+
+	return pool;
+}
+
+// the owner of a lock that died mid-update left at most one segment
+// unaccounted for, the pool goes on with the rest
+static void _pool_lock(seg_pool_t *pool)
+{
+	if (pthread_mutex_lock(&pool->lock) == EOWNERDEAD)
+	{
+		fprintf(stderr, "seg_pool: previous owner died, recovering lock\n");
+		pthread_mutex_consistent(&pool->lock);
+	}
+}
+
+// called once nfree was decremented, so a segment is there to take
+static void *_pool_take(seg_pool_t *pool)
+{
+	void *seg;
+
+	_pool_lock(pool);
+	seg = pool->items[pool->head];
+	pool->head = (pool->head + 1) % pool->capacity;
+	pool->n--;
+	// there are as many slots as segments, one of them is free
+	for (int i = 0; i < pool->capacity; i++)
+	{
+		if (pool->holders[i] == 0)
+		{
+			pool->held[i] = seg;
+			pool->holders[i] = getpid();
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return seg;
+}
+
+void *seg_pool_get(seg_pool_t *pool, volatile int *cancel)
+{
+	if (cancel == NULL)
+	{
+		while (sem_wait(&pool->nfree) < 0)
+			;
+		return _pool_take(pool);
+	}
+
+	// nothing posts on shutdown, waiters look at *cancel now and then
+	while (!*cancel)
+	{
+		struct timespec deadline = shm_deadline(shm_now_ms() + SEG_POOL_POLL_MS);
+
+		if (sem_timedwait(&pool->nfree, &deadline) == 0)
+			return _pool_take(pool);
+	}
+
+	return NULL;
+}
+
+void *seg_pool_timedget(seg_pool_t *pool, long long deadline_ms)
+{
+	struct timespec deadline = shm_deadline(deadline_ms);
+
+	while (sem_timedwait(&pool->nfree, &deadline) < 0)
+	{
+		if (errno != EINTR)
+			return NULL;
+	}
+
+	return _pool_take(pool);
+}
+
+void seg_pool_put(seg_pool_t *pool, void *seg)
+{
+	_pool_lock(pool);
+	if (pool->n == pool->capacity)
+	{
+		fprintf(stderr, "seg_pool_put: pool is full\n");
+		exit(1);
+	}
+	pool->items[(pool->head + pool->n) % pool->capacity] = seg;
+	pool->n++;
+	// segments put in at start up were never handed out
+	for (int i = 0; i < pool->capacity; i++)
+	{
+		if (pool->holders[i] != 0 && pool->held[i] == seg)
+		{
+			pool->holders[i] = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	sem_post(&pool->nfree);
+}
+
+int seg_pool_reclaim(seg_pool_t *pool, pid_t pid, void **segs)
+{
+	int n = 0;
+
+	_pool_lock(pool);
+	for (int i = 0; i < pool->capacity; i++)
+	{
+		if (pool->holders[i] == pid)
+		{
+			segs[n++] = pool->held[i];
+			pool->holders[i] = 0;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return n;
+}
+
+void seg_pool_destroy(seg_pool_t *pool)
+{
+	pthread_mutex_destroy(&pool->lock);
+	sem_destroy(&pool->nfree);
+	munmap(pool, sizeof(seg_pool_t) + pool->capacity * (2 * sizeof(void *) + sizeof(pid_t)));
+}
+
+long long shm_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+struct timespec shm_deadline(long long deadline_ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline_ms / 1000;
+	ts.tv_nsec = (deadline_ms % 1000) * 1000000;
+
+	return ts;
+}
@@ -1,3 +1,81 @@
 // In case you want to implement the shared memory IPC as a library
 // You may use this file. It is optional. It does help with code reuse
 //
+#ifndef __SHM_CHANNEL_H__
+#define __SHM_CHANNEL_H__
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/types.h>
+#include "steque.h"
+
+// bounded pool of equally sized objects (request_info, seg_info, ...)
+// memory is allocated in chunks as the pool grows and never handed back,
+// so once it reached its working size the request path never calls malloc
+typedef struct slab_t
+{
+  char *chunks;             // each starts with a pointer to the previous one
+  size_t objsize;
+  int count;                // objects allocated so far
+  int grow;                 // objects added per chunk
+  int max;                  // count never goes past this
+  steque_ring_t free_objs;
+  pthread_mutex_t lock;
+  pthread_cond_t avail;
+} slab_t;
+
+// number of backing allocations made by slab_init and slab_alloc
+extern unsigned long slab_nallocs;
+
+// allocates count objects now and more in steps of count up to max
+void slab_init(slab_t *slab, size_t objsize, int count, int max);
+
+// blocks until an object is available once max objects are in use
+void *slab_alloc(slab_t *slab);
+
+// like slab_alloc, but returns NULL instead of waiting
+void *slab_tryalloc(slab_t *slab);
+
+void slab_free(slab_t *slab, void *obj);
+
+void slab_destroy(slab_t *slab);
+
+// free list of segments shared by forked proxies, it lives in an anonymous
+// MAP_SHARED mapping so it has to be created before fork; the segments
+// put into it are inherited at the same address by every process
+typedef struct seg_pool_t
+{
+  pthread_mutex_t lock;     // robust, a proxy may die holding it
+  sem_t nfree;              // a condition variable would hang on dead waiters
+  int capacity;
+  int head;
+  int n;
+  void **held;              // segments handed out and the process holding
+  pid_t *holders;           // each, so a dead proxy's can be taken back
+  void *items[];
+} seg_pool_t;
+
+seg_pool_t *seg_pool_create(int capacity);
+
+// blocks until a segment is free, returns NULL once *cancel is set
+void *seg_pool_get(seg_pool_t *pool, volatile int *cancel);
+
+// like seg_pool_get, but returns NULL once deadline_ms (shm_now_ms) passed
+void *seg_pool_timedget(seg_pool_t *pool, long long deadline_ms);
+
+void seg_pool_put(seg_pool_t *pool, void *seg);
+
+// stores the segments pid still held in segs and forgets it held them,
+// returns how many; the caller puts them back once nothing uses them
+int seg_pool_reclaim(seg_pool_t *pool, pid_t pid, void **segs);
+
+void seg_pool_destroy(seg_pool_t *pool);
+
+// CLOCK_REALTIME in ms, the clock deadlines shared between processes use
+long long shm_now_ms(void);
+
+// deadline_ms as an absolute timeout for sem_timedwait
+struct timespec shm_deadline(long long deadline_ms);
+
+#endif // __SHM_CHANNEL_H__
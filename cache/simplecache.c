@@ -13,6 +13,7 @@
 
 #include "gfserver.h"
 #include "cache-student.h"
+#include "fiber.h"
 
 #define MAX_KEYLEN 1024
 
@@ -82,7 +83,8 @@ int simplecache_get(char *key){
 	int mid, cmp;
 
 	if (cache_delay > 0) {
-		usleep(cache_delay);
+		// parks only the calling fiber when running on one
+		fiber_usleep(cache_delay);
 	}
 
 	while (lo <= hi) {
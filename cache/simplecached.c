@@ -11,11 +11,15 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <mqueue.h>
+#include <stddef.h>
+#include <sys/stat.h>
 
 
 #include "cache-student.h"
 #include "shm_channel.h"
 #include "simplecache.h"
+#include "fiber.h"
+#include "uring_io.h"
 #include "gfserver.h"
 
 // CACHE_FAILURE
@@ -24,169 +28,576 @@
 #endif
 
 #define MAX_CACHE_REQUEST_LEN 6200
-#define MAX_SIMPLE_CACHE_QUEUE_SIZE 826
+
+// bounds for the back off of a fiber thread whose fibers are all parked
+#define FIBER_IDLE_MIN_US 20
+#define FIBER_IDLE_MAX_US 1000
+// a worker above the minimum exits after finding no work for this long
+#define THREAD_IDLE_MS 5000
+// a request waiting this long starts another worker even if some are free
+#define THREAD_WAIT_MS 50
 
 unsigned long int cache_delay;
+int nfibers = 0;
+int uring_mode = 0;
+unsigned long nbytes_read = 0;
 
 pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-steque_t *cache_queue;
+steque_ring_t cache_queue;
+// a fiber thread as the reader sees it, under cache_mutex
+typedef struct fiber_thread_t
+{
+	fiber_sched_t *sched;
+	int nfree;              // fiber slots it had free when it last looked
+	struct fiber_thread_t *next;
+} fiber_thread_t;
+
+// one with a free slot is kicked when a request is queued
+fiber_thread_t *fiber_threads = NULL;
+slab_t req_slab;
+unsigned long nrequests = 0;
+// requests given up on by either side
+unsigned long ncancelled = 0;
 mqd_t mqdes;
 struct timespec timeout = {10, 0};
+// worker pool, grows up to max_threads while requests wait and shrinks
+// back to min_threads; all under cache_mutex
+int min_threads = 0;
+int max_threads;
+int nworkers = 0;
+int nfree = 0;          // requests the running workers could take right now
+int nworkers_peak = 0;
+unsigned long ngrown = 0;
+unsigned long ngrown_wait = 0;  // of those, for a request waiting too long
+unsigned long nshrunk = 0;
 int exit_flag = 0;
 
+// per thread io_uring state, the registered batch buffer belongs to one
+// request at a time, other fibers of the thread fall back to pread
+static __thread uring_t read_ring;
+static __thread char *read_batch = NULL;
+static __thread int read_ring_state = 0; // 0 untried, 1 ready, -1 unavailable
+static __thread int read_batch_busy = 0;
+
+typedef struct chunk_reader_t
+{
+	int fd;
+	int batched;
+	off_t batch_off;
+	size_t batch_len;
+} chunk_reader_t;
+
+static void reader_open(chunk_reader_t *reader, int fd)
+{
+	reader->fd = fd;
+	reader->batched = 0;
+	reader->batch_off = 0;
+	reader->batch_len = 0;
+
+	if (uring_mode == 0)
+	{
+		return;
+	}
+
+	if (read_ring_state == 0)
+	{
+		read_ring_state = -1;
+		if (posix_memalign((void **)&read_batch, 4096, URING_BATCH_SIZE) != 0)
+		{
+			read_batch = NULL;
+		}
+		else if (uring_init(&read_ring, 8, uring_mode == 2) < 0)
+		{
+			perror("io_uring_setup");
+		}
+		else if (uring_register_buffer(&read_ring, read_batch, URING_BATCH_SIZE) < 0)
+		{
+			perror("io_uring_register");
+			uring_destroy(&read_ring);
+		}
+		else
+		{
+			read_ring_state = 1;
+		}
+
+		if (read_ring_state < 0)
+		{
+			printf("io_uring unavailable, falling back to pread\n");
+		}
+	}
+
+	if (read_ring_state == 1 && !read_batch_busy)
+	{
+		read_batch_busy = 1;
+		reader->batched = 1;
+	}
+}
+
+// copies the next chunk into dst, with io_uring the file is read in
+// URING_BATCH_SIZE batches so most chunks do not need a syscall at all
+static ssize_t reader_read(chunk_reader_t *reader, void *dst, size_t len, off_t offset)
+{
+	if (!reader->batched)
+	{
+		return pread(reader->fd, dst, len, offset);
+	}
+
+	if (offset < reader->batch_off || offset >= reader->batch_off + (off_t)reader->batch_len)
+	{
+		struct io_uring_sqe *sqe = uring_get_sqe(&read_ring);
+		struct io_uring_cqe *cqe;
+		int res;
+
+		uring_prep_read_fixed(sqe, reader->fd, read_batch, URING_BATCH_SIZE, offset, 0);
+		uring_submit(&read_ring, 1);
+		if ((cqe = uring_wait_cqe(&read_ring)) == NULL)
+		{
+			return -1;
+		}
+		res = cqe->res;
+		uring_cqe_seen(&read_ring);
+
+		if (res <= 0)
+		{
+			return res < 0 ? -1 : 0;
+		}
+		reader->batch_off = offset;
+		reader->batch_len = res;
+	}
+
+	size_t avail = reader->batch_off + reader->batch_len - offset;
+	if (len > avail)
+	{
+		len = avail;
+	}
+	memcpy(dst, read_batch + (offset - reader->batch_off), len);
+
+	return len;
+}
+
+static void reader_close(chunk_reader_t *reader)
+{
+	if (reader->batched)
+	{
+		read_batch_busy = 0;
+	}
+}
+
+// releases this thread's ring before it exits
+static void reader_thread_exit()
+{
+	if (read_ring_state == 1)
+	{
+		uring_destroy(&read_ring);
+	}
+	free(read_batch);
+	read_batch = NULL;
+	read_ring_state = 0;
+}
+
+// serves one request, runs either on a worker thread or on a fiber
+static void serve_cache_request(void *arg)
+{
+	request_info *req_info = arg;
+	ssize_t bytes_sent; 
+	size_t file_len;
+	struct stat st;
+
+	size_t segsize = req_info->segsize;
+	
+	// acccess segment
+	int seg_fd = shm_open(req_info->seg_name, O_RDWR, 0666);
+	if (seg_fd == -1)
+	{
+		perror("shm_open");
+		slab_free(&req_slab, req_info);
+		return;
+	}
+
+	// map segment
+	void* file_buffer = mmap(NULL, segsize, PROT_WRITE | PROT_READ, MAP_SHARED, seg_fd, 0);
+
+	if (file_buffer == MAP_FAILED)
+	{
+		perror("mmap");
+		exit(1);
+	}
+	
+	// open semaphores
+	// only the proxy creates them, never bring back ones it removed
+	sem_t *sem1 = sem_open(req_info->sem1_name, 0);
+	sem_t *sem2 = sem_open(req_info->sem2_name, 0);
+	// the proxy already gave up and removed them
+	if (sem1 == SEM_FAILED || sem2 == SEM_FAILED)
+	{
+		perror("sem_open");
+		__sync_fetch_and_add(&ncancelled, 1);
+		if (sem1 != SEM_FAILED)
+			sem_close(sem1);
+		if (sem2 != SEM_FAILED)
+			sem_close(sem2);
+		munmap(file_buffer, segsize);
+		slab_free(&req_slab, req_info);
+		close(seg_fd);
+		return;
+	}
+	// printf("sem1 name: %s\n", req_info->sem1_name);
+	// printf("sem2 name: %s\n", req_info->sem2_name);
+
+	// set status buffer
+	response_info* res_info = (response_info*) file_buffer;
+
+	// the proxy may have given up while the request was queued
+	if (res_info->id != req_info->id || res_info->cancel || shm_now_ms() > res_info->deadline_ms)
+	{
+		printf("Cancelled : %s\n", req_info->path);
+		__sync_fetch_and_add(&ncancelled, 1);
+		if (res_info->id == req_info->id)
+		{
+			res_info->cancel = 1;
+			sem_post(sem1);
+		}
+		sem_close(sem1);
+		sem_close(sem2);
+		munmap(file_buffer, segsize);
+		slab_free(&req_slab, req_info);
+		close(seg_fd);
+		return;
+	}
+
+	// get cache file descriptor
+	int fd = simplecache_get(req_info->path);
+	printf("Cache Path : %s\n", req_info->path);
+
+	if (fd < 0)
+	{
+		printf("File not found\n");
+		res_info->file_len = -1;
+		// int value;
+		// sem_getvalue(sem1, &value);
+		// printf("Cache Sem 1 before: %i\n", value);
+		sem_post(sem1);
+		// sem_getvalue(sem1, &value);
+		// printf("Cache Sem 1 after: %i\n", value);
+		
+		sem_close(sem1);
+		sem_close(sem2);
+		munmap(file_buffer, segsize);	
+		slab_free(&req_slab, req_info);
+		close(seg_fd);
+		return;
+	}
+
+	if (fstat(fd, &st) < 0)
+	{
+		res_info->file_len = -1;
+		sem_post(sem1);
+		sem_close(sem1);
+		sem_close(sem2);
+		munmap(file_buffer, segsize);	
+		slab_free(&req_slab, req_info);
+		close(seg_fd);
+		return;
+	} 
+
+	// send header
+	// printf("Seg name : %s\n", req_info->seg_name);
+	file_len = (size_t)st.st_size;
+	// printf("File len : %li\n", file_len);
+	res_info->file_len = file_len;
+	// printf("status : %li\n",status_buffer->file_len);
+	
+	// int value;
+	// sem_getvalue(sem2, &value);
+	// printf("Sem 2 before: %i\n", value);
+	// Signal proxy to read segment
+	sem_post(sem1);
+		
+	// send file content, each handshake fills the whole segment
+	// int value;
+	size_t chunk_size = segsize - offsetof(response_info, buffer);
+	struct timespec deadline = shm_deadline(res_info->deadline_ms);
+	chunk_reader_t reader;
+	reader_open(&reader, fd);
+	bytes_sent = 0;
+	// printf("Bytes sent : %ld\n", bytes_sent);
+	while (bytes_sent < file_len)
+	{
+		// Wait for proxy to signal that it is ready to send file content
+		// sem_getvalue(sem2,&value);
+		// printf("sem2 before : %i\n", value);
+		// a proxy whose client left cancels, one that is stuck runs out of time
+		if (fiber_sem_timedwait(sem2, &deadline) < 0 || res_info->cancel || res_info->id != req_info->id)
+		{
+			printf("Cancelled : %s after %ld bytes\n", req_info->path, bytes_sent);
+			__sync_fetch_and_add(&ncancelled, 1);
+			if (res_info->id == req_info->id)
+			{
+				res_info->cancel = 1;
+				sem_post(sem1);
+			}
+			break;
+		}
+		// printf("sem2 after : %i\n", value);
+		res_info->content_len = reader_read(&reader, res_info->buffer, chunk_size, bytes_sent);
+		// printf("content len: %ld\n", res_info->content_len);
+		if (res_info->content_len <= 0)
+		{
+			printf("Error reading file\n");
+			// res_info->content_len = -1;
+			sem_post(sem1);
+			break;
+		}
+
+		bytes_sent += res_info->content_len;
+
+		// Signal proxy to read next chunk of file content
+		sem_post(sem1);
+	}
+	reader_close(&reader);
+	
+	printf("bytes sent: %ld\n", bytes_sent);
+	printf("Finished Path : %s\n", req_info->path);
+	printf("Finished Segment : %s\n", req_info->seg_name);
+	__sync_fetch_and_add(&nrequests, 1);
+	__sync_fetch_and_add(&nbytes_read, bytes_sent);
+	sem_close(sem1);
+	sem_close(sem2);
+	munmap(file_buffer, segsize);	
+	slab_free(&req_slab, req_info);
+	close(seg_fd);
+	// close(fd);
+}
+
+// called with cache_mutex held, waits for a request; returns 0 once a
+// worker above the minimum has been idle for THREAD_IDLE_MS
+static int wait_cache_request(struct timespec *idle_until)
+{
+	if (nworkers <= min_threads)
+	{
+		idle_until->tv_sec = 0;
+		pthread_cond_wait(&cache_cond, &cache_mutex);
+		return 1;
+	}
+
+	if (idle_until->tv_sec == 0)
+	{
+		clock_gettime(CLOCK_REALTIME, idle_until);
+		idle_until->tv_sec += THREAD_IDLE_MS / 1000;
+		idle_until->tv_nsec += (THREAD_IDLE_MS % 1000) * 1000000;
+		if (idle_until->tv_nsec >= 1000000000)
+		{
+			idle_until->tv_sec++;
+			idle_until->tv_nsec -= 1000000000;
+		}
+	}
+
+	// others may have left while this one waited
+	return pthread_cond_timedwait(&cache_cond, &cache_mutex, idle_until) != ETIMEDOUT || nworkers <= min_threads;
+}
+
+// called with cache_mutex held by a worker leaving the pool
+static void retire_worker()
+{
+	nworkers--;
+	nshrunk++;
+}
+
+static request_info *next_cache_request()
+{
+	request_info *req_info;
+	struct timespec idle_until = {0, 0};
+
+	pthread_mutex_lock(&cache_mutex);
+
+	while (steque_ring_isempty(&cache_queue))
+	{
+		if (exit_flag)
+		{
+			pthread_mutex_unlock(&cache_mutex);
+			return NULL;
+		}
+		nfree++;
+		if (!wait_cache_request(&idle_until) && steque_ring_isempty(&cache_queue))
+		{
+			nfree--;
+			retire_worker();
+			pthread_mutex_unlock(&cache_mutex);
+			return NULL;
+		}
+		nfree--;
+	}
+
+	req_info = steque_ring_pop(&cache_queue);
+
+	pthread_mutex_unlock(&cache_mutex);
+
+	return req_info;
+}
+
 static void *process_cache_request(void *arg)
 {
+	request_info *req_info;
+
+	// printf("thread id : %lu\n", pthread_self());
+	while ((req_info = next_cache_request()) != NULL)
+	{
+		serve_cache_request(req_info);
+	}
+	reader_thread_exit();
+
+	return NULL;
+}
+
+// multiplexes up to nfibers requests on this thread, requests blocked on the
+// proxy or on the cache delay are parked instead of pinning the thread
+static void *process_cache_fibers(void *arg)
+{
+	fiber_sched_t sched;
+	fiber_thread_t self;    // self.nfree free slots were added to nfree
+	unsigned long idle_us = 0;
+	struct timespec idle_until = {0, 0};
+
+	fiber_sched_init(&sched, nfibers);
+	self.sched = &sched;
+	self.nfree = nfibers;
+	pthread_mutex_lock(&cache_mutex);
+	self.next = fiber_threads;
+	fiber_threads = &self;
+	pthread_mutex_unlock(&cache_mutex);
+
 	while (1)
-	{	
-		ssize_t bytes_sent; 
-		size_t file_len;
-		struct stat st;
-		// printf("thread id : %lu\n", pthread_self());
+	{
 		pthread_mutex_lock(&cache_mutex);
 
-		while (steque_isempty(cache_queue))
+		// nothing in flight, sleep until the main loop hands us work
+		while (sched.nfibers == 0 && steque_ring_isempty(&cache_queue))
 		{
-			if (exit_flag)
+			if (exit_flag || (!wait_cache_request(&idle_until) && steque_ring_isempty(&cache_queue)))
 			{
+				nfree -= self.nfree;
+				if (!exit_flag)
+					retire_worker();
+				for (fiber_thread_t **t = &fiber_threads; *t != NULL; t = &(*t)->next)
+				{
+					if (*t == &self)
+					{
+						*t = self.next;
+						break;
+					}
+				}
 				pthread_mutex_unlock(&cache_mutex);
+				fiber_sched_destroy(&sched);
+				reader_thread_exit();
 				return NULL;
 			}
-			pthread_cond_wait(&cache_cond, &cache_mutex);
 		}
+		idle_until.tv_sec = 0;
 
-		request_info *req_info = steque_pop(cache_queue);
+		request_info *unspawned = NULL;
+		while (sched.nfibers < sched.max_fibers && !steque_ring_isempty(&cache_queue))
+		{
+			request_info *req_info = steque_ring_pop(&cache_queue);
+
+			idle_us = 0;
+			if (fiber_spawn(&sched, serve_cache_request, req_info) < 0)
+			{
+				unspawned = req_info;
+				break;
+			}
+		}
+		// free fiber slots count towards the pool's spare capacity
+		nfree += sched.max_fibers - sched.nfibers - self.nfree;
+		self.nfree = sched.max_fibers - sched.nfibers;
 
 		pthread_mutex_unlock(&cache_mutex);
 
-		size_t segsize = req_info->segsize;
-		
-		// acccess segment
-		int seg_fd = shm_open(req_info->seg_name, O_RDWR, 0666);
-		if (seg_fd == -1)
+		// no memory for another fiber, the request is served on this
+		// thread rather than dropped
+		if (unspawned != NULL)
 		{
-			perror("shm_open");
+			fprintf(stderr, "fiber_spawn failed, serving the request directly\n");
+			serve_cache_request(unspawned);
 			continue;
 		}
 
-		// map segment
-		void* file_buffer = mmap(NULL, segsize, PROT_WRITE | PROT_READ, MAP_SHARED, seg_fd, 0);
-
-		if (file_buffer == MAP_FAILED)
+		if (fiber_sched_step(&sched) > 0)
 		{
-			perror("mmap");
-			exit(1);
+			idle_us = 0;
+			continue;
 		}
-		
-		// open semaphores
-		sem_t *sem1 = sem_open(req_info->sem1_name, O_WRONLY | O_CREAT, 0644);
-		sem_t *sem2 = sem_open(req_info->sem2_name, O_WRONLY | O_CREAT, 0644);
-		// printf("sem1 name: %s\n", req_info->sem1_name);
-		// printf("sem2 name: %s\n", req_info->sem2_name);
-
-		// get cache file descriptor
-		int fd = simplecache_get(req_info->path);
-		printf("Cache Path : %s\n", req_info->path);
 
-		// set status buffer
-		response_info* res_info = (response_info*) file_buffer;
+		// every fiber is parked, block on the oldest one's semaphore so the
+		// proxy's post wakes us; the others are polled at least every idle_us
+		// and a new request kicks us out early
+		idle_us = idle_us == 0 ? FIBER_IDLE_MIN_US : idle_us * 2;
+		if (idle_us > FIBER_IDLE_MAX_US)
+		{
+			idle_us = FIBER_IDLE_MAX_US;
+		}
 
-		if (fd < 0)
+		pthread_mutex_lock(&cache_mutex);
+		int blocked = steque_ring_isempty(&cache_queue) || sched.nfibers == sched.max_fibers;
+		pthread_mutex_unlock(&cache_mutex);
+		if (!blocked || fiber_sched_wait(&sched, idle_us) == 0)
 		{
-			printf("File not found\n");
-			res_info->file_len = -1;
-			// int value;
-			// sem_getvalue(sem1, &value);
-			// printf("Cache Sem 1 before: %i\n", value);
-			sem_post(sem1);
-			// sem_getvalue(sem1, &value);
-			// printf("Cache Sem 1 after: %i\n", value);
-			
-			sem_close(sem1);
-			sem_close(sem2);
-			munmap(file_buffer, segsize);	
-			free(req_info);
-			close(seg_fd);
 			continue;
 		}
 
-		if (fstat(fd, &st) < 0)
+		// only sleepers left
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += idle_us * 1000;
+		if (deadline.tv_nsec >= 1000000000)
 		{
-			res_info->file_len = -1;
-			sem_post(sem1);
-			sem_close(sem1);
-			sem_close(sem2);
-			munmap(file_buffer, segsize);	
-			free(req_info);
-			close(seg_fd);
-			continue;
-		} 
-
-		// send header
-		// printf("Seg name : %s\n", req_info->seg_name);
-		file_len = (size_t)st.st_size;
-		// printf("File len : %li\n", file_len);
-		res_info->file_len = file_len;
-		// printf("status : %li\n",status_buffer->file_len);
-		
-		// int value;
-		// sem_getvalue(sem2, &value);
-		// printf("Sem 2 before: %i\n", value);
-		// Signal proxy to read segment
-		sem_post(sem1);
-			
-		// send file content
-		// int value;
-		bytes_sent = 0;
-		// printf("Bytes sent : %ld\n", bytes_sent);
-		while (bytes_sent < file_len)
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&cache_mutex);
+		if (steque_ring_isempty(&cache_queue) || sched.nfibers == sched.max_fibers)
 		{
-			// Wait for proxy to signal that it is ready to send file content
-			// sem_getvalue(sem2,&value);
-			// printf("sem2 before : %i\n", value);
-			sem_wait(sem2);
-			// sem_timedwait(sem2, &timeout);
-			// printf("sem2 after : %i\n", value);
-			res_info->content_len = pread(fd, res_info->buffer, MAX_SIMPLE_CACHE_QUEUE_SIZE, bytes_sent);
-			// printf("content len: %ld\n", res_info->content_len);
-			if (res_info->content_len <= 0)
-			{
-				printf("Error reading file\n");
-				// res_info->content_len = -1;
-				sem_post(sem1);
-				break;
-			}
+			pthread_cond_timedwait(&cache_cond, &cache_mutex, &deadline);
+		}
+		pthread_mutex_unlock(&cache_mutex);
+	}
+}
 
-			bytes_sent += res_info->content_len;
 
-			// Signal proxy to read next chunk of file content
-			sem_post(sem1);
-		}
-		
-		printf("bytes sent: %ld\n", bytes_sent);
-		printf("Finished Path : %s\n", req_info->path);
-		printf("Finished Segment : %s\n", req_info->seg_name);
-		sem_close(sem1);
-		sem_close(sem2);
-		munmap(file_buffer, segsize);	
-		free(req_info);
-		close(seg_fd);
-		// close(fd);
+// called with cache_mutex held, starts one more worker
+static int spawn_worker()
+{
+	pthread_attr_t attr;
+	pthread_t thread;
 
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, nfibers > 0 ? process_cache_fibers : process_cache_request, NULL) != 0)
+	{
+		pthread_attr_destroy(&attr);
+		return -1;
 	}
+	pthread_attr_destroy(&attr);
 
+	nworkers++;
+	// a fiber thread can take nfibers requests as soon as it runs
+	nfree += nfibers;
+	if (nworkers > nworkers_peak)
+	{
+		nworkers_peak = nworkers;
+	}
 
+	return 0;
 }
 
-
 void init_threads(size_t nthreads)
 {
-  static pthread_t *workers;
-  workers = malloc(sizeof(pthread_t) * nthreads);
+  pthread_mutex_lock(&cache_mutex);
   for (int i = 0; i < nthreads; i++)
   {
-    if (pthread_create(&workers[i], NULL, process_cache_request, NULL) != 0)
+    if (spawn_worker() != 0)
     {
       fprintf(stderr, "Can't create thread %d\n", i);
       exit(1);
@@ -194,6 +605,7 @@ void init_threads(size_t nthreads)
 
     // printf("Created thread %d\n", i);
   }
+  pthread_mutex_unlock(&cache_mutex);
 }
 
 static void _sig_handler(int signo)
@@ -217,8 +629,13 @@ static void _sig_handler(int signo)
 
 		// }
 
+		printf("heap allocations: %lu steque nodes, %lu slabs after %lu requests\n",
+			   steque_nallocs, slab_nallocs, nrequests);
+		printf("io_uring: %lu enters for %lu bytes read\n", uring_nenters, nbytes_read);
+		printf("cancelled: %lu requests\n", ncancelled);
+		printf("worker pool: %d threads, at most %d, %lu started under load (%lu for slow waits), %lu exited idle\n",
+			   nworkers, nworkers_peak, ngrown, ngrown_wait, nshrunk);
 		printf("exitin\n");		
-		steque_destroy(cache_queue);
 
 		exit(signo);
 	}
@@ -231,6 +648,9 @@ static void _sig_handler(int signo)
 	"  -c [cachedir]       Path to static files (Default: ./)\n"                                         \
 	"  -t [thread_count]   Thread count for work queue (Default is 42, Range is 1-235711)\n"             \
 	"  -d [delay]          Delay in simplecache_get (Default is 0, Range is 0-2500000 (microseconds)\n " \
+	"  -f [fiber_count]    Run up to fiber_count requests as fibers per thread (Default is 0, Range is 0-65536)\n" \
+	"  -u [uring_mode]     File reads: 0 pread, 1 io_uring, 2 io_uring with sq polling (Default is 0)\n"   \
+	"  -m [min_threads]    Threads kept while idle, more are started up to thread_count (Default is thread_count)\n" \
 	"  -h                  Show this help message\n"
 
 // OPTIONS
@@ -240,6 +660,9 @@ static struct option gLongOptions[] = {
 	{"help", no_argument, NULL, 'h'},
 	{"hidden", no_argument, NULL, 'i'},		 /* server side */
 	{"delay", required_argument, NULL, 'd'}, // delay.
+	{"fibers", required_argument, NULL, 'f'},
+	{"uring", required_argument, NULL, 'u'},
+	{"min-threads", required_argument, NULL, 'm'},
 	{NULL, 0, NULL, 0}};
 
 void Usage()
@@ -257,7 +680,7 @@ int main(int argc, char **argv)
 	/* disable buffering to stdout */
 	setbuf(stdout, NULL);
 
-	while ((option_char = getopt_long(argc, argv, "d:ic:hlt:x", gLongOptions, NULL)) != -1)
+	while ((option_char = getopt_long(argc, argv, "d:ic:hlt:xf:u:m:", gLongOptions, NULL)) != -1)
 	{
 		switch (option_char)
 		{
@@ -277,6 +700,15 @@ int main(int argc, char **argv)
 		case 'd':
 			cache_delay = (unsigned long int)atoi(optarg);
 			break;
+		case 'f': // fibers per thread
+			nfibers = atoi(optarg);
+			break;
+		case 'u': // io_uring backend
+			uring_mode = atoi(optarg);
+			break;
+		case 'm': // idle pool size
+			min_threads = atoi(optarg);
+			break;
 		case 'i': // server side usage
 		case 'o': // do not modify
 		case 'a': // experimental
@@ -295,6 +727,26 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Invalid number of threads must be in between 1-211804\n");
 		exit(__LINE__);
 	}
+	if ((min_threads < 0) || (min_threads > nthreads))
+	{
+		fprintf(stderr, "Invalid minimum number of threads must be in between 1 and the thread count\n");
+		exit(__LINE__);
+	}
+	max_threads = nthreads;
+	if (min_threads == 0)
+	{
+		min_threads = nthreads;
+	}
+	if ((nfibers > 65536) || (nfibers < 0) || ((long)nthreads * (nfibers > 0 ? nfibers : 1) > 1000000))
+	{
+		fprintf(stderr, "Invalid number of fibers must be in between 0-65536 and at most 1000000 in total\n");
+		exit(__LINE__);
+	}
+	if ((uring_mode < 0) || (uring_mode > 2))
+	{
+		fprintf(stderr, "Invalid io_uring mode must be 0, 1 or 2\n");
+		exit(__LINE__);
+	}
 	if (SIG_ERR == signal(SIGINT, _sig_handler))
 	{
 		fprintf(stderr, "Unable to catch SIGINT...exiting.\n");
@@ -315,26 +767,51 @@ int main(int argc, char **argv)
 	attr.mq_maxmsg = 10;
 	attr.mq_msgsize = MAX_CACHE_REQUEST_LEN;
 	attr.mq_curmsgs = 0;
-	// initialize cache queue
-	cache_queue = malloc(sizeof(steque_t));
-	steque_init(cache_queue);
+	// request buffers start at one queue's worth and grow with the load up
+	// to what can be in flight, the queue holding them is sized for that
+	int ninflight = nthreads * (nfibers > 0 ? nfibers : 1) + attr.mq_maxmsg;
+	slab_init(&req_slab, MAX_CACHE_REQUEST_LEN, attr.mq_maxmsg, ninflight);
+	steque_ring_init(&cache_queue, ninflight);
 
 	// initialize workers
-	init_threads(nthreads);
+	init_threads(min_threads);
+
+	// the queue is opened once; proxies find it by name, so one removed
+	// from under us is created again
+	int backoff_ms = 10;
+	while ((mqdes = mq_open(QUEUE_NAME, O_RDONLY | O_CREAT, 0777, &attr)) == (mqd_t)-1)
+	{
+		perror("mq_open");
+		usleep(backoff_ms * 1000);
+		backoff_ms = backoff_ms * 2 > 1000 ? 1000 : backoff_ms * 2;
+	}
 
 	while (1)
 	{	
-		mqdes = mq_open(QUEUE_NAME, O_RDONLY | O_CREAT, 0777,&attr);
-		// dynmically check if queue exists in case proxy server is restarted
-		while (mqdes == (mqd_t)-1)
-		{
-			printf("Recreating message queue\n");
-			mqdes = mq_open(QUEUE_NAME, O_RDONLY | O_CREAT, 0777,&attr);
-		}
-		request_info *req_info = (request_info*)malloc(MAX_CACHE_REQUEST_LEN);
+		request_info *req_info = (request_info*)slab_alloc(&req_slab);
 
 		// printf("receiving message\n");
-		int n = mq_receive(mqdes, (char *)req_info, MAX_CACHE_REQUEST_LEN, NULL);
+		struct timespec poll = shm_deadline(shm_now_ms() + 1000);
+		int n = mq_timedreceive(mqdes, (char *)req_info, MAX_CACHE_REQUEST_LEN, NULL, &poll);
+
+		if (n == -1 && (errno == ETIMEDOUT || errno == EINTR))
+		{
+			struct stat mq_st;
+
+			if (errno == ETIMEDOUT && fstat(mqdes, &mq_st) == 0 && mq_st.st_nlink == 0)
+			{
+				mqd_t mq = mq_open(QUEUE_NAME, O_RDONLY | O_CREAT, 0777, &attr);
+
+				printf("Recreating message queue\n");
+				if (mq != (mqd_t)-1)
+				{
+					mq_close(mqdes);
+					mqdes = mq;
+				}
+			}
+			slab_free(&req_slab, req_info);
+			continue;
+		}
 		printf("message received : %s\n", ((request_info *)req_info)->seg_name);
 
 		if (n == -1)
@@ -343,11 +820,35 @@ int main(int argc, char **argv)
 			printf("n %i", n);
 			perror("mq_receive");
 			printf("Error: %d \n ", errno);
+			slab_free(&req_slab, req_info);
+			// a broken queue must not spin
+			usleep(10000);
 			continue;
 		}
 		
+		req_info->queued_ms = shm_now_ms();
 		pthread_mutex_lock(&cache_mutex);
-		steque_enqueue(cache_queue, req_info);
+		steque_ring_enqueue(&cache_queue, req_info);
+		// like the signal below, one fiber thread that can take it is enough
+		for (fiber_thread_t *t = fiber_threads; t != NULL; t = t->next)
+		{
+			if (t->nfree > 0)
+			{
+				fiber_sched_kick(t->sched);
+				break;
+			}
+		}
+		// every worker is busy, or the free ones do not get to the oldest
+		// request fast enough: the pool grows by one
+		request_info *head = steque_ring_front(&cache_queue);
+		int busy = steque_ring_size(&cache_queue) > nfree;
+		if ((busy || req_info->queued_ms - head->queued_ms > THREAD_WAIT_MS) && nworkers < max_threads &&
+			spawn_worker() == 0)
+		{
+			ngrown++;
+			if (!busy)
+				ngrown_wait++;
+		}
 		pthread_mutex_unlock(&cache_mutex);
 		pthread_cond_signal(&cache_cond);
 
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include "uring_io.h"
+
+#define URING_SPINS 4096
+
+unsigned long uring_nenters = 0;
+
+// first sqpoll ring, later ones attach to its polling thread
+static int sqpoll_fd = -1;
+static pthread_mutex_t sqpoll_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int _uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	int ret;
+
+	__sync_fetch_and_add(&uring_nenters, 1);
+	while ((ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0)) < 0 && errno == EINTR)
+		;
+
+	return ret;
+}
+
+int uring_init(uring_t *ring, unsigned entries, int sqpoll)
+{
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	pthread_mutex_lock(&sqpoll_lock);
+	if (sqpoll)
+	{
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 2000;
+		if (sqpoll_fd >= 0)
+		{
+			p.flags |= IORING_SETUP_ATTACH_WQ;
+			p.wq_fd = sqpoll_fd;
+		}
+	}
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd >= 0 && sqpoll && sqpoll_fd < 0)
+	{
+		sqpoll_fd = ring->fd;
+	}
+	pthread_mutex_unlock(&sqpoll_lock);
+
+	if (ring->fd < 0)
+	{
+		return -1;
+	}
+
+	ring->entries = p.sq_entries;
+	ring->sqpoll = sqpoll;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else
+	{
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+		{
+			munmap(ring->sq_ptr, ring->sq_size);
+			close(ring->fd);
+			return -1;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+	{
+		if (ring->cq_ptr != ring->sq_ptr)
+			munmap(ring->cq_ptr, ring->cq_size);
+		munmap(ring->sq_ptr, ring->sq_size);
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_flags = (unsigned *)((char *)ring->sq_ptr + p.sq_off.flags);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+	return 0;
+}
+
+int uring_register_buffer(uring_t *ring, void *buf, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+
+	return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned index;
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_tail - head >= ring->entries)
+	{
+		return NULL;
+	}
+
+	index = ring->sqe_tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+
+	return sqe;
+}
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, off_t offset, unsigned long long user_data)
+{
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = 0;
+	sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int sockfd, const void *buf, unsigned len, int flags, unsigned long long user_data)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sockfd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->user_data = user_data;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr)
+{
+	unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	if (ring->sqpoll)
+	{
+		// the kernel thread picks up new entries by itself unless it went idle
+		unsigned flags = 0;
+		if (__atomic_load_n(ring->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		if (wait_nr > 0)
+			flags |= IORING_ENTER_GETEVENTS;
+		if (flags == 0)
+			return to_submit;
+		return _uring_enter(ring, 0, wait_nr, flags);
+	}
+
+	if (to_submit == 0 && wait_nr == 0)
+	{
+		return 0;
+	}
+
+	return _uring_enter(ring, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+struct io_uring_cqe *uring_wait_cqe(uring_t *ring)
+{
+	// with a polling kernel thread the completion usually shows up shortly,
+	// spin for it before paying for a syscall
+	int spins = ring->sqpoll ? URING_SPINS : 0;
+
+	while (1)
+	{
+		unsigned head = *ring->cq_head;
+
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			return &ring->cqes[head & *ring->cq_mask];
+		}
+
+		if (spins-- > 0)
+		{
+			__builtin_ia32_pause();
+			continue;
+		}
+
+		if (_uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+		{
+			return NULL;
+		}
+	}
+}
+
+void uring_cqe_seen(uring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_destroy(uring_t *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
@@ -0,0 +1,68 @@
+// Minimal io_uring wrapper used by simplecached and the proxy
+//
+// Talks to the kernel through the raw syscalls so no liburing is needed.
+// A ring is not thread safe, each thread keeps its own.
+//
+#ifndef __URING_IO_H__
+#define __URING_IO_H__
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// size of the staging buffers batched reads and sends go through
+#define URING_BATCH_SIZE (256 * 1024)
+
+typedef struct uring_t
+{
+	int fd;
+	unsigned entries;
+	int sqpoll;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	unsigned sqe_tail; // sqes handed out but not yet published
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+} uring_t;
+
+// io_uring_enter calls made by all rings, the cost metric for this backend
+extern unsigned long uring_nenters;
+
+// returns -1 when io_uring is unavailable so callers can fall back to
+// plain syscalls; rings created with sqpoll share one kernel polling thread
+int uring_init(uring_t *ring, unsigned entries, int sqpoll);
+
+// registers buf as fixed buffer 0 for uring_prep_read_fixed
+int uring_register_buffer(uring_t *ring, void *buf, size_t len);
+
+// returns NULL when the submission queue is full
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, off_t offset, unsigned long long user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int sockfd, const void *buf, unsigned len, int flags, unsigned long long user_data);
+
+// publishes all prepared sqes and waits for at least wait_nr completions
+int uring_submit(uring_t *ring, unsigned wait_nr);
+
+// blocks until a completion is available
+struct io_uring_cqe *uring_wait_cqe(uring_t *ring);
+
+// marks the completion returned by uring_wait_cqe as consumed
+void uring_cqe_seen(uring_t *ring);
+
+void uring_destroy(uring_t *ring);
+
+#endif // __URING_IO_H__
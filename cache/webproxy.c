@@ -11,9 +11,13 @@
 #include <limits.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <sys/wait.h>
 // headers would go here
 #include "cache-student.h"
+#include "shm_channel.h"
 #include "gfserver.h"
+#include "../server/gfserver_epoll.h"
+#include "uring_io.h"
 
 // note that the -n and -z parameters are NOT used for Part 1 */
 // they are only used for Part 2 */
@@ -26,6 +30,16 @@
   "  -s [server]         The server to connect to (Default: GitHub test data)\n" \
   "  -t [thread_count]   Num worker threads (Default: 35 Range: 418)\n"          \
   "  -z [segment_size]   The segment size (in bytes, Default: 5712).\n"          \
+  "  -u [uring_mode]     Socket sends: 0 send, 1 io_uring, 2 sq polling\n"      \
+  "  -P [proc_count]     Fork proc_count proxies sharing port and segments\n"   \
+  "                      (Default is 0, serve from this process)\n"            \
+  "  -c [max_active]     With -P, segments one client may hold at once\n"      \
+  "                      (Default is 0, no limit)\n"                          \
+  "  -r [rate]           With -P, requests per second one client may make\n"   \
+  "                      (Default is 0, no limit)\n"                          \
+  "  -M [min_threads]    With -P, keep min_threads workers per proxy while\n" \
+  "                      idle and start up to thread_count under load\n"     \
+  "                      (Default is thread_count)\n"                       \
   "  -h                  Show this help message\n"
 
 // Options
@@ -35,6 +49,11 @@ static struct option gLongOptions[] = {
     {"listen-port", required_argument, NULL, 'p'},
     {"thread-count", required_argument, NULL, 't'},
     {"segment-size", required_argument, NULL, 'z'},
+    {"uring", required_argument, NULL, 'u'},
+    {"processes", required_argument, NULL, 'P'},
+    {"client-max-active", required_argument, NULL, 'c'},
+    {"client-rate", required_argument, NULL, 'r'},
+    {"min-threads", required_argument, NULL, 'M'},
     {"help", no_argument, NULL, 'h'},
 
     {"hidden", no_argument, NULL, 'i'}, // server side
@@ -42,59 +61,212 @@ static struct option gLongOptions[] = {
 
 // gfs
 static gfserver_t gfs;
+// forked proxies each run an epoll engine on a SO_REUSEPORT socket
+static gfserver_epoll_t gfs_epoll;
+static int nprocs = 0;
+static int client_max_active = 0;
+static int client_rate = 0;
+static int min_threads = 0;
+static int proxy_index = -1;
+static pid_t *proxies;
 // handles cache
 extern ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void *arg);
+extern void handle_with_cache_init(int nworkerthreads);
 
-// segment queue
-pthread_cond_t seg_cond = PTHREAD_COND_INITIALIZER;
-pthread_cond_t seg_cleanup_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t seg_mutex = PTHREAD_MUTEX_INITIALIZER;
-steque_t *seg_queue;
+// segment pool
+seg_pool_t *seg_pool;
+slab_t seg_slab;
 unsigned int nsegments;
-int exit_flag = 0;
+volatile int exit_flag = 0;
+int uring_mode = 0;
+extern unsigned long nbytes_forwarded;
+extern unsigned long nspilled;
+extern unsigned long ncancelled;
+extern unsigned long nunavailable;
+extern int nsegs_held;
 
 mqd_t mqdes;
 
+// how long shutdown waits for segments still in use
+#define SEG_CLEANUP_MS 5000
+// segments taken back from a proxy that exited
+static void **reclaimed;
+
+// the cache may still be working on a dead proxy's segments, their
+// requests are cancelled before the segments are used again
+static int _reclaim_segments(pid_t pid)
+{
+  int n = seg_pool_reclaim(seg_pool, pid, reclaimed);
+
+  for (int i = 0; i < n; i++)
+  {
+    seg_info *seg = reclaimed[i];
+    ((response_info *)seg->seg)->cancel = 1;
+    seg_pool_put(seg_pool, seg);
+  }
+
+  return n;
+}
+
 static void _sig_handler(int signo)
 {
   if (signo == SIGTERM || signo == SIGINT)
   {
     // cleanup could go here
     unsigned int unlinked_seg = 0;
+    if (exit_flag)
+    {
+      return;
+    }
     exit_flag = 1;
-  	while (unlinked_seg < nsegments)
+
+    if (proxy_index >= 0)
     {
-      seg_info *seg;
+      // forked proxy, hand the segments back and let the parent unlink them
+      gfserver_epoll_stop(&gfs_epoll);
+      while (nsegs_held > 0)
+      {
+        usleep(1000);
+      }
+      printf("proxy %d io_uring: %lu enters for %lu bytes sent\n", proxy_index, uring_nenters, nbytes_forwarded);
+      printf("proxy %d: %lu segments returned before their client had the file\n", proxy_index, nspilled);
+      printf("proxy %d: %lu requests cancelled, %lu while the cache was down\n", proxy_index, ncancelled, nunavailable);
+      if (client_rate > 0)
+        printf("proxy %d: %lu requests over their client's rate\n", proxy_index, gfs_epoll.nthrottled);
+      if (min_threads > 0)
+        printf("proxy %d: %d workers, at most %d, %lu started under load (%lu for slow waits), %lu exited idle\n",
+               proxy_index, gfs_epoll.nworkers, gfs_epoll.nworkers_peak, gfs_epoll.ngrown, gfs_epoll.ngrown_wait,
+               gfs_epoll.nshrunk);
+      exit(0);
+    }
 
-      pthread_mutex_lock(&seg_mutex);
-      while (steque_isempty(seg_queue))
+    for (int i = 0; i < nprocs; i++)
+    {
+      kill(proxies[i], SIGTERM);
+    }
+    for (int i = 0; i < nprocs; i++)
+    {
+      waitpid(proxies[i], NULL, 0);
+      // a proxy killed outright never handed its segments back
+      _reclaim_segments(proxies[i]);
+    }
+
+    // semaphores are closed by the request that opened them
+    long long deadline = shm_now_ms() + SEG_CLEANUP_MS;
+  	while (unlinked_seg < nsegments)
+    {
+      seg_info *seg = seg_pool_timedget(seg_pool, deadline);
+      if (seg == NULL)
       {
-        pthread_cond_wait(&seg_cleanup_cond, &seg_mutex);
+        printf("%u segments still in use, unlinking them by name\n", nsegments - unlinked_seg);
+        break;
       }
-      seg = steque_pop(seg_queue);
       printf("acquire segments cleanup\n");
-      pthread_mutex_unlock(&seg_mutex);
 
       munmap(seg->seg,seg->segsize);
       shm_unlink(seg->seg_name);
-      sem_close(seg->sem1);
-      sem_close(seg->sem2);
       sem_unlink(seg->sem1_name);
-      sem_unlink(seg->sem1_name);
-      free(seg);
+      sem_unlink(seg->sem2_name);
+      slab_free(&seg_slab, seg);
 
       unlinked_seg += 1;
 
     }
+    if (unlinked_seg < nsegments)
+    {
+      for (int i = 0; i < nsegments; i++)
+      {
+        char name[16];
+        snprintf(name, sizeof(name), "/seg%d", i);
+        shm_unlink(name);
+        snprintf(name, sizeof(name), "/sem1%d", i);
+        sem_unlink(name);
+        snprintf(name, sizeof(name), "/sem2%d", i);
+        sem_unlink(name);
+      }
+    }
     
     printf("unlinked segs : %i\n", unlinked_seg);
+    printf("heap allocations: %lu steque nodes, %lu slabs\n", steque_nallocs, slab_nallocs);
+    printf("io_uring: %lu enters for %lu bytes sent\n", uring_nenters, nbytes_forwarded);
+    printf("spill: %lu segments returned before their client had the file\n", nspilled);
+    printf("cancelled: %lu requests, %lu while the cache was down\n", ncancelled, nunavailable);
 
-    gfserver_stop(&gfs);
-    steque_destroy(seg_queue);
+    if (nprocs == 0)
+    {
+      gfserver_stop(&gfs);
+    }
+    seg_pool_destroy(seg_pool);
+    slab_destroy(&seg_slab);
     exit(signo);
   }
 }
 
+static void *_serve_proxy(void *arg)
+{
+  gfserver_epoll_serve(&gfs_epoll);
+  return NULL;
+}
+
+// runs in a forked proxy and never returns
+static void _run_proxy(unsigned short port, unsigned short nworkerthreads, int nloops)
+{
+  gfserver_epoll_init(&gfs_epoll, nworkerthreads);
+  gfserver_epoll_setopt(&gfs_epoll, GFS_PORT, port);
+  gfserver_epoll_setopt(&gfs_epoll, GFS_WORKER_FUNC, handle_with_cache);
+  gfserver_epoll_setopt(&gfs_epoll, GFS_MAXNPENDING, 187);
+  gfserver_epoll_setopt(&gfs_epoll, GFS_NLOOPS, nloops);
+  gfserver_epoll_setopt(&gfs_epoll, GFS_REUSEPORT, 1);
+  // a worker holds a segment for the whole request
+  gfserver_epoll_setopt(&gfs_epoll, GFS_CLIENT_MAX_ACTIVE, client_max_active);
+  gfserver_epoll_setopt(&gfs_epoll, GFS_CLIENT_RATE, client_rate);
+  if (min_threads > 0)
+    gfserver_epoll_setopt(&gfs_epoll, GFS_MIN_THREADS, min_threads);
+  for (int i = 0; i < nworkerthreads; i++)
+  {
+    gfserver_epoll_setopt(&gfs_epoll, GFS_WORKER_ARG, i, "data");
+  }
+
+  // serve from threads that block the signals, so the handler always runs
+  // here and never on a worker that still holds a segment
+  sigset_t mask;
+  pthread_t server_thread;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  if (pthread_create(&server_thread, NULL, _serve_proxy, NULL) != 0)
+  {
+    fprintf(stderr, "Can't create server thread\n");
+    exit(1);
+  }
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+
+  // the signal handler exits once the segments are drained
+  while (1)
+  {
+    pause();
+  }
+}
+
+static pid_t _fork_proxy(int index, unsigned short port, unsigned short nworkerthreads, int nloops)
+{
+  pid_t pid = fork();
+
+  if (pid < 0)
+  {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0)
+  {
+    proxy_index = index;
+    _run_proxy(port, nworkerthreads, nloops);
+  }
+
+  return pid;
+}
+
 int main(int argc, char **argv)
 {
   int option_char = 0;
@@ -119,8 +291,11 @@ int main(int argc, char **argv)
     exit(SERVER_FAILURE);
   }
 
+  // gfserver pads a cancelled response with zeros to a client that is gone
+  signal(SIGPIPE, SIG_IGN);
+
   // Parse and set command line arguments */
-  while ((option_char = getopt_long(argc, argv, "s:qht:xn:p:lz:", gLongOptions, NULL)) != -1)
+  while ((option_char = getopt_long(argc, argv, "s:qht:xn:p:lz:u:P:c:r:M:", gLongOptions, NULL)) != -1)
   {
     switch (option_char)
     {
@@ -146,6 +321,21 @@ int main(int argc, char **argv)
     case 't': // thread-count
       nworkerthreads = atoi(optarg);
       break;
+    case 'u': // io_uring backend
+      uring_mode = atoi(optarg);
+      break;
+    case 'P': // proxy processes
+      nprocs = atoi(optarg);
+      break;
+    case 'c': // segments per client
+      client_max_active = atoi(optarg);
+      break;
+    case 'r': // requests per second per client
+      client_rate = atoi(optarg);
+      break;
+    case 'M': // idle worker pool size
+      min_threads = atoi(optarg);
+      break;
     case 'i':
     // do not modify
     case 'O':
@@ -169,6 +359,30 @@ int main(int argc, char **argv)
     exit(__LINE__);
   }
 
+  if (uring_mode < 0 || uring_mode > 2)
+  {
+    fprintf(stderr, "Invalid io_uring mode\n");
+    exit(__LINE__);
+  }
+
+  if (nprocs < 0 || nprocs > 64)
+  {
+    fprintf(stderr, "Invalid number of proxy processes\n");
+    exit(__LINE__);
+  }
+
+  if (client_max_active < 0 || client_rate < 0 || ((client_max_active > 0 || client_rate > 0) && nprocs == 0))
+  {
+    fprintf(stderr, "Invalid per client limits, requires -P\n");
+    exit(__LINE__);
+  }
+
+  if (min_threads < 0 || min_threads > nworkerthreads || (min_threads > 0 && nprocs == 0))
+  {
+    fprintf(stderr, "Invalid minimum number of worker threads, requires -P\n");
+    exit(__LINE__);
+  }
+
   if (port > 65331)
   {
     fprintf(stderr, "Invalid port number\n");
@@ -185,18 +399,19 @@ int main(int argc, char **argv)
     exit(__LINE__);
   }
 
-  // initialize segment queue
-  seg_queue = malloc(sizeof(steque_t));
-  steque_init(seg_queue);
+  // initialize segment pool, segments are recycled through it without allocating
+  seg_pool = seg_pool_create(nsegments);
+  slab_init(&seg_slab, sizeof(seg_info), nsegments, nsegments);
+  handle_with_cache_init(nworkerthreads);
 
 
   // Initialize shared memory set-up here
   for (int i = 0; i < nsegments; i++)
   {
-    struct seg_info *seg_info = malloc(sizeof(struct seg_info));
-    char segname[10];
+    struct seg_info *seg_info = slab_alloc(&seg_slab);
+    char segname[16];
 
-    sprintf(segname, "/seg%d", i);
+    snprintf(segname, sizeof(segname), "/seg%d", i);
 
     // create segment
     int fd = shm_open(segname, O_CREAT | O_RDWR | O_TRUNC, 0666);
@@ -213,8 +428,8 @@ int main(int argc, char **argv)
       exit(1);
     }
 
-    // map segment
-    void *seg = mmap(NULL, segsize, PROT_READ, MAP_SHARED, fd, 0);
+    // map segment, the proxy writes the request id, deadline and cancel flag
+    void *seg = mmap(NULL, segsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
     if (seg == MAP_FAILED)
     {
@@ -223,16 +438,56 @@ int main(int argc, char **argv)
     }
 
     // create semaphores
-    sprintf(seg_info->sem1_name, "/sem1%d", i);
-    sprintf(seg_info->sem2_name, "/sem2%d", i);
+    snprintf(seg_info->sem1_name, sizeof(seg_info->sem1_name), "/sem1%d", i);
+    snprintf(seg_info->sem2_name, sizeof(seg_info->sem2_name), "/sem2%d", i);
+    // a proxy that died mid-request may have left them posted
+    sem_unlink(seg_info->sem1_name);
+    sem_unlink(seg_info->sem2_name);
 
     // initialize segment info
     seg_info->seg = seg;
     strcpy(seg_info->seg_name, segname);
     seg_info->segsize = segsize;
 
-    // add to queue
-    steque_enqueue(seg_queue, seg_info);
+    // add to pool
+    seg_pool_put(seg_pool, seg_info);
+  }
+
+  if (nprocs > 0)
+  {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nloops = ncpus / nprocs > 0 ? ncpus / nprocs : 1;
+
+    // segments, semaphores and the pool are set up, the proxies inherit them
+    proxies = malloc(nprocs * sizeof(pid_t));
+    reclaimed = malloc(nsegments * sizeof(void *));
+    for (int i = 0; i < nprocs; i++)
+    {
+      proxies[i] = _fork_proxy(i, port, nworkerthreads, nloops);
+    }
+
+    // the parent replaces proxies that die until it is told to clean up
+    while (1)
+    {
+      int status;
+      pid_t pid = waitpid(-1, &status, 0);
+
+      if (pid < 0)
+      {
+        pause();
+        continue;
+      }
+      for (int i = 0; i < nprocs; i++)
+      {
+        if (proxies[i] == pid)
+        {
+          printf("proxy %d exited with status %d, %d segments reclaimed\n", i, status, _reclaim_segments(pid));
+          // one that crashes right away is not restarted in a tight loop
+          sleep(1);
+          proxies[i] = _fork_proxy(i, port, nworkerthreads, nloops);
+        }
+      }
+    }
   }
 
   /*
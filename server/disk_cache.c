@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "disk_cache.h"
+
+#define DISK_CACHE_BUCKETS 4096
+#define DISK_CACHE_NAME_MAX 255
+#define DISK_CACHE_TMP_PREFIX ".tmp."
+#define DISK_CACHE_XATTR_ETAG "user.etag"
+#define DISK_CACHE_XATTR_LAST_MODIFIED "user.last_modified"
+
+struct disk_entry_t
+{
+	char *key;
+	size_t size;
+	time_t mtime;             // only used to order the index at startup
+	int refreshing;
+	disk_entry_t *hnext;
+	disk_entry_t *prev;
+	disk_entry_t *next;
+};
+
+static unsigned long tmp_counter = 0;
+
+static size_t _hash(const char *key)
+{
+	size_t h = 5381;
+
+	while (*key)
+	{
+		h = h * 33 + (unsigned char)*key++;
+	}
+
+	return h;
+}
+
+// request paths become flat file names, '.' is escaped at the start so
+// objects never clash with temporary files
+static int _escape(const char *key, char *name, size_t len)
+{
+	size_t n = 0;
+
+	for (const char *p = key; *p; p++)
+	{
+		if (*p == '/' || *p == '%' || (p == key && *p == '.'))
+		{
+			if (n + 3 >= len)
+				return -1;
+			n += sprintf(name + n, "%%%02X", (unsigned char)*p);
+		}
+		else
+		{
+			if (n + 1 >= len)
+				return -1;
+			name[n++] = *p;
+		}
+	}
+	name[n] = '\0';
+
+	return 0;
+}
+
+static void _unescape(const char *name, char *key)
+{
+	unsigned int c;
+
+	while (*name)
+	{
+		if (name[0] == '%' && sscanf(name + 1, "%2X", &c) == 1)
+		{
+			*key++ = (char)c;
+			name += 3;
+		}
+		else
+		{
+			*key++ = *name++;
+		}
+	}
+	*key = '\0';
+}
+
+static int _object_path(disk_cache_t *cache, const char *key, char *path, size_t len)
+{
+	char name[DISK_CACHE_NAME_MAX + 1];
+
+	if (_escape(key, name, sizeof(name)) < 0)
+	{
+		return -1;
+	}
+
+	return snprintf(path, len, "%s/%s", cache->dir, name) < len ? 0 : -1;
+}
+
+static disk_entry_t *_find(disk_cache_t *cache, const char *key)
+{
+	disk_entry_t *e = cache->buckets[_hash(key) % cache->nbuckets];
+
+	while (e != NULL && strcmp(e->key, key) != 0)
+	{
+		e = e->hnext;
+	}
+
+	return e;
+}
+
+static void _lru_unlink(disk_cache_t *cache, disk_entry_t *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->lru_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void _lru_push(disk_cache_t *cache, disk_entry_t *e)
+{
+	e->prev = NULL;
+	e->next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->prev = e;
+	else
+		cache->lru_tail = e;
+	cache->lru_head = e;
+}
+
+static void _insert(disk_cache_t *cache, disk_entry_t *e)
+{
+	size_t b = _hash(e->key) % cache->nbuckets;
+
+	e->hnext = cache->buckets[b];
+	cache->buckets[b] = e;
+	_lru_push(cache, e);
+	cache->cur_bytes += e->size;
+}
+
+static void _remove(disk_cache_t *cache, disk_entry_t *e)
+{
+	disk_entry_t **pp = &cache->buckets[_hash(e->key) % cache->nbuckets];
+	char path[512];
+
+	while (*pp != e)
+	{
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+	_lru_unlink(cache, e);
+	cache->cur_bytes -= e->size;
+
+	// readers that already opened the object keep their descriptor
+	if (_object_path(cache, e->key, path, sizeof(path)) == 0)
+	{
+		unlink(path);
+	}
+	free(e->key);
+	free(e);
+}
+
+static void _evict(disk_cache_t *cache)
+{
+	while (cache->cur_bytes > cache->max_bytes && cache->lru_tail != NULL)
+	{
+		_remove(cache, cache->lru_tail);
+	}
+}
+
+static int _by_mtime(const void *a, const void *b)
+{
+	time_t ta = (*(disk_entry_t **)a)->mtime;
+	time_t tb = (*(disk_entry_t **)b)->mtime;
+
+	return (ta > tb) - (ta < tb);
+}
+
+void disk_cache_init(disk_cache_t *cache, const char *dir, size_t max_bytes)
+{
+	DIR *d;
+	struct dirent *ent;
+	disk_entry_t **found = NULL;
+	size_t nfound = 0;
+	size_t cap = 0;
+
+	memset(cache, 0, sizeof(*cache));
+	snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+	cache->max_bytes = max_bytes;
+	cache->nbuckets = DISK_CACHE_BUCKETS;
+	cache->buckets = calloc(cache->nbuckets, sizeof(disk_entry_t *));
+	pthread_mutex_init(&cache->lock, NULL);
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+	{
+		perror("mkdir");
+		exit(1);
+	}
+
+	if ((d = opendir(dir)) == NULL || (cache->dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+	{
+		perror("opendir");
+		exit(1);
+	}
+
+	// one readdir pass plus an fstatat per object, no file is read
+	while ((ent = readdir(d)) != NULL)
+	{
+		struct stat st;
+		disk_entry_t *e;
+
+		if (strncmp(ent->d_name, DISK_CACHE_TMP_PREFIX, strlen(DISK_CACHE_TMP_PREFIX)) == 0)
+		{
+			// left behind by an interrupted write
+			unlinkat(dirfd(d), ent->d_name, 0);
+			continue;
+		}
+		if (ent->d_name[0] == '.' || fstatat(dirfd(d), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+		{
+			continue;
+		}
+
+		e = calloc(1, sizeof(disk_entry_t));
+		e->key = malloc(strlen(ent->d_name) + 1);
+		_unescape(ent->d_name, e->key);
+		e->size = st.st_size;
+		e->mtime = st.st_mtime;
+
+		if (nfound == cap)
+		{
+			cap = cap ? cap * 2 : 256;
+			found = realloc(found, cap * sizeof(disk_entry_t *));
+		}
+		found[nfound++] = e;
+	}
+	closedir(d);
+
+	// oldest first, so the newest objects end up at the head of the LRU
+	qsort(found, nfound, sizeof(disk_entry_t *), _by_mtime);
+	for (size_t i = 0; i < nfound; i++)
+	{
+		_insert(cache, found[i]);
+	}
+	free(found);
+	_evict(cache);
+
+	printf("disk cache %s: %zu objects, %zu bytes\n", cache->dir, nfound, cache->cur_bytes);
+}
+
+int disk_cache_open(disk_cache_t *cache, const char *key)
+{
+	disk_entry_t *e;
+	char path[512];
+	int fd = -1;
+
+	pthread_mutex_lock(&cache->lock);
+	if ((e = _find(cache, key)) != NULL && _object_path(cache, key, path, sizeof(path)) == 0)
+	{
+		// opened under the lock so eviction cannot unlink it in between
+		if ((fd = open(path, O_RDONLY)) < 0)
+		{
+			_remove(cache, e);
+		}
+		else
+		{
+			_lru_unlink(cache, e);
+			_lru_push(cache, e);
+		}
+	}
+	if (fd >= 0)
+		cache->nhits++;
+	else
+		cache->nmisses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	return fd;
+}
+
+int disk_cache_begin(disk_cache_t *cache, const char *key, char *tmppath)
+{
+	char path[512];
+	int fd;
+
+	if (_object_path(cache, key, path, sizeof(path)) < 0)
+	{
+		return -1;
+	}
+
+	snprintf(tmppath, 512, "%s/" DISK_CACHE_TMP_PREFIX "%d.%lu", cache->dir, (int)getpid(),
+			 __sync_fetch_and_add(&tmp_counter, 1));
+	if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+	{
+		perror("disk_cache_begin");
+	}
+
+	return fd;
+}
+
+void disk_cache_commit(disk_cache_t *cache, const char *key, int fd, const char *tmppath, size_t size)
+{
+	disk_entry_t *e;
+	char path[512];
+
+	if (size > cache->max_bytes || _object_path(cache, key, path, sizeof(path)) < 0)
+	{
+		unlink(tmppath);
+		return;
+	}
+
+	// the data has to be on disk before the name points at it
+	if (fsync(fd) < 0)
+	{
+		perror("fsync");
+		unlink(tmppath);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (rename(tmppath, path) < 0)
+	{
+		perror("rename");
+		unlink(tmppath);
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	// a concurrent miss for the same key may have committed first
+	if ((e = _find(cache, key)) != NULL)
+	{
+		cache->cur_bytes -= e->size;
+		e->size = size;
+		cache->cur_bytes += size;
+		_lru_unlink(cache, e);
+		_lru_push(cache, e);
+	}
+	else
+	{
+		e = calloc(1, sizeof(disk_entry_t));
+		e->key = strdup(key);
+		e->size = size;
+		_insert(cache, e);
+	}
+	_evict(cache);
+	pthread_mutex_unlock(&cache->lock);
+
+	// and the rename has to be on disk before the object counts as cached
+	fsync(cache->dir_fd);
+}
+
+void disk_cache_abort(disk_cache_t *cache, const char *tmppath)
+{
+	unlink(tmppath);
+}
+
+disk_fresh_t disk_cache_freshness(disk_cache_t *cache, int fd)
+{
+	struct stat st;
+	time_t age;
+
+	if (cache->fresh_secs <= 0 || fstat(fd, &st) < 0)
+	{
+		return DISK_FRESH;
+	}
+
+	age = time(NULL) - st.st_mtime;
+	if (age <= cache->fresh_secs)
+		return DISK_FRESH;
+	if (age <= cache->fresh_secs + cache->max_stale_secs)
+		return DISK_STALE;
+	return DISK_EXPIRED;
+}
+
+int disk_cache_claim(disk_cache_t *cache, const char *key)
+{
+	disk_entry_t *e;
+	int claimed = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	if ((e = _find(cache, key)) != NULL && !e->refreshing)
+	{
+		e->refreshing = 1;
+		cache->nrefreshes++;
+		claimed = 1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return claimed;
+}
+
+void disk_cache_release(disk_cache_t *cache, const char *key)
+{
+	disk_entry_t *e;
+
+	pthread_mutex_lock(&cache->lock);
+	if ((e = _find(cache, key)) != NULL)
+	{
+		e->refreshing = 0;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void disk_cache_touch(disk_cache_t *cache, const char *key)
+{
+	disk_entry_t *e;
+	char path[512];
+
+	// revalidation follows a hit, the object was just used
+	pthread_mutex_lock(&cache->lock);
+	if ((e = _find(cache, key)) != NULL)
+	{
+		_lru_unlink(cache, e);
+		_lru_push(cache, e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (_object_path(cache, key, path, sizeof(path)) == 0 && utimensat(AT_FDCWD, path, NULL, 0) == 0)
+	{
+		__sync_fetch_and_add(&cache->nrevalidated, 1);
+	}
+}
+
+void disk_cache_remove(disk_cache_t *cache, const char *key)
+{
+	disk_entry_t *e;
+
+	pthread_mutex_lock(&cache->lock);
+	if ((e = _find(cache, key)) != NULL)
+	{
+		_remove(cache, e);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void _get_xattr(int fd, const char *name, char *value, size_t len)
+{
+	ssize_t n = fgetxattr(fd, name, value, len - 1);
+
+	value[n > 0 ? n : 0] = '\0';
+}
+
+void disk_cache_get_validators(int fd, char *etag, size_t etag_len, char *last_modified, size_t last_modified_len)
+{
+	_get_xattr(fd, DISK_CACHE_XATTR_ETAG, etag, etag_len);
+	_get_xattr(fd, DISK_CACHE_XATTR_LAST_MODIFIED, last_modified, last_modified_len);
+}
+
+// without xattr support objects are simply refetched in full
+void disk_cache_set_validators(int fd, const char *etag, const char *last_modified)
+{
+	if (etag[0] != '\0')
+		fsetxattr(fd, DISK_CACHE_XATTR_ETAG, etag, strlen(etag), 0);
+	if (last_modified[0] != '\0')
+		fsetxattr(fd, DISK_CACHE_XATTR_LAST_MODIFIED, last_modified, strlen(last_modified), 0);
+}
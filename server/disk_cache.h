@@ -0,0 +1,83 @@
+#ifndef __DISK_CACHE_H__
+#define __DISK_CACHE_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Size bounded on-disk cache of origin objects, evicted in LRU order.
+ *
+ * Every object is one file in dir named after its escaped request path,
+ * so the index can be rebuilt from a directory scan at startup.  Objects
+ * are written to a temporary file first, synced and renamed into place, a
+ * crash never leaves a partial object behind.
+ *
+ * An object's mtime is the last time the origin confirmed it, its ETag and
+ * Last-Modified validators are kept in extended attributes of the file.
+ */
+
+typedef struct disk_entry_t disk_entry_t;
+
+typedef enum
+{
+	DISK_FRESH,               // serve as is
+	DISK_STALE,               // serve, but refresh in the background
+	DISK_EXPIRED              // revalidate before serving
+} disk_fresh_t;
+
+typedef struct disk_cache_t
+{
+	char dir[256];
+	int dir_fd;               // synced after renames into dir
+	size_t max_bytes;
+	size_t cur_bytes;
+	unsigned long nhits;
+	unsigned long nmisses;
+
+	long fresh_secs;          // 0 if objects never go stale
+	long max_stale_secs;      // how long past fresh_secs an object is still served
+	unsigned long nrefreshes; // background refreshes started
+	unsigned long nrevalidated; // objects the origin answered with 304
+
+	pthread_mutex_t lock;
+	disk_entry_t **buckets;
+	size_t nbuckets;
+	disk_entry_t *lru_head;   // most recently used
+	disk_entry_t *lru_tail;
+} disk_cache_t;
+
+// creates dir if needed and indexes the objects already in it
+void disk_cache_init(disk_cache_t *cache, const char *dir, size_t max_bytes);
+
+// returns an open descriptor for a cached object or -1 on a miss
+int disk_cache_open(disk_cache_t *cache, const char *key);
+
+// creates a temporary file for key, tmppath must hold 512 bytes;
+// returns -1 when key cannot be cached
+int disk_cache_begin(disk_cache_t *cache, const char *key, char *tmppath);
+
+// syncs a completely written temporary file, fd is the descriptor
+// disk_cache_begin returned, and moves it into the cache
+void disk_cache_commit(disk_cache_t *cache, const char *key, int fd, const char *tmppath, size_t size);
+
+void disk_cache_abort(disk_cache_t *cache, const char *tmppath);
+
+// classifies an object opened with disk_cache_open by its age
+disk_fresh_t disk_cache_freshness(disk_cache_t *cache, int fd);
+
+// returns 1 if the caller should refresh key, only one refresh per object
+// runs at a time; disk_cache_release ends it
+int disk_cache_claim(disk_cache_t *cache, const char *key);
+void disk_cache_release(disk_cache_t *cache, const char *key);
+
+// the origin confirmed the cached copy, it is fresh and recently used again
+void disk_cache_touch(disk_cache_t *cache, const char *key);
+
+// the origin no longer has the object
+void disk_cache_remove(disk_cache_t *cache, const char *key);
+
+// validators are empty strings when the origin sent none
+void disk_cache_get_validators(int fd, char *etag, size_t etag_len, char *last_modified, size_t last_modified_len);
+void disk_cache_set_validators(int fd, const char *etag, const char *last_modified);
+
+#endif // __DISK_CACHE_H__
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flight.h"
+#include "gfserver_send.h"
+
+struct flight_t
+{
+	char *key;
+	flight_t *hnext;
+	int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	int header;               // the leader has sent its header
+	int done;
+	int shared;               // 0 if followers fetch on their own
+	gfstatus_t status;
+	size_t file_len;
+	char **chunks;
+	size_t nchunks;
+	size_t len;               // body bytes published
+};
+
+static size_t _hash(const char *key)
+{
+	size_t h = 5381;
+
+	while (*key)
+	{
+		h = h * 33 + (unsigned char)*key++;
+	}
+
+	return h % FLIGHT_BUCKETS;
+}
+
+void flight_table_init(flight_table_t *table)
+{
+	memset(table, 0, sizeof(*table));
+	pthread_mutex_init(&table->lock, NULL);
+}
+
+flight_t *flight_join(flight_table_t *table, const char *key, int *leader)
+{
+	flight_t **bucket = &table->buckets[_hash(key)];
+	flight_t *f;
+
+	pthread_mutex_lock(&table->lock);
+	for (f = *bucket; f != NULL; f = f->hnext)
+	{
+		if (strcmp(f->key, key) == 0)
+			break;
+	}
+
+	// the leader's reference keeps a linked flight alive
+	if (f != NULL)
+	{
+		__sync_fetch_and_add(&f->refs, 1);
+		table->nfollowers++;
+		*leader = 0;
+	}
+	else
+	{
+		f = calloc(1, sizeof(flight_t));
+		f->key = strdup(key);
+		f->refs = 1;
+		f->shared = 1;
+		pthread_mutex_init(&f->lock, NULL);
+		pthread_cond_init(&f->cond, NULL);
+		f->hnext = *bucket;
+		*bucket = f;
+		table->nleaders++;
+		*leader = 1;
+	}
+	pthread_mutex_unlock(&table->lock);
+
+	return f;
+}
+
+void flight_header(flight_t *f, gfstatus_t status, size_t len)
+{
+	pthread_mutex_lock(&f->lock);
+	f->header = 1;
+	f->status = status;
+	f->file_len = len;
+	if (len > FLIGHT_MAX_BYTES)
+	{
+		f->shared = 0;
+	}
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+void flight_append(flight_t *f, const void *data, size_t len)
+{
+	const char *p = data;
+
+	pthread_mutex_lock(&f->lock);
+	while (f->shared && len > 0)
+	{
+		size_t off = f->len % FLIGHT_CHUNK;
+		size_t n = FLIGHT_CHUNK - off < len ? FLIGHT_CHUNK - off : len;
+
+		// chunks never move once allocated, only the array of them does
+		if (off == 0)
+		{
+			f->chunks = realloc(f->chunks, (f->nchunks + 1) * sizeof(char *));
+			f->chunks[f->nchunks++] = malloc(FLIGHT_CHUNK);
+		}
+		memcpy(f->chunks[f->nchunks - 1] + off, p, n);
+		f->len += n;
+		p += n;
+		len -= n;
+	}
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+int flight_nfollowers(flight_t *f)
+{
+	return __sync_fetch_and_add(&f->refs, 0) - 1;
+}
+
+void flight_finish(flight_table_t *table, flight_t *f)
+{
+	flight_t **pp = &table->buckets[_hash(f->key)];
+
+	pthread_mutex_lock(&table->lock);
+	while (*pp != f)
+	{
+		pp = &(*pp)->hnext;
+	}
+	*pp = f->hnext;
+	pthread_mutex_unlock(&table->lock);
+
+	pthread_mutex_lock(&f->lock);
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+ssize_t flight_follow(flight_t *f, gfcontext_t *ctx)
+{
+	gfs_zerocopy_t zc;
+	size_t sent = 0;
+	int header = 0;
+
+	pthread_mutex_lock(&f->lock);
+	while (!f->header && !f->done)
+	{
+		pthread_cond_wait(&f->cond, &f->lock);
+	}
+	if (!f->header)
+	{
+		pthread_mutex_unlock(&f->lock);
+		return SERVER_FAILURE;
+	}
+	if (!f->shared)
+	{
+		pthread_mutex_unlock(&f->lock);
+		return FLIGHT_FETCH;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	// the header goes out with the first chunk, the chunks stay put so the
+	// rest is sent without a copy
+	gfs_zerocopy_init(&zc, ctx);
+	while (1)
+	{
+		struct iovec iov = {NULL, 0};
+
+		pthread_mutex_lock(&f->lock);
+		while (f->status == GF_OK && sent == f->len && !f->done)
+		{
+			pthread_cond_wait(&f->cond, &f->lock);
+		}
+		if (f->status == GF_OK && sent < f->len)
+		{
+			iov.iov_base = f->chunks[sent / FLIGHT_CHUNK] + sent % FLIGHT_CHUNK;
+			iov.iov_len = FLIGHT_CHUNK - sent % FLIGHT_CHUNK;
+			if (iov.iov_len > f->len - sent)
+				iov.iov_len = f->len - sent;
+		}
+		pthread_mutex_unlock(&f->lock);
+
+		if (!header)
+		{
+			header = 1;
+			if (gfs_sendheaderv(ctx, f->status, f->file_len, &iov, iov.iov_len > 0) != iov.iov_len)
+				break;
+		}
+		else if (iov.iov_len == 0 || gfs_send_zerocopy(ctx, &zc, iov.iov_base, iov.iov_len) != iov.iov_len)
+		{
+			break;
+		}
+		if (iov.iov_len == 0)
+			break;
+		sent += iov.iov_len;
+	}
+	gfs_zerocopy_reap(&zc, 1);
+
+	return ctx->bytes_transferred;
+}
+
+void flight_release(flight_t *f)
+{
+	if (__sync_sub_and_fetch(&f->refs, 1) > 0)
+	{
+		return;
+	}
+
+	for (size_t i = 0; i < f->nchunks; i++)
+	{
+		free(f->chunks[i]);
+	}
+	free(f->chunks);
+	free(f->key);
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
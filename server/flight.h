@@ -0,0 +1,59 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include "gfserver.h"
+
+/*
+ * Origin fetches in progress, so concurrent requests for the same path
+ * share one upstream transfer.  The first request for a path leads: it
+ * fetches the object as usual and publishes the Getfile header and every
+ * body byte it forwards to its client.  Later requests follow: they are
+ * sent everything published so far and then wait for more, until the
+ * leader finishes.  A fetch that fails fails for all of them.
+ *
+ * The body is kept in fixed chunks so followers can send from them without
+ * holding the lock, and stays until the last request leaves.  Objects over
+ * FLIGHT_MAX_BYTES are not shared, their followers fetch on their own.
+ */
+
+#define FLIGHT_BUCKETS 256
+#define FLIGHT_CHUNK (64 * 1024)
+#define FLIGHT_MAX_BYTES (64 << 20)
+
+// flight_follow result when the caller has to fetch the object itself
+#define FLIGHT_FETCH (-2)
+
+typedef struct flight_t flight_t;
+
+typedef struct flight_table_t
+{
+	pthread_mutex_t lock;
+	flight_t *buckets[FLIGHT_BUCKETS];
+	unsigned long nleaders;   // fetches made
+	unsigned long nfollowers; // requests that joined one
+} flight_table_t;
+
+void flight_table_init(flight_table_t *table);
+
+// returns the fetch of key in progress, or a new one if there is none; in
+// that case *leader is set and the caller has to fetch and publish
+flight_t *flight_join(flight_table_t *table, const char *key, int *leader);
+
+// leader side, the header exactly as sent to the leader's client
+void flight_header(flight_t *f, gfstatus_t status, size_t len);
+void flight_append(flight_t *f, const void *data, size_t len);
+// requests that share the fetch besides the leader
+int flight_nfollowers(flight_t *f);
+// no more data, new requests for the key start a fetch of their own
+void flight_finish(flight_table_t *table, flight_t *f);
+
+// follower side, sends the shared response to ctx as it arrives; returns
+// like a gfserver handler, or FLIGHT_FETCH if the object is not shared
+ssize_t flight_follow(flight_t *f, gfcontext_t *ctx);
+
+// both sides, the last one frees the fetch
+void flight_release(flight_t *f);
+
+#endif // __FLIGHT_H__
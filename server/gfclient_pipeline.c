@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define USAGE                                                                    \
+  "usage:\n"                                                                     \
+  "  gfclient_pipeline [options]\n"                                              \
+  "options:\n"                                                                   \
+  "  -s [server_addr]    Server address (Default: localhost)\n"                  \
+  "  -p [server_port]    Server port (Default: 16664)\n"                         \
+  "  -w [workload_path]  Path to workload file (Default: workload.txt)\n"        \
+  "  -t [nthreads]       Number of threads (Default 1)\n"                        \
+  "  -r [nrequests]      Requests per thread (Default 100)\n"                    \
+  "  -k [max_requests]   Send up to max_requests requests per connection with\n" \
+  "                      KEEPALIVE (Default 0, one per connection)\n"           \
+  "  -d [depth]          With -k, keep up to depth requests in flight\n"         \
+  "                      (Default 1)\n"                                          \
+  "  -h                  Show this help message\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+    {"server", required_argument, NULL, 's'},
+    {"port", required_argument, NULL, 'p'},
+    {"workload-path", required_argument, NULL, 'w'},
+    {"nthreads", required_argument, NULL, 't'},
+    {"nrequests", required_argument, NULL, 'r'},
+    {"keepalive-max", required_argument, NULL, 'k'},
+    {"depth", required_argument, NULL, 'd'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+#define MAX_PATHS 1024
+#define MAX_DEPTH 64
+// connections in a row closed before any response, then a thread gives up
+#define MAX_FAILED_CONNECTS 8
+
+static const char *server = "localhost";
+static unsigned short port = 16664;
+static int nrequests = 100;
+static int keepalive_max = 0;
+static int depth = 1;
+static char *paths[MAX_PATHS];
+static int npaths = 0;
+
+static unsigned long nok, nnotfound, nerrors, nconnects, nabandoned;
+static unsigned long long nbytes;
+
+static int _connect(void)
+{
+  struct addrinfo hints, *res;
+  char portstr[16];
+  int one = 1;
+  int fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(portstr, sizeof(portstr), "%u", port);
+  if (getaddrinfo(server, portstr, &hints, &res) != 0)
+  {
+    fprintf(stderr, "Can't resolve %s\n", server);
+    exit(1);
+  }
+  fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+  {
+    perror("connect");
+    exit(1);
+  }
+  freeaddrinfo(res);
+  // pipelined requests go out right away
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  __sync_fetch_and_add(&nconnects, 1);
+
+  return fd;
+}
+
+// buffered reader over one connection
+typedef struct reader_t
+{
+  int fd;
+  char buf[65536 + 1];
+  size_t off;
+  size_t len;
+} reader_t;
+
+static int _fill(reader_t *r)
+{
+  ssize_t n;
+
+  if (r->off > 0)
+  {
+    memmove(r->buf, r->buf + r->off, r->len - r->off);
+    r->len -= r->off;
+    r->off = 0;
+  }
+  while ((n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - 1 - r->len, 0)) < 0 && errno == EINTR)
+    ;
+  if (n <= 0)
+    return -1;
+  r->len += n;
+
+  return 0;
+}
+
+// reads one response, returns -1 when the connection ended before it
+static int _response(reader_t *r)
+{
+  char status[32];
+  size_t len;
+  int hlen;
+
+  // GETFILE OK <len> <body>, GETFILE FILE_NOT_FOUND 0\n or GETFILE ERROR 0\n,
+  // complete once the byte after the length has arrived
+  while (1)
+  {
+    r->buf[r->len] = '\0';
+    if (sscanf(r->buf + r->off, "GETFILE %31s %zu%n", status, &len, &hlen) == 2 && r->off + hlen < r->len)
+      break;
+    if (_fill(r) < 0)
+      return -1;
+  }
+  r->off += hlen + 1;
+
+  if (strcmp(status, "OK") != 0)
+  {
+    __sync_fetch_and_add(strcmp(status, "FILE_NOT_FOUND") == 0 ? &nnotfound : &nerrors, 1);
+    return 0;
+  }
+
+  while (len > 0)
+  {
+    size_t n;
+
+    if (r->off == r->len && _fill(r) < 0)
+      return -1;
+    n = r->len - r->off < len ? r->len - r->off : len;
+    r->off += n;
+    len -= n;
+    __sync_fetch_and_add(&nbytes, n);
+  }
+  __sync_fetch_and_add(&nok, 1);
+
+  return 0;
+}
+
+static void _request(int fd, const char *path, int keepalive)
+{
+  char line[512];
+  int len = snprintf(line, sizeof(line), "GETFILE GET %s%s\r\n\r\n", path, keepalive ? " KEEPALIVE" : "");
+
+  // a server closing at its request cap fails the requests sent ahead,
+  // they are sent again on the next connection
+  send(fd, line, len, MSG_NOSIGNAL);
+}
+
+static void *_thread_main(void *arg)
+{
+  long index = (long)arg;
+  reader_t *r = malloc(sizeof(reader_t));
+  int done = 0;
+  int failed = 0;
+
+  while (done < nrequests)
+  {
+    int per_conn = keepalive_max > 0 ? keepalive_max : 1;
+    int sent = 0, answered = 0;
+
+    if (per_conn > nrequests - done)
+      per_conn = nrequests - done;
+    r->fd = _connect();
+    r->off = r->len = 0;
+
+    // the last request of a connection goes without KEEPALIVE, so the
+    // server closes it; requests left unanswered are sent again
+    while (answered < per_conn)
+    {
+      while (sent < per_conn && sent - answered < depth)
+      {
+        _request(r->fd, paths[(index + done + sent) % npaths], keepalive_max > 0 && sent < per_conn - 1);
+        sent++;
+      }
+      if (_response(r) < 0)
+        break;
+      answered++;
+    }
+    close(r->fd);
+    done += answered;
+
+    // back off while the server drops connections, stop if it keeps on
+    if (answered > 0)
+    {
+      failed = 0;
+    }
+    else if (++failed == MAX_FAILED_CONNECTS)
+    {
+      fprintf(stderr, "thread %ld: %d connections closed without a response, giving up\n", index, failed);
+      __sync_fetch_and_add(&nabandoned, nrequests - done);
+      break;
+    }
+    else
+    {
+      usleep(1000 << failed);
+    }
+  }
+  free(r);
+
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  const char *workload_path = "workload.txt";
+  int nthreads = 1;
+  int option_char;
+  char line[512];
+  FILE *f;
+  pthread_t *threads;
+  struct timespec start, end;
+  double secs;
+
+  while ((option_char = getopt_long(argc, argv, "s:p:w:t:r:k:d:h", gLongOptions, NULL)) != -1)
+  {
+    switch (option_char)
+    {
+    case 's':
+      server = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'w':
+      workload_path = optarg;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'r':
+      nrequests = atoi(optarg);
+      break;
+    case 'k':
+      keepalive_max = atoi(optarg);
+      break;
+    case 'd':
+      depth = atoi(optarg);
+      break;
+    case 'h':
+      fprintf(stdout, "%s", USAGE);
+      exit(0);
+    default:
+      fprintf(stderr, "%s", USAGE);
+      exit(1);
+    }
+  }
+
+  if (nthreads < 1 || nrequests < 1 || keepalive_max < 0 || depth < 1 || depth > MAX_DEPTH)
+  {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  if ((f = fopen(workload_path, "r")) == NULL)
+  {
+    fprintf(stderr, "Unable to open workload file %s\n", workload_path);
+    exit(1);
+  }
+  while (npaths < MAX_PATHS && fgets(line, sizeof(line), f) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '/')
+      paths[npaths++] = strdup(line);
+  }
+  fclose(f);
+  if (npaths == 0)
+  {
+    fprintf(stderr, "Empty workload file %s\n", workload_path);
+    exit(1);
+  }
+
+  threads = malloc(nthreads * sizeof(pthread_t));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < nthreads; i++)
+  {
+    if (pthread_create(&threads[i], NULL, _thread_main, (void *)i) != 0)
+    {
+      fprintf(stderr, "Can't create thread %ld\n", i);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < nthreads; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%lu ok, %lu not found, %lu errors, %llu bytes over %lu connections\n", nok, nnotfound, nerrors, nbytes, nconnects);
+  if (nabandoned > 0)
+    printf("%lu requests abandoned\n", nabandoned);
+  printf("%.3f s, %.0f requests/s\n", secs, (nok + nnotfound + nerrors) / secs);
+
+  return 0;
+}
@@ -0,0 +1,1529 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+
+#include "gfserver_epoll.h"
+
+#define GFS_MAX_EVENTS 256
+#define GFS_HEADER_LEN 64
+// clients are hashed into this many flows per work queue, clients sharing
+// a flow share its fair share
+#define GFS_FLOWS 1024
+// bytes a flow may send per round robin turn
+#define GFS_FLOW_QUANTUM (64 * 1024)
+
+// same wire format as gfs_sendheader
+#define GFS_HEADER_OK "GETFILE OK %zu "
+#define GFS_HEADER_FILE_NOT_FOUND "GETFILE FILE_NOT_FOUND 0\n"
+#define GFS_HEADER_ERROR "GETFILE ERROR 0\n"
+
+// optional last word of a request line, the client wants to send more
+// requests over the same connection
+#define GFS_KEEPALIVE_TOKEN "KEEPALIVE"
+
+enum{
+	CONN_READING,
+	CONN_BLOCKING,
+	CONN_ASYNC
+};
+
+typedef struct gfs_conn_t{
+	gfcontext_t ctx;          // first so a gfcontext_t * is also a gfs_conn_t *
+	gfs_loop_t *loop;
+	int state;
+	size_t rlen;
+
+	char header[GFS_HEADER_LEN];
+	size_t header_len;
+	size_t header_off;
+
+	void *async_state;
+	int want_write;           // EPOLLOUT is armed
+	int blocked;              // last send hit a full socket
+	int waiting;              // handler returned GFS_ASYNC_WAIT
+	int woken;                // queued on loop->wake_queue
+	int wake_missed;          // woken while the handler was not waiting
+	int closed;               // client is gone
+	int registered;           // socket is in the loop's epoll set
+	int ready;                // queued on loop->ready_queue
+	int zombie;               // closed while still on the wake queue
+	int done;                 // handler finished, close once the header is out
+	long long queued_at;      // CLOCK_MONOTONIC ms, entered the work queue
+	unsigned long client;     // IPv4 address of the peer
+	struct gfs_flow_t *flow;  // NULL while not queued or running
+
+	int keepalive;            // read the next request after this response
+	int nrequests;
+	char rest[MAX_REQUEST_LEN]; // bytes read past the current request
+	size_t rest_len;
+	long long idle_since;     // CLOCK_MONOTONIC ms, on loop->idle list
+	struct gfs_conn_t *idle_prev;
+	struct gfs_conn_t *idle_next;
+} gfs_conn_t;
+
+// the requests of the clients hashed to one slot of a work queue
+typedef struct gfs_flow_t{
+	steque_t items;
+	int nrunning;             // taken by workers and not finished yet
+	long deficit;             // bytes it may still send this turn
+	int active;               // on the round robin list
+	struct gfs_flow_t *next;
+	double tokens;            // requests it may make right away
+	long long refilled_ms;
+} gfs_flow_t;
+
+struct gfs_queue_t{
+	gfs_flow_t *flows;
+	gfs_flow_t *rr_head;      // flows with requests waiting, served in
+	gfs_flow_t *rr_tail;      // deficit round robin order
+	int nitems;
+	steque_t throttled;       // over their client's rate, answered first
+	pthread_mutex_t lock;
+	pthread_cond_t inserted;  // on CLOCK_MONOTONIC
+
+	// worker pool, GFS_WORKER_ARG index i serves queue i % nqueues
+	gfserver_epoll_t *gfs;
+	int index;
+	int nworkers;
+	int nidle;                // waiting for a request
+	int min_workers;
+	int max_workers;
+
+	// CoDel state
+	long long above_until;    // waits above target since, until this time
+	int shedding;
+	unsigned shed_count;      // shed since shedding started
+	long long shed_next;      // when the next request is shed
+};
+
+struct gfs_loop_t{
+	gfserver_epoll_t *gfs;
+	int index;
+	int listen_fd;            // shared socket_fd unless reuseport is on
+	int epoll_fd;
+	int event_fd;
+	gfs_queue_t *queue;       // where blocking requests accepted here go
+	pthread_t thread;
+
+	pthread_mutex_t wake_lock;
+	steque_t wake_queue;      // filled by gfs_async_wake from any thread
+	steque_t returned;        // kept-alive connections back from the workers
+	steque_t ready_queue;     // connections to run again, loop thread only
+
+	gfs_conn_t *idle_head;    // kept-alive connections between requests,
+	gfs_conn_t *idle_tail;    // oldest first
+};
+
+void gfserver_epoll_init(gfserver_epoll_t *gfh, int nthreads)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	memset(gfh, 0, sizeof(*gfh));
+	gfh->port = 6200;
+	gfh->max_npending = 10;
+	gfh->nthreads = nthreads;
+	gfh->nloops = ncpus > 0 ? ncpus : 1;
+	gfh->socket_fd = -1;
+	gfh->keepalive_idle_ms = 5000;
+	gfh->queue_interval_ms = 100;
+	gfh->min_threads = nthreads;
+	gfh->thread_idle_ms = 5000;
+	gfh->thread_wait_ms = 50;
+	gfh->worker_args = calloc(nthreads, sizeof(void *));
+}
+
+void gfserver_epoll_setopt(gfserver_epoll_t *gfh, int option, ...)
+{
+	va_list ap;
+	int index;
+
+	va_start(ap, option);
+
+	switch (option)
+	{
+	case GFS_PORT:
+		gfh->port = (unsigned short)va_arg(ap, int);
+		break;
+	case GFS_MAXNPENDING:
+		gfh->max_npending = va_arg(ap, int);
+		break;
+	case GFS_WORKER_FUNC:
+		gfh->worker_func = va_arg(ap, ssize_t (*)(gfcontext_t *, const char *, void *));
+		break;
+	case GFS_WORKER_ARG:
+		index = va_arg(ap, int);
+		if (index >= 0 && index < gfh->nthreads)
+		{
+			gfh->worker_args[index] = va_arg(ap, void *);
+		}
+		break;
+	case GFS_ASYNC_WORKER_FUNC:
+		gfh->async_func = va_arg(ap, gfs_async_func_t);
+		break;
+	case GFS_NLOOPS:
+		gfh->nloops = va_arg(ap, int);
+		if (gfh->nloops < 1)
+		{
+			gfh->nloops = 1;
+		}
+		break;
+	case GFS_REUSEPORT:
+		gfh->reuseport = va_arg(ap, int);
+		break;
+	case GFS_KEEPALIVE_MAX:
+		gfh->keepalive_max = va_arg(ap, int);
+		break;
+	case GFS_KEEPALIVE_IDLE_MS:
+		gfh->keepalive_idle_ms = va_arg(ap, int);
+		break;
+	case GFS_QUEUE_TARGET_MS:
+		gfh->queue_target_ms = va_arg(ap, int);
+		break;
+	case GFS_QUEUE_INTERVAL_MS:
+		gfh->queue_interval_ms = va_arg(ap, int);
+		if (gfh->queue_interval_ms < 1)
+		{
+			gfh->queue_interval_ms = 1;
+		}
+		break;
+	case GFS_QUEUE_MAX_MS:
+		gfh->queue_max_ms = va_arg(ap, int);
+		break;
+	case GFS_CLIENT_MAX_ACTIVE:
+		gfh->client_max_active = va_arg(ap, int);
+		break;
+	case GFS_CLIENT_RATE:
+		gfh->client_rate = va_arg(ap, int);
+		break;
+	case GFS_CLIENT_BURST:
+		gfh->client_burst = va_arg(ap, int);
+		break;
+	case GFS_MIN_THREADS:
+		gfh->min_threads = va_arg(ap, int);
+		if (gfh->min_threads < 1 || gfh->min_threads > gfh->nthreads)
+		{
+			gfh->min_threads = gfh->nthreads;
+		}
+		break;
+	case GFS_THREAD_IDLE_MS:
+		gfh->thread_idle_ms = va_arg(ap, int);
+		if (gfh->thread_idle_ms < 1)
+		{
+			gfh->thread_idle_ms = 1;
+		}
+		break;
+	case GFS_THREAD_WAIT_MS:
+		gfh->thread_wait_ms = va_arg(ap, int);
+		break;
+	default:
+		fprintf(stderr, "gfserver_epoll_setopt: Invalid option\n");
+	}
+
+	va_end(ap);
+}
+
+static int _set_nonblocking(int fd, int on)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags < 0)
+	{
+		return -1;
+	}
+	flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static long long _now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void _idle_remove(gfs_conn_t *conn)
+{
+	gfs_loop_t *loop = conn->loop;
+
+	if (conn->idle_since == 0)
+	{
+		return;
+	}
+	if (conn->idle_prev != NULL)
+		conn->idle_prev->idle_next = conn->idle_next;
+	else
+		loop->idle_head = conn->idle_next;
+	if (conn->idle_next != NULL)
+		conn->idle_next->idle_prev = conn->idle_prev;
+	else
+		loop->idle_tail = conn->idle_prev;
+	conn->idle_prev = conn->idle_next = NULL;
+	conn->idle_since = 0;
+}
+
+// every connection waits equally long, so appending keeps the list sorted
+static void _idle_add(gfs_conn_t *conn)
+{
+	gfs_loop_t *loop = conn->loop;
+
+	conn->idle_since = _now_ms();
+	conn->idle_prev = loop->idle_tail;
+	conn->idle_next = NULL;
+	if (loop->idle_tail != NULL)
+		loop->idle_tail->idle_next = conn;
+	else
+		loop->idle_head = conn;
+	loop->idle_tail = conn;
+}
+
+static void _conn_close(gfs_conn_t *conn)
+{
+	gfs_loop_t *loop = conn->loop;
+	int zombie;
+
+	_idle_remove(conn);
+	if (conn->registered)
+	{
+		epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->ctx.socket, NULL);
+	}
+	close(conn->ctx.socket);
+
+	// a pending wake still references the connection, let the loop free it
+	pthread_mutex_lock(&loop->wake_lock);
+	zombie = conn->woken;
+	conn->zombie = zombie;
+	pthread_mutex_unlock(&loop->wake_lock);
+
+	if (!zombie)
+	{
+		free(conn);
+	}
+}
+
+static void _conn_events(gfs_conn_t *conn, uint32_t events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = conn;
+	epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_MOD, conn->ctx.socket, &ev);
+	conn->want_write = (events & EPOLLOUT) != 0;
+}
+
+// flags MSG_MORE when body bytes follow right away
+static int _flush_header(gfs_conn_t *conn, int flags)
+{
+	while (conn->header_off < conn->header_len)
+	{
+		ssize_t n = send(conn->ctx.socket, conn->header + conn->header_off,
+						 conn->header_len - conn->header_off, MSG_NOSIGNAL | flags);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				conn->blocked = 1;
+				return 0;
+			}
+			conn->closed = 1;
+			return -1;
+		}
+		conn->header_off += n;
+	}
+
+	return 0;
+}
+
+// the header is only queued here, it leaves with the first body bytes or
+// when the handler returns
+ssize_t gfs_async_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len)
+{
+	gfs_conn_t *conn = (gfs_conn_t *)ctx;
+	int len;
+
+	if (status == GF_OK)
+		len = snprintf(conn->header, GFS_HEADER_LEN, GFS_HEADER_OK, file_len);
+	else if (status == GF_FILE_NOT_FOUND)
+		len = snprintf(conn->header, GFS_HEADER_LEN, GFS_HEADER_FILE_NOT_FOUND);
+	else if (status == GF_ERROR)
+		len = snprintf(conn->header, GFS_HEADER_LEN, GFS_HEADER_ERROR);
+	else
+	{
+		fprintf(stderr, "gfs_async_sendheader: Invalid gfstatus argument\n");
+		return -1;
+	}
+
+	ctx->file_len = status == GF_OK ? file_len : 0;
+	ctx->bytes_transferred = 0;
+	conn->header_len = len;
+	conn->header_off = 0;
+
+	if (conn->closed)
+	{
+		return -1;
+	}
+
+	return len;
+}
+
+ssize_t gfs_async_send(gfcontext_t *ctx, const void *data, size_t size)
+{
+	gfs_conn_t *conn = (gfs_conn_t *)ctx;
+	size_t pending = conn->header_len - conn->header_off;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	if (conn->closed)
+	{
+		return -1;
+	}
+
+	// a pending header and the body share one system call and segment
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = conn->header + conn->header_off;
+	iov[0].iov_len = pending;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = size;
+	msg.msg_iov = pending > 0 ? iov : iov + 1;
+	msg.msg_iovlen = pending > 0 ? 2 : 1;
+
+	while ((n = sendmsg(ctx->socket, &msg, MSG_NOSIGNAL)) < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			conn->blocked = 1;
+			return 0;
+		}
+		conn->closed = 1;
+		return -1;
+	}
+
+	// body bytes may not overtake the header
+	if (n < pending)
+	{
+		conn->header_off += n;
+		conn->blocked = 1;
+		return 0;
+	}
+	conn->header_off = conn->header_len;
+	n -= pending;
+
+	if (n < size)
+	{
+		conn->blocked = 1;
+	}
+	ctx->bytes_transferred += n;
+
+	return n;
+}
+
+ssize_t gfs_async_sendfile(gfcontext_t *ctx, int fd, off_t *offset, size_t count)
+{
+	gfs_conn_t *conn = (gfs_conn_t *)ctx;
+	ssize_t n;
+
+	if (conn->closed || _flush_header(conn, count > 0 ? MSG_MORE : 0) < 0)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+
+	if (conn->header_off < conn->header_len)
+	{
+		return 0;
+	}
+
+	while ((n = sendfile(ctx->socket, fd, offset, count)) < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			conn->blocked = 1;
+			return 0;
+		}
+		// the caller falls back to reading the file itself
+		if (errno == EINVAL || errno == ENOSYS)
+			return -1;
+		conn->closed = 1;
+		return -1;
+	}
+
+	if (n == 0 && count > 0)
+	{
+		// the file is shorter than announced
+		errno = EIO;
+		return -1;
+	}
+	if (n < count)
+	{
+		conn->blocked = 1;
+	}
+	ctx->bytes_transferred += n;
+
+	return n;
+}
+
+void gfs_async_wake(gfcontext_t *ctx)
+{
+	gfs_conn_t *conn = (gfs_conn_t *)ctx;
+	gfs_loop_t *loop = conn->loop;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&loop->wake_lock);
+	if (!conn->woken)
+	{
+		conn->woken = 1;
+		steque_enqueue(&loop->wake_queue, conn);
+	}
+	pthread_mutex_unlock(&loop->wake_lock);
+
+	if (write(loop->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	{
+		perror("gfs_async_wake");
+	}
+}
+
+static void _conn_ready(gfs_conn_t *conn)
+{
+	if (!conn->ready)
+	{
+		conn->ready = 1;
+		steque_enqueue(&conn->loop->ready_queue, conn);
+	}
+}
+
+static void _conn_reuse(gfs_conn_t *conn);
+
+static void _conn_finish(gfs_conn_t *conn)
+{
+	// the header is small but may still be stuck behind a full socket
+	if (!conn->closed && conn->header_off < conn->header_len)
+	{
+		if (!conn->want_write)
+			_conn_events(conn, EPOLLOUT);
+		return;
+	}
+	// a short body leaves the client out of step, it has to reconnect
+	if (conn->keepalive && !conn->closed && conn->ctx.bytes_transferred == conn->ctx.file_len)
+	{
+		_conn_reuse(conn);
+		return;
+	}
+	_conn_close(conn);
+}
+
+static void _conn_run(gfs_conn_t *conn)
+{
+	gfserver_epoll_t *gfs = conn->loop->gfs;
+	void *arg = gfs->worker_args[conn->loop->index % gfs->nthreads];
+	gfs_async_t ret;
+
+	if (conn->done)
+	{
+		_conn_finish(conn);
+		return;
+	}
+
+	conn->blocked = 0;
+	conn->waiting = 0;
+	ret = gfs->async_func(&conn->ctx, conn->ctx.path, arg, &conn->async_state);
+
+	// a waiting handler's header goes out with its first body bytes
+	if (ret != GFS_ASYNC_WAIT && !conn->closed)
+	{
+		_flush_header(conn, 0);
+	}
+
+	switch (ret)
+	{
+	case GFS_ASYNC_WAIT:
+		if (conn->wake_missed)
+		{
+			conn->wake_missed = 0;
+			_conn_ready(conn);
+		}
+		else
+		{
+			conn->waiting = 1;
+			if (conn->want_write)
+				_conn_events(conn, 0);
+		}
+		return;
+	case GFS_ASYNC_WRITABLE:
+		if (conn->closed)
+		{
+			// let the handler observe the failed send and clean up
+			_conn_ready(conn);
+		}
+		else if (conn->blocked || conn->header_off < conn->header_len)
+		{
+			if (!conn->want_write)
+				_conn_events(conn, EPOLLOUT);
+		}
+		else
+		{
+			_conn_ready(conn);
+		}
+		return;
+	case GFS_ASYNC_ERROR:
+		if (conn->header_len == 0 && !conn->closed)
+		{
+			gfs_async_sendheader(&conn->ctx, GF_ERROR, 0);
+			_flush_header(conn, 0);
+		}
+		break;
+	case GFS_ASYNC_DONE:
+		break;
+	}
+
+	conn->done = 1;
+	conn->async_state = NULL;
+	_conn_finish(conn);
+}
+
+static void _conn_writable(gfs_conn_t *conn, uint32_t events)
+{
+	if (events & (EPOLLERR | EPOLLHUP))
+	{
+		conn->closed = 1;
+	}
+	else if (_flush_header(conn, 0) == 0 && conn->header_off < conn->header_len)
+	{
+		return;
+	}
+
+	if (conn->closed)
+	{
+		// hangups are reported regardless of the event mask, stop listening
+		epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->ctx.socket, NULL);
+		conn->registered = 0;
+		conn->want_write = 0;
+	}
+	else if (conn->want_write)
+	{
+		_conn_events(conn, 0);
+	}
+
+	// a waiting handler notices the hangup on its next send after a wake,
+	// a queued one runs from the ready queue anyway
+	if (conn->ready || (!conn->done && conn->waiting && !conn->closed))
+	{
+		return;
+	}
+	_conn_run(conn);
+}
+
+static int _parse_request(gfs_conn_t *conn)
+{
+	gfcontext_t *ctx = &conn->ctx;
+	char *str = ctx->request;
+	char *option;
+
+	ctx->protocol = strsep(&str, " \t\r\n");
+	if (ctx->protocol == NULL || strcmp(ctx->protocol, "GETFILE") != 0)
+	{
+		fprintf(stderr, "unsupported protocol: %s\n", ctx->protocol);
+		return -1;
+	}
+
+	ctx->method = strsep(&str, " \t\r\n");
+	if (ctx->method == NULL || strcasecmp(ctx->method, "GET") != 0)
+	{
+		fprintf(stderr, "unsupported request method: %s\n", ctx->method);
+		return -1;
+	}
+
+	ctx->path = strsep(&str, " \t\r\n");
+	if (ctx->path == NULL || ctx->path[0] != '/')
+	{
+		fprintf(stderr, "bad ctx: no leading slash on request URI: %s\n", ctx->path);
+		return -1;
+	}
+
+	// honoured until the connection reaches its request cap
+	option = strsep(&str, " \t\r\n");
+	conn->nrequests++;
+	conn->keepalive = option != NULL && strcmp(option, GFS_KEEPALIVE_TOKEN) == 0 &&
+					  conn->nrequests < conn->loop->gfs->keepalive_max;
+
+	// a body written after its header would wait for the client's delayed
+	// ACK, closing the connection no longer pushes it out
+	if (conn->keepalive && conn->nrequests == 1)
+	{
+		int one = 1;
+		setsockopt(ctx->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	return 0;
+}
+
+// called with the queue lock held
+static void _queue_push(gfserver_epoll_t *gfs, gfs_queue_t *queue, gfs_conn_t *conn)
+{
+	gfs_flow_t *flow = &queue->flows[(conn->client * 2654435761UL >> 7) % GFS_FLOWS];
+
+	// a client over its rate is told so instead of queuing work
+	if (gfs->client_rate > 0)
+	{
+		int burst = gfs->client_burst > 0 ? gfs->client_burst : gfs->client_rate;
+
+		flow->tokens += (conn->queued_at - flow->refilled_ms) * gfs->client_rate / 1000.0;
+		if (flow->refilled_ms == 0 || flow->tokens > burst)
+			flow->tokens = burst;
+		flow->refilled_ms = conn->queued_at;
+		if (flow->tokens < 1)
+		{
+			steque_enqueue(&queue->throttled, conn);
+			return;
+		}
+		flow->tokens -= 1;
+	}
+
+	conn->flow = flow;
+	steque_enqueue(&flow->items, conn);
+	queue->nitems++;
+	if (!flow->active)
+	{
+		flow->active = 1;
+		flow->deficit = 0;
+		flow->next = NULL;
+		if (queue->rr_tail != NULL)
+			queue->rr_tail->next = flow;
+		else
+			queue->rr_head = flow;
+		queue->rr_tail = flow;
+	}
+}
+
+static int _worker_spawn(gfs_queue_t *queue);
+
+static void _conn_dispatch(gfs_conn_t *conn)
+{
+	gfserver_epoll_t *gfs = conn->loop->gfs;
+	gfs_queue_t *queue;
+	gfs_conn_t *head;
+	int depth, peak, waiting;
+
+	if (gfs->async_func != NULL)
+	{
+		conn->state = CONN_ASYNC;
+		_conn_events(conn, 0);
+		_conn_run(conn);
+		return;
+	}
+
+	// blocking handlers get a plain blocking socket and a worker thread
+	epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->ctx.socket, NULL);
+	conn->registered = 0;
+	_set_nonblocking(conn->ctx.socket, 0);
+	conn->state = CONN_BLOCKING;
+
+	conn->queued_at = _now_ms();
+	queue = conn->loop->queue;
+	pthread_mutex_lock(&queue->lock);
+	_queue_push(gfs, queue, conn);
+	// every idle worker already has a request coming, or the idle ones do
+	// not get to the next request in line fast enough
+	head = queue->rr_head != NULL ? steque_front(&queue->rr_head->items) : NULL;
+	waiting = head != NULL && conn->queued_at - head->queued_at > gfs->thread_wait_ms;
+	if ((queue->nitems > queue->nidle || waiting) && queue->nworkers < queue->max_workers &&
+		_worker_spawn(queue) == 0)
+	{
+		__sync_fetch_and_add(&gfs->ngrown, 1);
+		if (queue->nitems <= queue->nidle)
+			__sync_fetch_and_add(&gfs->ngrown_wait, 1);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	pthread_cond_signal(&queue->inserted);
+
+	depth = __sync_add_and_fetch(&gfs->queue_depth, 1);
+	while (depth > (peak = gfs->queue_peak) && !__sync_bool_compare_and_swap(&gfs->queue_peak, peak, depth))
+		;
+}
+
+// handles the request in ctx.request once it is complete, bytes past it
+// belong to the next request of a pipelining client
+static void _conn_request(gfs_conn_t *conn)
+{
+	char *end = strstr(conn->ctx.request, "\r\n\r\n");
+
+	if (end == NULL)
+	{
+		if (conn->rlen == MAX_REQUEST_LEN - 1)
+		{
+			fprintf(stderr, "bad ctx: Unable to read path.\n");
+			_conn_close(conn);
+		}
+		return;
+	}
+
+	end += 4;
+	conn->rest_len = conn->ctx.request + conn->rlen - end;
+	memcpy(conn->rest, end, conn->rest_len);
+
+	if (_parse_request(conn) < 0)
+	{
+		_conn_close(conn);
+		return;
+	}
+
+	_conn_dispatch(conn);
+}
+
+// starts over with the next request on a kept-alive connection, on the
+// loop thread
+static void _conn_reuse(gfs_conn_t *conn)
+{
+	struct epoll_event ev;
+
+	memcpy(conn->ctx.request, conn->rest, conn->rest_len);
+	conn->rlen = conn->rest_len;
+	conn->ctx.request[conn->rlen] = '\0';
+	conn->rest_len = 0;
+	conn->ctx.protocol = conn->ctx.method = conn->ctx.path = NULL;
+	conn->ctx.file_len = 0;
+	conn->ctx.bytes_transferred = 0;
+	conn->ctx.thread = conn->loop->thread;
+	conn->state = CONN_READING;
+	conn->header_len = conn->header_off = 0;
+	conn->async_state = NULL;
+	conn->blocked = conn->waiting = conn->done = 0;
+	conn->keepalive = 0;
+
+	if (!conn->registered)
+	{
+		_set_nonblocking(conn->ctx.socket, 1);
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, conn->ctx.socket, &ev) < 0)
+		{
+			perror("epoll_ctl");
+			_conn_close(conn);
+			return;
+		}
+		conn->registered = 1;
+		conn->want_write = 0;
+	}
+	else
+	{
+		_conn_events(conn, EPOLLIN);
+	}
+
+	// the next request may have come along with the last one
+	if (strstr(conn->ctx.request, "\r\n\r\n") != NULL)
+	{
+		_conn_request(conn);
+		return;
+	}
+	_idle_add(conn);
+}
+
+static void _conn_read(gfs_conn_t *conn)
+{
+	ssize_t n;
+
+	n = recv(conn->ctx.socket, conn->ctx.request + conn->rlen, MAX_REQUEST_LEN - 1 - conn->rlen, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+		return;
+	}
+	if (n <= 0)
+	{
+		_conn_close(conn);
+		return;
+	}
+
+	conn->rlen += n;
+	conn->ctx.request[conn->rlen] = '\0';
+	_idle_remove(conn);
+
+	_conn_request(conn);
+}
+
+static void _loop_accept(gfs_loop_t *loop)
+{
+	while (1)
+	{
+		struct epoll_event ev;
+		struct sockaddr_in addr;
+		socklen_t addrlen = sizeof(addr);
+		gfs_conn_t *conn;
+		int fd = accept4(loop->listen_fd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK);
+
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !loop->gfs->stopping)
+				fprintf(stderr, "accept failed\n");
+			return;
+		}
+
+		conn = calloc(1, sizeof(gfs_conn_t));
+		conn->loop = loop;
+		conn->state = CONN_READING;
+		conn->ctx.socket = fd;
+		conn->client = ntohl(addr.sin_addr.s_addr);
+		conn->ctx.gfs = NULL;
+		conn->ctx.thread = loop->thread;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			perror("epoll_ctl");
+			close(fd);
+			free(conn);
+			continue;
+		}
+		conn->registered = 1;
+	}
+}
+
+static void _loop_wakeups(gfs_loop_t *loop)
+{
+	uint64_t count;
+
+	if (read(loop->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	{
+		perror("read");
+	}
+
+	pthread_mutex_lock(&loop->wake_lock);
+	while (!steque_isempty(&loop->returned))
+	{
+		gfs_conn_t *conn = steque_pop(&loop->returned);
+
+		pthread_mutex_unlock(&loop->wake_lock);
+		_conn_reuse(conn);
+		pthread_mutex_lock(&loop->wake_lock);
+	}
+	while (!steque_isempty(&loop->wake_queue))
+	{
+		gfs_conn_t *conn = steque_pop(&loop->wake_queue);
+		conn->woken = 0;
+		if (conn->zombie)
+		{
+			free(conn);
+		}
+		else if (conn->waiting)
+		{
+			conn->waiting = 0;
+			_conn_ready(conn);
+		}
+		else
+		{
+			conn->wake_missed = 1;
+		}
+	}
+	pthread_mutex_unlock(&loop->wake_lock);
+}
+
+static void *_loop_main(void *arg)
+{
+	gfs_loop_t *loop = arg;
+	struct epoll_event events[GFS_MAX_EVENTS];
+
+	while (!loop->gfs->stopping)
+	{
+		int timeout = steque_isempty(&loop->ready_queue) ? -1 : 0;
+		int n;
+
+		// kept-alive connections idle for too long are closed
+		if (loop->idle_head != NULL)
+		{
+			long long now = _now_ms();
+
+			while (loop->idle_head != NULL && now - loop->idle_head->idle_since >= loop->gfs->keepalive_idle_ms)
+			{
+				_conn_close(loop->idle_head);
+			}
+			if (loop->idle_head != NULL && timeout < 0)
+				timeout = loop->idle_head->idle_since + loop->gfs->keepalive_idle_ms - now;
+		}
+
+		n = epoll_wait(loop->epoll_fd, events, GFS_MAX_EVENTS, timeout);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			gfs_conn_t *conn = events[i].data.ptr;
+
+			if (conn == NULL)
+			{
+				_loop_accept(loop);
+			}
+			else if ((void *)conn == (void *)loop)
+			{
+				_loop_wakeups(loop);
+			}
+			else if (conn->state == CONN_READING)
+			{
+				_conn_read(conn);
+			}
+			else if (conn->state == CONN_ASYNC)
+			{
+				_conn_writable(conn, events[i].events);
+			}
+		}
+
+		// only run what was ready before this round, so a busy handler
+		// cannot starve the sockets
+		for (int i = steque_size(&loop->ready_queue); i > 0; i--)
+		{
+			gfs_conn_t *conn = steque_pop(&loop->ready_queue);
+			conn->ready = 0;
+			_conn_run(conn);
+		}
+	}
+
+	return NULL;
+}
+
+static unsigned _isqrt(unsigned long x)
+{
+	unsigned long r = x, y = (x + 1) / 2;
+
+	while (y < r)
+	{
+		r = y;
+		y = (r + x / r) / 2;
+	}
+
+	return r;
+}
+
+/*
+ * Called with the queue lock held for the request just taken off it
+ * after waiting waited_ms.  Returns 1 if it is to be answered with an
+ * error.  CoDel: waits above target for a whole interval start shedding,
+ * one request per interval / sqrt(requests shed so far), until a request
+ * waits less than target again.
+ */
+static int _queue_shed(gfserver_epoll_t *gfs, gfs_queue_t *queue, long long waited_ms, long long now)
+{
+	long long interval = gfs->queue_interval_ms;
+	int above;
+
+	if (gfs->queue_max_ms > 0 && waited_ms > gfs->queue_max_ms)
+	{
+		return 1;
+	}
+	if (gfs->queue_target_ms <= 0)
+	{
+		return 0;
+	}
+
+	// a queue about to run dry is no standing queue
+	if (waited_ms < gfs->queue_target_ms || queue->nitems == 0)
+	{
+		queue->above_until = 0;
+		above = 0;
+	}
+	else if (queue->above_until == 0)
+	{
+		queue->above_until = now + interval;
+		above = 0;
+	}
+	else
+	{
+		above = now >= queue->above_until;
+	}
+
+	if (queue->shedding)
+	{
+		if (!above)
+		{
+			queue->shedding = 0;
+			return 0;
+		}
+		if (now < queue->shed_next)
+		{
+			return 0;
+		}
+		queue->shed_count++;
+		queue->shed_next += interval * 1000 / _isqrt(queue->shed_count * 1000000UL);
+		return 1;
+	}
+	if (!above)
+	{
+		return 0;
+	}
+
+	// shedding again soon after it stopped picks up near the old rate
+	queue->shedding = 1;
+	queue->shed_count = queue->shed_count > 2 && now - queue->shed_next < 16 * interval ? queue->shed_count - 2 : 1;
+	queue->shed_next = now + interval * 1000 / _isqrt(queue->shed_count * 1000000UL);
+
+	return 1;
+}
+
+/*
+ * Called with the queue lock held, returns NULL if no flow may run a
+ * request now.  Deficit round robin: a flow whose turn comes gets
+ * GFS_FLOW_QUANTUM bytes of credit and runs a request if it has credit
+ * left, the bytes sent are charged once the request is done.  Flows at
+ * GFS_CLIENT_MAX_ACTIVE wait for one of their requests to finish.
+ */
+static gfs_conn_t *_queue_pop(gfserver_epoll_t *gfs, gfs_queue_t *queue)
+{
+	int nready = 0;
+	long best = LONG_MIN;
+	gfs_flow_t *flow;
+
+	if (!steque_isempty(&queue->throttled))
+	{
+		return steque_pop(&queue->throttled);
+	}
+
+	for (flow = queue->rr_head; flow != NULL; flow = flow->next)
+	{
+		if (gfs->client_max_active <= 0 || flow->nrunning < gfs->client_max_active)
+		{
+			nready++;
+			if (flow->deficit > best)
+				best = flow->deficit;
+		}
+	}
+	if (nready == 0)
+	{
+		return NULL;
+	}
+
+	// when every ready flow is in debt, hand out the rounds it takes the
+	// first of them to get credit back at once instead of one per pass
+	if (best <= 0)
+	{
+		long rounds = -best / GFS_FLOW_QUANTUM + 1;
+
+		for (flow = queue->rr_head; flow != NULL; flow = flow->next)
+		{
+			if (gfs->client_max_active <= 0 || flow->nrunning < gfs->client_max_active)
+				flow->deficit += rounds * GFS_FLOW_QUANTUM;
+		}
+	}
+
+	// a ready flow has credit now, so this ends within one pass
+	while (1)
+	{
+		gfs_conn_t *conn = NULL;
+
+		flow = queue->rr_head;
+		queue->rr_head = flow->next;
+		if (queue->rr_head == NULL)
+			queue->rr_tail = NULL;
+		flow->next = NULL;
+
+		if (gfs->client_max_active <= 0 || flow->nrunning < gfs->client_max_active)
+		{
+			if (flow->deficit <= 0)
+				flow->deficit += GFS_FLOW_QUANTUM;
+			else
+				conn = steque_pop(&flow->items);
+		}
+
+		// back to the end of the round, or off it once drained
+		if (steque_isempty(&flow->items))
+		{
+			flow->active = 0;
+		}
+		else
+		{
+			if (queue->rr_tail != NULL)
+				queue->rr_tail->next = flow;
+			else
+				queue->rr_head = flow;
+			queue->rr_tail = flow;
+		}
+
+		if (conn != NULL)
+		{
+			flow->nrunning++;
+			queue->nitems--;
+			return conn;
+		}
+	}
+}
+
+// called with the queue lock held once the handler for conn returned
+static void _queue_done(gfs_queue_t *queue, gfs_conn_t *conn)
+{
+	gfs_flow_t *flow = conn->flow;
+
+	conn->flow = NULL;
+	if (flow == NULL)
+	{
+		return;
+	}
+	flow->nrunning--;
+	// an idle flow starts its next turn afresh
+	if (flow->active)
+	{
+		flow->deficit -= conn->ctx.bytes_transferred + GFS_HEADER_LEN;
+	}
+}
+
+// called with the queue lock held, waits for a request; returns 0 once a
+// worker above the minimum should exit after idling GFS_THREAD_IDLE_MS
+static int _worker_wait(gfserver_epoll_t *gfs, gfs_queue_t *queue, long long *idle_since)
+{
+	struct timespec deadline;
+	long long now, left;
+
+	queue->nidle++;
+	if (queue->nworkers <= queue->min_workers)
+	{
+		*idle_since = 0;
+		pthread_cond_wait(&queue->inserted, &queue->lock);
+		queue->nidle--;
+		return 1;
+	}
+
+	now = _now_ms();
+	if (*idle_since == 0)
+		*idle_since = now;
+	if ((left = *idle_since + gfs->thread_idle_ms - now) <= 0)
+	{
+		queue->nidle--;
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += left / 1000;
+	deadline.tv_nsec += (left % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&queue->inserted, &queue->lock, &deadline);
+	queue->nidle--;
+
+	return 1;
+}
+
+static void *_worker_main(void *arg)
+{
+	gfs_queue_t *queue = arg;
+	gfserver_epoll_t *gfs = queue->gfs;
+	long long idle_since = 0;
+	int index;
+
+	// take a free argument slot of this queue, _worker_spawn made sure
+	// there is one
+	pthread_mutex_lock(&queue->lock);
+	for (index = queue->index; gfs->worker_slots[index]; index += gfs->nqueues)
+		;
+	gfs->worker_slots[index] = 1;
+	pthread_mutex_unlock(&queue->lock);
+
+	while (1)
+	{
+		gfs_conn_t *conn;
+		ssize_t ret;
+		long long now, waited;
+		int shed;
+
+		pthread_mutex_lock(&queue->lock);
+		while ((conn = _queue_pop(gfs, queue)) == NULL)
+		{
+			if (!_worker_wait(gfs, queue, &idle_since))
+			{
+				// idle long enough, the pool shrinks by this worker
+				gfs->worker_slots[index] = 0;
+				queue->nworkers--;
+				pthread_mutex_unlock(&queue->lock);
+				__sync_fetch_and_sub(&gfs->nworkers, 1);
+				__sync_fetch_and_add(&gfs->nshrunk, 1);
+				return NULL;
+			}
+		}
+		idle_since = 0;
+		now = _now_ms();
+		waited = now - conn->queued_at;
+		shed = conn->flow != NULL && _queue_shed(gfs, queue, waited, now);
+		pthread_mutex_unlock(&queue->lock);
+
+		__sync_fetch_and_sub(&gfs->queue_depth, 1);
+		__sync_fetch_and_add(&gfs->nqueued, 1);
+		__sync_fetch_and_add(&gfs->queue_ms, waited);
+
+		conn->ctx.thread = pthread_self();
+		// a shed request costs a header, not a handler run
+		if (conn->flow == NULL)
+		{
+			__sync_fetch_and_add(&gfs->nthrottled, 1);
+			gfs_sendheader(&conn->ctx, GF_ERROR, 0);
+		}
+		else if (shed)
+		{
+			__sync_fetch_and_add(&gfs->nshed, 1);
+			gfs_sendheader(&conn->ctx, GF_ERROR, 0);
+		}
+		else if ((ret = gfs->worker_func(&conn->ctx, conn->ctx.path, gfs->worker_args[index])) < 0)
+		{
+			gfs_sendheader(&conn->ctx, GF_ERROR, 0);
+		}
+
+		// keep the client in sync when the handler came up short
+		if (conn->ctx.bytes_transferred < conn->ctx.file_len)
+		{
+			char zeros[4096];
+			memset(zeros, 0, sizeof(zeros));
+			fprintf(stderr, "_close: seems that entire file was not sent.  Filling with zeros.\n");
+			while (conn->ctx.bytes_transferred < conn->ctx.file_len)
+			{
+				size_t len = conn->ctx.file_len - conn->ctx.bytes_transferred;
+				if (gfs_send(&conn->ctx, zeros, len < sizeof(zeros) ? len : sizeof(zeros)) <= 0)
+					break;
+			}
+		}
+
+		pthread_mutex_lock(&queue->lock);
+		_queue_done(queue, conn);
+		pthread_mutex_unlock(&queue->lock);
+		// a flow at its limit may run again
+		if (gfs->client_max_active > 0)
+		{
+			pthread_cond_signal(&queue->inserted);
+		}
+
+		// epoll and the idle list belong to the loop, it takes the
+		// connection back
+		if (conn->keepalive && conn->ctx.bytes_transferred == conn->ctx.file_len)
+		{
+			uint64_t one = 1;
+
+			pthread_mutex_lock(&conn->loop->wake_lock);
+			steque_enqueue(&conn->loop->returned, conn);
+			pthread_mutex_unlock(&conn->loop->wake_lock);
+			if (write(conn->loop->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+				perror("write");
+			continue;
+		}
+
+		_conn_close(conn);
+	}
+
+	return NULL;
+}
+
+// called with the queue lock held, starts one more worker for queue
+static int _worker_spawn(gfs_queue_t *queue)
+{
+	gfserver_epoll_t *gfs = queue->gfs;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int n, peak;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, _worker_main, queue) != 0)
+	{
+		pthread_attr_destroy(&attr);
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+
+	queue->nworkers++;
+	n = __sync_add_and_fetch(&gfs->nworkers, 1);
+	while (n > (peak = gfs->nworkers_peak) && !__sync_bool_compare_and_swap(&gfs->nworkers_peak, peak, n))
+		;
+
+	return 0;
+}
+
+static int _listen_socket(gfserver_epoll_t *gfh)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+	{
+		fprintf(stderr, "failed to create the listening socket\n");
+		exit(1);
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+	{
+		fprintf(stderr, "failed to set SO_REUSEADDR socket option (not fatal)\n");
+	}
+
+	if (gfh->reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+	{
+		fprintf(stderr, "failed to set SO_REUSEPORT socket option\n");
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(gfh->port);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "failed to bind; port = %d\n", gfh->port);
+		exit(1);
+	}
+
+	if (listen(fd, gfh->max_npending) < 0)
+	{
+		fprintf(stderr, "failed to listen\n");
+		exit(1);
+	}
+
+	return fd;
+}
+
+static void _loop_init(gfserver_epoll_t *gfs, gfs_loop_t *loop, int index)
+{
+	struct epoll_event ev;
+
+	loop->gfs = gfs;
+	loop->index = index;
+	loop->queue = &gfs->queues[index % gfs->nqueues];
+	pthread_mutex_init(&loop->wake_lock, NULL);
+	steque_init(&loop->wake_queue);
+	steque_init(&loop->returned);
+	steque_init(&loop->ready_queue);
+
+	if ((loop->epoll_fd = epoll_create1(0)) < 0 ||
+		(loop->event_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+	{
+		perror("epoll");
+		exit(1);
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = loop;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev);
+
+	if (gfs->reuseport)
+	{
+		// the kernel spreads connections over the loops' own sockets
+		loop->listen_fd = _listen_socket(gfs);
+		ev.events = EPOLLIN;
+	}
+	else
+	{
+		// every loop accepts, EPOLLEXCLUSIVE avoids waking all of them per connection
+		loop->listen_fd = gfs->socket_fd;
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	}
+	ev.data.ptr = NULL;
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev);
+}
+
+void gfserver_epoll_serve(gfserver_epoll_t *gfh)
+{
+	pthread_condattr_t cond_attr;
+
+	if (!gfh->reuseport)
+	{
+		gfh->socket_fd = _listen_socket(gfh);
+	}
+
+	// one work queue per loop with reuseport, but never more than workers
+	gfh->nqueues = gfh->reuseport ? (gfh->nloops < gfh->nthreads ? gfh->nloops : gfh->nthreads) : 1;
+	if (gfh->nqueues < 1)
+	{
+		gfh->nqueues = 1;
+	}
+	gfh->queues = calloc(gfh->nqueues, sizeof(gfs_queue_t));
+	for (int i = 0; i < gfh->nqueues; i++)
+	{
+		gfh->queues[i].flows = calloc(GFS_FLOWS, sizeof(gfs_flow_t));
+		for (int j = 0; j < GFS_FLOWS; j++)
+			steque_init(&gfh->queues[i].flows[j].items);
+		steque_init(&gfh->queues[i].throttled);
+		pthread_mutex_init(&gfh->queues[i].lock, NULL);
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&gfh->queues[i].inserted, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+
+		// queue i gets every nqueues-th worker, the minimum likewise
+		gfh->queues[i].gfs = gfh;
+		gfh->queues[i].index = i;
+		gfh->queues[i].max_workers = (gfh->nthreads - i + gfh->nqueues - 1) / gfh->nqueues;
+		gfh->queues[i].min_workers = (gfh->min_threads - i + gfh->nqueues - 1) / gfh->nqueues;
+	}
+
+	if (gfh->async_func == NULL && gfh->worker_func != NULL)
+	{
+		gfh->worker_slots = calloc(gfh->nthreads, 1);
+		for (int i = 0; i < gfh->nqueues; i++)
+		{
+			pthread_mutex_lock(&gfh->queues[i].lock);
+			while (gfh->queues[i].nworkers < gfh->queues[i].min_workers)
+			{
+				if (_worker_spawn(&gfh->queues[i]) < 0)
+				{
+					fprintf(stderr, "Can't create thread %d\n", gfh->nworkers);
+					exit(1);
+				}
+			}
+			pthread_mutex_unlock(&gfh->queues[i].lock);
+		}
+	}
+
+	gfh->loops = calloc(gfh->nloops, sizeof(gfs_loop_t));
+	for (int i = 0; i < gfh->nloops; i++)
+	{
+		_loop_init(gfh, &gfh->loops[i], i);
+	}
+
+	// loop 0 runs on the calling thread
+	gfh->loops[0].thread = pthread_self();
+	for (int i = 1; i < gfh->nloops; i++)
+	{
+		if (pthread_create(&gfh->loops[i].thread, NULL, _loop_main, &gfh->loops[i]) != 0)
+		{
+			fprintf(stderr, "Can't create event loop %d\n", i);
+			exit(1);
+		}
+	}
+
+	_loop_main(&gfh->loops[0]);
+}
+
+void gfserver_epoll_stop(gfserver_epoll_t *gfh)
+{
+	uint64_t one = 1;
+
+	gfh->stopping = 1;
+	if (gfh->socket_fd >= 0)
+	{
+		close(gfh->socket_fd);
+	}
+
+	for (int i = 0; gfh->loops != NULL && i < gfh->nloops; i++)
+	{
+		if (gfh->reuseport && gfh->loops[i].listen_fd >= 0)
+		{
+			close(gfh->loops[i].listen_fd);
+		}
+		if (write(gfh->loops[i].event_fd, &one, sizeof(one)) < 0)
+			continue;
+	}
+}
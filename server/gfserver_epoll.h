@@ -0,0 +1,233 @@
+#ifndef __GFSERVER_EPOLL_H__
+#define __GFSERVER_EPOLL_H__
+
+#include "gfserver.h"
+
+/*
+ * Event driven alternative to gfserver_t.  A few event loop threads own
+ * all sockets through epoll, so open connections do not pin threads.
+ *
+ * Handlers registered with GFS_WORKER_FUNC still work unchanged: once a
+ * request has been read they are run on a pool of nthreads worker threads
+ * and may use gfs_sendheader and gfs_send as usual.
+ *
+ * Handlers registered with GFS_ASYNC_WORKER_FUNC run on the event loop
+ * itself and must never block.  They write with gfs_async_sendheader and
+ * gfs_async_send and return to the loop whenever the socket is full or
+ * they are waiting for data produced elsewhere.
+ *
+ * With GFS_REUSEPORT every loop listens on its own SO_REUSEPORT socket
+ * and feeds its own work queue, so no lock is shared between loops.
+ * Separate processes may serve the same port this way as well.
+ *
+ * With GFS_KEEPALIVE_MAX a client may end a request line with KEEPALIVE,
+ *
+ *	GETFILE GET /path KEEPALIVE\r\n\r\n
+ *
+ * and the connection stays open for its next request once the response is
+ * complete.  Clients may pipeline: requests sent ahead are answered in
+ * order.  The server closes the connection after the request that reaches
+ * the cap, after a response that came up short, or when it was idle for
+ * GFS_KEEPALIVE_IDLE_MS; a client resends unanswered requests on a new
+ * connection.
+ *
+ * Requests for blocking handlers wait in a work queue.  With
+ * GFS_QUEUE_TARGET_MS the queue sheds load the way CoDel drops packets:
+ * once every request for a whole GFS_QUEUE_INTERVAL_MS has waited longer
+ * than the target, requests are answered with GETFILE ERROR instead of
+ * being handled, at a rate that rises until the waits are short again.
+ * GFS_QUEUE_MAX_MS answers every request that waited longer with an
+ * error, its client has likely given up on it.
+ *
+ * The work queue is fair between clients, told apart by IPv4 address: each
+ * has its own queue and workers take turns between them by deficit round
+ * robin, so a client sending large files or many requests at once only
+ * delays its own.  GFS_CLIENT_MAX_ACTIVE caps the workers one client may
+ * occupy, GFS_CLIENT_RATE answers requests beyond a client's rate with an
+ * error right away.
+ *
+ * The worker pool grows from GFS_MIN_THREADS up to nthreads while more
+ * requests wait than workers are idle, or while the next request in line
+ * has waited longer than GFS_THREAD_WAIT_MS, and a worker above the
+ * minimum exits once it found no work for GFS_THREAD_IDLE_MS.  Growing at once
+ * but shrinking only after a quiet spell keeps the pool from oscillating.
+ */
+
+typedef struct _gfserver_epoll_t gfserver_epoll_t;
+typedef struct gfs_loop_t gfs_loop_t;
+typedef struct gfs_queue_t gfs_queue_t;
+
+typedef enum{
+  GFS_ASYNC_DONE,     /* the whole response has been handed to gfs_async_send */
+  GFS_ASYNC_WRITABLE, /* call again once the socket accepts more data */
+  GFS_ASYNC_WAIT,     /* call again after gfs_async_wake has been called */
+  GFS_ASYNC_ERROR     /* abort, an error header is sent if none was sent yet */
+} gfs_async_t;
+
+/*
+ * The fourth argument points to a per-request slot, NULL on the first
+ * call, where the handler keeps its state between calls.  The handler
+ * owns that state and must release it before returning GFS_ASYNC_DONE
+ * or GFS_ASYNC_ERROR.
+ */
+typedef gfs_async_t (*gfs_async_func_t)(gfcontext_t *, const char *, void *, void **);
+
+typedef enum{
+  GFS_ASYNC_WORKER_FUNC = GFS_WORKER_ARG + 1,
+  GFS_NLOOPS,
+  GFS_REUSEPORT,
+  GFS_KEEPALIVE_MAX,
+  GFS_KEEPALIVE_IDLE_MS,
+  GFS_QUEUE_TARGET_MS,
+  GFS_QUEUE_INTERVAL_MS,
+  GFS_QUEUE_MAX_MS,
+  GFS_CLIENT_MAX_ACTIVE,
+  GFS_CLIENT_RATE,
+  GFS_CLIENT_BURST,
+  GFS_MIN_THREADS,
+  GFS_THREAD_IDLE_MS,
+  GFS_THREAD_WAIT_MS
+} gfserver_epoll_option_t;
+
+struct _gfserver_epoll_t{
+	unsigned short port;
+	int max_npending;
+	int nthreads;
+	int nloops;
+	int reuseport;
+	int keepalive_max;
+	int keepalive_idle_ms;
+	int queue_target_ms;
+	int queue_interval_ms;
+	int queue_max_ms;
+	int client_max_active;
+	int client_rate;
+	int client_burst;
+	int min_threads;
+	int thread_idle_ms;
+	int thread_wait_ms;
+	int socket_fd;
+	volatile int stopping;
+
+	ssize_t (*worker_func)(gfcontext_t *, const char *, void*);
+	gfs_async_func_t async_func;
+	void **worker_args;
+
+	gfs_loop_t *loops;
+	char *worker_slots;           // GFS_WORKER_ARG indices in use
+
+	gfs_queue_t *queues;
+	int nqueues;
+
+	// work queue statistics, over all queues
+	int queue_depth;              // requests waiting now
+	int queue_peak;
+	unsigned long nqueued;        // requests that went through a queue
+	unsigned long long queue_ms;  // time they waited in total
+	unsigned long nshed;          // answered with an error by the queue
+	unsigned long nthrottled;     // answered with an error, client over its rate
+
+	// worker pool statistics
+	int nworkers;                 // running now
+	int nworkers_peak;
+	unsigned long ngrown;         // workers started on demand
+	unsigned long ngrown_wait;    // of those, for a request waiting too long
+	unsigned long nshrunk;        // workers that exited, idle
+};
+
+/*
+ * Initializes the input gfserver_epoll_t object to use nthreads worker
+ * threads for blocking handlers and one event loop per online cpu.
+ */
+void gfserver_epoll_init(gfserver_epoll_t *gfh, int nthreads);
+
+/*
+ * Accepts every gfserver_option_t understood by gfserver_setopt and
+ * additionally:
+ *
+ * GFS_ASYNC_WORKER_FUNC	a gfs_async_func_t.  Takes precedence over
+ *						GFS_WORKER_FUNC.  The handler running on event
+ *						loop i receives the GFS_WORKER_ARG registered for
+ *						index i % nthreads.
+ *
+ * GFS_NLOOPS			int indicating the number of event loop threads.
+ *
+ * GFS_REUSEPORT		int, non-zero gives every event loop its own
+ *						listening socket and work queue.  Worker thread i
+ *						serves the queue of loop i % nloops.
+ *
+ * GFS_KEEPALIVE_MAX		int, requests a client may send over one
+ *						connection (Default 0, one request per connection).
+ *
+ * GFS_KEEPALIVE_IDLE_MS	int, how long a kept-alive connection may wait
+ *						for its next request (Default 5000).
+ *
+ * GFS_QUEUE_TARGET_MS	int, acceptable time for a request to wait for a
+ *						worker (Default 0, requests are never shed).
+ *
+ * GFS_QUEUE_INTERVAL_MS	int, how long waits may stay above the target
+ *						before shedding starts (Default 100).
+ *
+ * GFS_QUEUE_MAX_MS		int, requests that waited longer are shed in any
+ *						case (Default 0, no limit).
+ *
+ * GFS_CLIENT_MAX_ACTIVE	int, workers one client may occupy at once, its
+ *						other requests wait (Default 0, no limit).
+ *
+ * GFS_CLIENT_RATE		int, requests per second one client may make on
+ *						average (Default 0, no limit).
+ *
+ * GFS_CLIENT_BURST		int, requests one client may make at once above
+ *						its rate (Default GFS_CLIENT_RATE).
+ *
+ * GFS_MIN_THREADS		int, workers kept while idle, more are started
+ *						under load up to nthreads (Default nthreads).
+ *
+ * GFS_THREAD_IDLE_MS		int, how long a worker above the minimum waits
+ *						for work before it exits (Default 5000).
+ *
+ * GFS_THREAD_WAIT_MS		int, a request waiting this long starts another
+ *						worker even if some are idle (Default 50).
+ */
+void gfserver_epoll_setopt(gfserver_epoll_t *gfh, int option, ...);
+
+/*
+ * Starts the event loops, this function does not return until
+ * gfserver_epoll_stop is called.
+ */
+void gfserver_epoll_serve(gfserver_epoll_t *gfh);
+
+/*
+ * Stops accepting connections and wakes up the event loops.  Safe to
+ * call from a signal handler.
+ */
+void gfserver_epoll_stop(gfserver_epoll_t *gfh);
+
+/*
+ * Queues the Getfile header.  Only valid from within an async handler.
+ * Returns the header length or -1 for an invalid status.
+ */
+ssize_t gfs_async_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
+
+/*
+ * Writes up to size bytes without blocking.  Only valid from within an
+ * async handler.  Returns the number of bytes accepted, which is less
+ * than size once the socket is full, or -1 when the client is gone.
+ */
+ssize_t gfs_async_send(gfcontext_t *ctx, const void *data, size_t size);
+
+/*
+ * Like gfs_async_send, but sends up to count bytes of fd starting at
+ * *offset without copying them through user space and advances *offset.
+ * Fails with errno EINVAL or ENOSYS when fd does not support sendfile.
+ */
+ssize_t gfs_async_sendfile(gfcontext_t *ctx, int fd, off_t *offset, size_t count);
+
+/*
+ * Schedules the async handler of ctx to run again.  May be called from
+ * any thread, but only while the handler has not yet returned
+ * GFS_ASYNC_DONE or GFS_ASYNC_ERROR.
+ */
+void gfs_async_wake(gfcontext_t *ctx);
+
+#endif
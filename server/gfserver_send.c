@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+#include "gfserver_send.h"
+
+static __thread char *fallback_buf = NULL;
+// frees fallback_buf when a worker of a shrinking pool exits
+static pthread_key_t fallback_key;
+static pthread_once_t fallback_once = PTHREAD_ONCE_INIT;
+
+static void _fallback_key_init(void)
+{
+	pthread_key_create(&fallback_key, free);
+}
+
+static ssize_t _send_buffered(gfcontext_t *ctx, int fd, off_t offset, size_t len)
+{
+	size_t sent = 0;
+
+	if (fallback_buf == NULL)
+	{
+		if (posix_memalign((void **)&fallback_buf, 4096, GFS_SENDFILE_BUFSIZE) != 0)
+		{
+			fallback_buf = NULL;
+			return -1;
+		}
+		pthread_once(&fallback_once, _fallback_key_init);
+		pthread_setspecific(fallback_key, fallback_buf);
+	}
+
+	while (sent < len)
+	{
+		size_t want = len - sent < GFS_SENDFILE_BUFSIZE ? len - sent : GFS_SENDFILE_BUFSIZE;
+		ssize_t n = pread(fd, fallback_buf, want, offset + sent);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		if (gfs_send(ctx, fallback_buf, n) != n)
+			break;
+		sent += n;
+	}
+
+	return sent;
+}
+
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fd, off_t offset, size_t len)
+{
+	size_t sent = 0;
+
+	while (sent < len)
+	{
+		ssize_t n = sendfile(ctx->socket, fd, &offset, len - sent);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL || errno == ENOSYS)
+				return sent + _send_buffered(ctx, fd, offset, len - sent);
+			break;
+		}
+		if (n == 0)
+			break;
+
+		sent += n;
+		ctx->bytes_transferred += n;
+	}
+
+	return sent;
+}
+
+#define GFS_IOV_MAX 64
+#define GFS_HEADER_LEN 64
+// a client that stops reading must not keep zero-copy buffers forever
+#define GFS_ZEROCOPY_WAIT_MS 30000
+
+size_t gfs_zerocopy_min = 0;
+
+// sends all of iov, which it consumes; returns the bytes sent
+static size_t _sendv(gfcontext_t *ctx, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	size_t sent = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	while (iovcnt > 0)
+	{
+		ssize_t n;
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		if ((n = sendmsg(ctx->socket, &msg, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		sent += n;
+
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return sent;
+}
+
+ssize_t gfs_sendv(gfcontext_t *ctx, const struct iovec *iov, int iovcnt)
+{
+	struct iovec local[GFS_IOV_MAX];
+	size_t want = 0, sent = 0;
+
+	for (int i = 0; i < iovcnt; i += GFS_IOV_MAX)
+	{
+		int n = iovcnt - i < GFS_IOV_MAX ? iovcnt - i : GFS_IOV_MAX;
+		size_t len = 0;
+
+		for (int j = 0; j < n; j++)
+			len += iov[i + j].iov_len;
+		memcpy(local, iov + i, n * sizeof(struct iovec));
+		want += len;
+		sent += _sendv(ctx, local, n);
+		if (sent < want)
+			break;
+	}
+	ctx->bytes_transferred += sent;
+
+	return sent == 0 && want > 0 ? -1 : sent;
+}
+
+ssize_t gfs_trysend(gfcontext_t *ctx, const void *data, size_t len)
+{
+	ssize_t n;
+
+	while ((n = send(ctx->socket, data, len, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	if (n < 0)
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+	ctx->bytes_transferred += n;
+
+	return n;
+}
+
+ssize_t gfs_sendheaderv(gfcontext_t *ctx, gfstatus_t status, size_t file_len, const struct iovec *iov, int iovcnt)
+{
+	struct iovec local[GFS_IOV_MAX];
+	char header[GFS_HEADER_LEN];
+	size_t hlen, len = 0, sent;
+	int n = iovcnt < GFS_IOV_MAX - 1 ? iovcnt : GFS_IOV_MAX - 1;
+
+	// same wire format and bookkeeping as gfs_sendheader
+	if (status == GF_OK)
+		hlen = snprintf(header, sizeof(header), "GETFILE OK %zu ", file_len);
+	else if (status == GF_FILE_NOT_FOUND)
+		hlen = snprintf(header, sizeof(header), "GETFILE FILE_NOT_FOUND 0\n");
+	else if (status == GF_ERROR)
+		hlen = snprintf(header, sizeof(header), "GETFILE ERROR 0\n");
+	else
+	{
+		fprintf(stderr, "gfs_sendheaderv: Invalid gfstatus argument\n");
+		return -1;
+	}
+	ctx->file_len = file_len;
+	ctx->bytes_transferred = 0;
+
+	local[0].iov_base = header;
+	local[0].iov_len = hlen;
+	for (int i = 0; i < n; i++)
+	{
+		local[i + 1] = iov[i];
+		len += iov[i].iov_len;
+	}
+	if ((sent = _sendv(ctx, local, n + 1)) < hlen)
+	{
+		return -1;
+	}
+	ctx->bytes_transferred = sent - hlen;
+
+	if (sent - hlen == len && n < iovcnt)
+	{
+		ssize_t more = gfs_sendv(ctx, iov + n, iovcnt - n);
+		return more < 0 ? len : len + more;
+	}
+
+	return sent - hlen;
+}
+
+void gfs_cork(gfcontext_t *ctx, int on)
+{
+	setsockopt(ctx->socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+void gfs_zerocopy_init(gfs_zerocopy_t *zc, gfcontext_t *ctx)
+{
+	int one = 1;
+
+	zc->fd = ctx->socket;
+	zc->next = zc->done = 0;
+	zc->off = gfs_zerocopy_min == 0 || setsockopt(zc->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0;
+}
+
+ssize_t gfs_send_zerocopy(gfcontext_t *ctx, gfs_zerocopy_t *zc, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t sent = 0;
+
+	if (zc->off || len < gfs_zerocopy_min)
+	{
+		return gfs_send(ctx, (void *)data, len);
+	}
+
+	while (sent < len)
+	{
+		ssize_t n = send(zc->fd, p + sent, len - sent, MSG_ZEROCOPY | MSG_NOSIGNAL);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			// out of pinned memory, plain sends until completions come in
+			if (errno == ENOBUFS)
+			{
+				gfs_zerocopy_reap(zc, 0);
+				if ((n = gfs_send(ctx, (void *)(p + sent), len - sent)) < 0)
+					break;
+				sent += n;
+				return sent;
+			}
+			break;
+		}
+		// every call that sent something is one completion
+		zc->next++;
+		sent += n;
+		ctx->bytes_transferred += n;
+	}
+
+	return sent == 0 && len > 0 ? -1 : sent;
+}
+
+void gfs_zerocopy_reap(gfs_zerocopy_t *zc, int wait)
+{
+	int waited = 0;
+
+	while (zc->done != zc->next)
+	{
+		char control[128];
+		struct msghdr msg;
+		struct cmsghdr *cm;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE) < 0)
+		{
+			struct pollfd pfd = {zc->fd, 0, 0};
+
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN || !wait)
+				return;
+			// POLLERR is reported once the error queue has something
+			if (waited >= GFS_ZEROCOPY_WAIT_MS)
+			{
+				fprintf(stderr, "gfs_zerocopy_reap: client stopped reading\n");
+				shutdown(zc->fd, SHUT_RDWR);
+				return;
+			}
+			poll(&pfd, 1, 100);
+			waited += 100;
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+				continue;
+			// ee_info to ee_data is the range of sends released
+			zc->done += err->ee_data - err->ee_info + 1;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->off = 1;
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef __GFSERVER_SEND_H__
+#define __GFSERVER_SEND_H__
+
+#include <sys/uio.h>
+#include "gfserver.h"
+
+// size of the aligned fallback buffer used when sendfile is not supported
+#define GFS_SENDFILE_BUFSIZE (1 << 20)
+
+/*
+ * Sends len bytes of fd starting at offset on the blocking socket of ctx
+ * and counts them in ctx->bytes_transferred, like gfs_send.  Streams with
+ * sendfile so the data never passes through user space, files sendfile
+ * does not support go through a large aligned buffer instead.  Returns the
+ * number of bytes sent, which is less than len if the file is shorter or
+ * the client went away.  The process must ignore SIGPIPE, sendfile has
+ * no MSG_NOSIGNAL.
+ */
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fd, off_t offset, size_t len);
+
+/*
+ * Like gfs_send for several buffers at once, one system call per socket
+ * buffer full rather than one per buffer.
+ */
+ssize_t gfs_sendv(gfcontext_t *ctx, const struct iovec *iov, int iovcnt);
+
+/*
+ * Like gfs_send but never blocks: sends what fits into the socket buffer
+ * right now.  Returns the number of bytes sent, 0 if none fit, or -1 if
+ * the client went away.
+ */
+ssize_t gfs_trysend(gfcontext_t *ctx, const void *data, size_t len);
+
+/*
+ * Like gfs_sendheader followed by gfs_sendv, but the header leaves in the
+ * same segment as the first body bytes.  Returns the number of body bytes
+ * sent, or -1 if not even the header went out.
+ */
+ssize_t gfs_sendheaderv(gfcontext_t *ctx, gfstatus_t status, size_t file_len, const struct iovec *iov, int iovcnt);
+
+/*
+ * TCP_CORK on the socket of ctx: while on, only full segments are sent, so
+ * a header and the body written after it share packets.  Turning it off
+ * sends what is left.
+ */
+void gfs_cork(gfcontext_t *ctx, int on);
+
+/*
+ * Zero-copy sends.  Buffers of at least gfs_zerocopy_min bytes are sent
+ * with MSG_ZEROCOPY: the kernel sends from the pages of the buffer itself,
+ * so the caller must not change or free it until gfs_zerocopy_reap with
+ * wait set has returned.  Smaller buffers, or all of them while
+ * gfs_zerocopy_min is 0, are sent like gfs_send.  A socket whose sends the
+ * kernel copies anyway, loopback for one, goes back to plain sends.
+ */
+extern size_t gfs_zerocopy_min;
+
+typedef struct gfs_zerocopy_t
+{
+	int fd;                   // socket the state belongs to
+	int off;                  // zero-copy is not used on this socket
+	unsigned next;            // id of the next zero-copy send
+	unsigned done;            // sends the kernel has released
+} gfs_zerocopy_t;
+
+void gfs_zerocopy_init(gfs_zerocopy_t *zc, gfcontext_t *ctx);
+ssize_t gfs_send_zerocopy(gfcontext_t *ctx, gfs_zerocopy_t *zc, const void *data, size_t len);
+// collects completions, with wait until all sends so far are released
+void gfs_zerocopy_reap(gfs_zerocopy_t *zc, int wait);
+
+#endif // __GFSERVER_SEND_H__
@@ -1,167 +1,1805 @@
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 #include "proxy-student.h"
 #include "gfserver.h"
+#include "gfserver_epoll.h"
+#include "gfserver_send.h"
+
+#define MAX_REQUEST_N 824
+#define BUFSIZE (6200)
+
+unsigned long curl_nconnects = 0;
+unsigned long curl_nrequests = 0;
+unsigned long curl_nranged = 0;
+unsigned long curl_nparts = 0;
+
+static CURLSH *curl_share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+// easy handles of finished async transfers, the next ones reuse them
+#define CURL_ASYNC_FREE_MAX 256
+static CURL *async_free[CURL_ASYNC_FREE_MAX];
+static int async_nfree = 0;
+static pthread_mutex_t async_free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void share_lock(CURL *eh, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *eh, curl_lock_data data, void *userptr)
+{
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+void curl_workers_init(curl_worker_t *workers, int nworkers, const char *server)
+{
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+	{
+		pthread_mutex_init(&share_locks[i], NULL);
+	}
+
+	curl_share = curl_share_init();
+	curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	for (int i = 0; i < nworkers; i++)
+	{
+		workers[i].server = server;
+		workers[i].up = NULL;
+		workers[i].cache = NULL;
+		workers[i].neg = NULL;
+		workers[i].origins = NULL;
+		workers[i].flights = NULL;
+		workers[i].prefetch = NULL;
+		workers[i].attempt_multi = NULL;
+		workers[i].hedge_eh = NULL;
+		workers[i].nranges = 0;
+		workers[i].range_multi = NULL;
+		workers[i].range_eh = NULL;
+		workers[i].out = NULL;
+		workers[i].out_cap = 0;
+		if ((workers[i].eh = curl_easy_init()) == NULL)
+		{
+			fprintf(stderr, "curl_easy_init() failed\n");
+			exit(1);
+		}
+	}
+}
+
+void curl_workers_cleanup(curl_worker_t *workers, int nworkers)
+{
+	for (int i = 0; i < nworkers; i++)
+	{
+		curl_easy_cleanup(workers[i].eh);
+		if (workers[i].attempt_multi != NULL)
+		{
+			curl_easy_cleanup(workers[i].hedge_eh);
+			curl_multi_cleanup(workers[i].attempt_multi);
+		}
+		if (workers[i].range_multi != NULL)
+		{
+			for (int j = 0; j < workers[i].nranges; j++)
+				curl_easy_cleanup(workers[i].range_eh[j]);
+			free(workers[i].range_eh);
+			curl_multi_cleanup(workers[i].range_multi);
+		}
+		free(workers[i].out);
+	}
+	while (async_nfree > 0)
+	{
+		curl_easy_cleanup(async_free[--async_nfree]);
+	}
+	curl_share_cleanup(curl_share);
+}
+
+// an origin that does not accept the connection in time or stops sending
+// for this long fails the transfer instead of holding the worker
+#define CURL_CONNECT_TIMEOUT_MS 2000
+#define CURL_STALL_SECS 10
+
+// reset keeps the handle's connections and caches, only the options go
+static void curl_prepare(CURL *eh, const char *url)
+{
+	curl_easy_reset(eh);
+	curl_easy_setopt(eh, CURLOPT_SHARE, curl_share);
+	curl_easy_setopt(eh, CURLOPT_URL, url);
+	curl_easy_setopt(eh, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT_MS, (long)CURL_CONNECT_TIMEOUT_MS);
+	curl_easy_setopt(eh, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(eh, CURLOPT_LOW_SPEED_TIME, (long)CURL_STALL_SECS);
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void curl_count(CURL *eh)
+{
+	long nconnects;
+
+	if (curl_easy_getinfo(eh, CURLINFO_NUM_CONNECTS, &nconnects) == CURLE_OK)
+	{
+		__sync_fetch_and_add(&curl_nconnects, nconnects);
+	}
+	__sync_fetch_and_add(&curl_nrequests, 1);
+}
+
+// bodies without a Content-Length are kept in memory up to this size and
+// spooled to a temporary file beyond it
+#define CURL_BUFFER_MAX (1 << 20)
+
+// unsent body a transfer may hold before it is paused, unless the rest of
+// the object fits into CURL_TRANSFER_TAILMAX: then the transfer is allowed
+// to finish so its connection goes back to the pool right away
+#define CURL_TRANSFER_BUFMAX (256 * 1024)
+#define CURL_TRANSFER_TAILMAX (1 << 20)
+
+typedef struct curl_attempt_t curl_attempt_t;
+
+typedef struct curl_request_t
+{
+	gfcontext_t *ctx;
+	curl_attempt_t *winner;   // the attempt whose response is used
+	long status;
+	curl_off_t content_len;   // -1 until a Content-Length header is seen
+	curl_off_t total_len;     // object size from Content-Range, -1 if none
+	int header_sent;
+	char *buf;
+	size_t buf_len;
+	FILE *spool;
+	size_t body_len;
+
+	int tee_fd;               // disk cache copy of the body, -1 if none
+	int tee_failed;
+	size_t tee_len;
+	char etag[256];           // validators stored with the cached copy
+	char last_modified[64];
+
+	flight_t *flight;         // set when other requests share this fetch
+	int client_gone;
+	gfs_zerocopy_t *zc;       // set while the body comes from buffers that stay put
+
+	char *out;                // streamed body the client has not taken yet
+	size_t out_len;
+	size_t out_off;
+	size_t out_cap;
+	int paused;               // writecb returned CURL_WRITEFUNC_PAUSE
+	int send_failed;          // the client went away, fail the transfer
+} curl_request_t;
+
+// the response goes to the client and to the requests sharing the fetch
+static void req_sendheader(curl_request_t *req, gfstatus_t status, size_t len)
+{
+	if (req->flight != NULL)
+	{
+		flight_header(req->flight, status, len);
+	}
+	if (req->ctx != NULL)
+	{
+		// held back until it fills a segment with the body, the handler
+		// uncorks once the transfer ends
+		if (status == GF_OK && len > 0)
+			gfs_cork(req->ctx, 1);
+		req->ctx->file_len = len;
+		gfs_sendheader(req->ctx, status, len);
+	}
+	req->header_sent = 1;
+}
+
+static ssize_t req_send(curl_request_t *req, const void *data, size_t len)
+{
+	if (req->flight != NULL)
+	{
+		flight_append(req->flight, data, len);
+	}
+	if (req->client_gone || req->ctx == NULL)
+	{
+		return len;
+	}
+	if ((req->zc != NULL ? gfs_send_zerocopy(req->ctx, req->zc, data, len) : gfs_send(req->ctx, (void *)data, len)) < 0)
+	{
+		// the others still want the object when this client hangs up
+		if (req->flight == NULL || flight_nfollowers(req->flight) == 0)
+			return -1;
+		req->client_gone = 1;
+	}
+
+	return len;
+}
+
+// sends the Getfile header once the origin's headers are complete, a 304
+// is answered from the cache and background refreshes have no client
+static void send_status(curl_request_t *req)
+{
+	if ((req->ctx == NULL && req->flight == NULL) || req->status == 304)
+	{
+		return;
+	}
+
+	// a 416 for the first chunk means the object is empty
+	if ((req->status == 206 || req->status == 416) && req->total_len >= 0)
+	{
+		req_sendheader(req, GF_OK, req->total_len);
+	}
+	else if (req->status >= 400)
+	{
+		req_sendheader(req, GF_FILE_NOT_FOUND, 0);
+	}
+	else if (req->status != 206 && req->content_len >= 0)
+	{
+		req_sendheader(req, GF_OK, req->content_len);
+	}
+}
+
+// picks the status and Content-Length out of one header line, returns 1
+// once the headers of the final response are complete
+static int parse_header(const char *buffer, size_t numbytes, long *status, curl_off_t *content_len)
+{
+	long code;
+	curl_off_t len;
+
+	// every status line starts a new header block, e.g. after a 100 Continue
+	if (numbytes > 5 && strncmp(buffer, "HTTP/", 5) == 0 && sscanf(buffer, "HTTP/%*s %ld", &code) == 1)
+	{
+		*status = code;
+		*content_len = -1;
+	}
+	else if (numbytes > 15 && strncasecmp(buffer, "content-length:", 15) == 0 &&
+			 sscanf(buffer + 15, " %" CURL_FORMAT_CURL_OFF_T, &len) == 1)
+	{
+		*content_len = len;
+	}
+	else if ((numbytes == 2 && buffer[0] == '\r') || (numbytes == 1 && buffer[0] == '\n'))
+	{
+		return *status >= 200;
+	}
+
+	return 0;
+}
+
+// picks the object size out of a Content-Range header, either of
+// "bytes first-last/size" or "bytes */size"
+static void parse_content_range(const char *buffer, size_t numbytes, curl_off_t *total_len)
+{
+	curl_off_t len;
+
+	if (numbytes > 14 && strncasecmp(buffer, "content-range:", 14) == 0 &&
+		(sscanf(buffer + 14, " bytes %*[0-9]-%*[0-9]/%" CURL_FORMAT_CURL_OFF_T, &len) == 1 ||
+		 sscanf(buffer + 14, " bytes */%" CURL_FORMAT_CURL_OFF_T, &len) == 1))
+	{
+		*total_len = len;
+	}
+}
+
+// copies the value of a header line without the line break
+static void header_value(const char *buffer, size_t numbytes, size_t namelen, char *value, size_t len)
+{
+	size_t n;
+
+	buffer += namelen;
+	numbytes -= namelen;
+	while (numbytes > 0 && *buffer == ' ')
+	{
+		buffer++;
+		numbytes--;
+	}
+	while (numbytes > 0 && (buffer[numbytes - 1] == '\r' || buffer[numbytes - 1] == '\n'))
+	{
+		numbytes--;
+	}
+
+	n = numbytes < len - 1 ? numbytes : len - 1;
+	memcpy(value, buffer, n);
+	value[n] = '\0';
+}
+
+static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	curl_request_t *req = (curl_request_t *)userdata;
+	size_t numbytes = size * nitems;
+
+	if (numbytes > 5 && strncmp(buffer, "HTTP/", 5) == 0)
+	{
+		req->total_len = -1;
+		req->etag[0] = req->last_modified[0] = '\0';
+	}
+	else if (numbytes > 5 && strncasecmp(buffer, "etag:", 5) == 0)
+	{
+		header_value(buffer, numbytes, 5, req->etag, sizeof(req->etag));
+	}
+	else if (numbytes > 14 && strncasecmp(buffer, "last-modified:", 14) == 0)
+	{
+		header_value(buffer, numbytes, 14, req->last_modified, sizeof(req->last_modified));
+	}
+	parse_content_range(buffer, numbytes, &req->total_len);
+
+	if (parse_header(buffer, numbytes, &req->status, &req->content_len))
+	{
+		send_status(req);
+	}
+
+	return numbytes;
+}
+
+static void tee_body(curl_request_t *req, const char *ptr, size_t numbytes)
+{
+	if (req->tee_fd >= 0 && !req->tee_failed)
+	{
+		if (write(req->tee_fd, ptr, numbytes) != numbytes)
+		{
+			perror("disk cache write");
+			req->tee_failed = 1;
+		}
+		req->tee_len += numbytes;
+	}
+}
+
+// the client's share of a streamed body goes through a bounded buffer, so a
+// slow client pauses the transfer instead of blocking inside curl; requests
+// sharing the fetch get their copy right away
+static size_t req_queue(curl_request_t *req, const char *ptr, size_t numbytes)
+{
+	size_t pending = req->out_len - req->out_off;
+
+	if (req->send_failed)
+	{
+		return 0;
+	}
+	if (req->ctx == NULL || req->client_gone)
+	{
+		req->body_len += numbytes;
+		return req_send(req, ptr, numbytes) < 0 ? 0 : numbytes;
+	}
+
+	if (pending > 0 && pending + numbytes > CURL_TRANSFER_BUFMAX &&
+		(req->content_len < 0 || pending + (req->content_len - req->body_len) > CURL_TRANSFER_TAILMAX))
+	{
+		req->paused = 1;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	if (req->out_off > 0)
+	{
+		memmove(req->out, req->out + req->out_off, pending);
+		req->out_len = pending;
+		req->out_off = 0;
+	}
+	if (req->out_len + numbytes > req->out_cap)
+	{
+		size_t cap = req->out_cap ? req->out_cap : BUFSIZE;
+		while (cap < req->out_len + numbytes)
+			cap *= 2;
+		req->out = realloc(req->out, cap);
+		req->out_cap = cap;
+	}
+	if (req->flight != NULL)
+	{
+		flight_append(req->flight, ptr, numbytes);
+	}
+	memcpy(req->out + req->out_len, ptr, numbytes);
+	req->out_len += numbytes;
+	req->body_len += numbytes;
+
+	return numbytes;
+}
+
+static size_t writecb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	curl_request_t *req = (curl_request_t *)userdata;
+	size_t numbytes = size * nmemb;
+
+	// error pages are dropped, not forwarded
+	if (req->status >= 400)
+	{
+		return numbytes;
+	}
+
+	tee_body(req, ptr, numbytes);
+
+	if (req->ctx == NULL && req->flight == NULL)
+	{
+		return req->tee_failed ? 0 : numbytes;
+	}
+
+	if (req->header_sent)
+	{
+		return req_queue(req, ptr, numbytes);
+	}
+
+	// no length yet, hold the body back until the transfer ends
+	if (req->spool == NULL && req->body_len + numbytes > CURL_BUFFER_MAX)
+	{
+		if ((req->spool = tmpfile()) == NULL ||
+			fwrite(req->buf, 1, req->body_len, req->spool) != req->body_len)
+		{
+			perror("tmpfile");
+			return 0;
+		}
+	}
+
+	if (req->spool != NULL)
+	{
+		if (fwrite(ptr, 1, numbytes, req->spool) != numbytes)
+		{
+			perror("fwrite");
+			return 0;
+		}
+	}
+	else
+	{
+		if (req->buf == NULL)
+		{
+			req->buf = malloc(CURL_BUFFER_MAX);
+		}
+		memcpy(req->buf + req->body_len, ptr, numbytes);
+	}
+	req->body_len += numbytes;
+
+	return numbytes;
+}
+
+// forwards a body whose length was only known once the transfer ended
+static void send_held_body(curl_request_t *req)
+{
+	char chunk[BUFSIZE];
+	size_t n;
+
+	// a body held in memory leaves together with the header
+	if (req->spool == NULL)
+	{
+		struct iovec iov = {req->buf, req->body_len};
+
+		if (req->flight != NULL)
+		{
+			flight_header(req->flight, GF_OK, req->body_len);
+			flight_append(req->flight, req->buf, req->body_len);
+		}
+		if (req->ctx != NULL)
+		{
+			gfs_sendheaderv(req->ctx, GF_OK, req->body_len, &iov, req->body_len > 0);
+		}
+		req->header_sent = 1;
+		return;
+	}
+
+	req_sendheader(req, GF_OK, req->body_len);
+	if (req->ctx == NULL && req->flight == NULL)
+	{
+		return;
+	}
+
+	rewind(req->spool);
+	while ((n = fread(chunk, 1, sizeof(chunk), req->spool)) > 0)
+	{
+		if (req_send(req, chunk, n) < 0)
+			break;
+	}
+}
+
+// one chunk of a ranged fetch, its buffer is a slot of the reorder buffer
+typedef struct range_part_t
+{
+	CURL *eh;
+	long status;
+	curl_off_t total_len;
+	char *buf;
+	size_t start;             // offset of the chunk in the object
+	size_t len;               // 0 while the slot is free
+	size_t filled;
+	size_t sent;
+	int done;
+} range_part_t;
+
+static size_t part_header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	range_part_t *part = (range_part_t *)userdata;
+	size_t numbytes = size * nitems;
+	curl_off_t content_len;
+
+	parse_content_range(buffer, numbytes, &part->total_len);
+	parse_header(buffer, numbytes, &part->status, &content_len);
+
+	return numbytes;
+}
+
+static size_t part_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	range_part_t *part = (range_part_t *)userdata;
+	size_t numbytes = size * nmemb;
+
+	// anything but exactly the requested range fails the transfer
+	if (part->status != 206 || part->filled + numbytes > part->len)
+	{
+		return 0;
+	}
+
+	memcpy(part->buf + part->filled, ptr, numbytes);
+	part->filled += numbytes;
+
+	return numbytes;
+}
+
+static void part_start(CURLM *multi, range_part_t *part, const char *url, size_t start, size_t len)
+{
+	char range[64];
+
+	part->status = 0;
+	part->total_len = -1;
+	part->start = start;
+	part->len = len;
+	part->filled = part->sent = 0;
+	part->done = 0;
+
+	snprintf(range, sizeof(range), "%zu-%zu", start, start + len - 1);
+	curl_prepare(part->eh, url);
+	curl_easy_setopt(part->eh, CURLOPT_RANGE, range);
+	// one connection per part, each with its own congestion window
+	curl_easy_setopt(part->eh, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+	curl_easy_setopt(part->eh, CURLOPT_HEADERFUNCTION, part_header_cb);
+	curl_easy_setopt(part->eh, CURLOPT_HEADERDATA, part);
+	curl_easy_setopt(part->eh, CURLOPT_WRITEFUNCTION, part_write_cb);
+	curl_easy_setopt(part->eh, CURLOPT_WRITEDATA, part);
+	curl_easy_setopt(part->eh, CURLOPT_PRIVATE, part);
+	curl_multi_add_handle(multi, part->eh);
+	__sync_fetch_and_add(&curl_nparts, 1);
+}
+
+/*
+ * Fetches the rest of an object whose first chunk came from a range
+ * request.  Up to nranges chunks are in flight at once, each into its own
+ * slot, and the client is fed strictly in order: the slot holding the next
+ * byte is forwarded as it fills and reused once its chunk is complete.
+ */
+static CURLcode fetch_ranges(curl_worker_t *worker, curl_request_t *req, const char *url)
+{
+	range_part_t parts[CURL_RANGE_MAX_PARTS];
+	gfs_zerocopy_t zc;
+	size_t total = req->total_len;
+	size_t head = req->body_len;   // next byte the client needs
+	size_t next = head;            // next byte not requested yet
+	CURLcode res = CURLE_OK;
+	CURLMsg *msg;
+	int running, nmsgs, i;
+
+	if (worker->range_multi == NULL)
+	{
+		worker->range_multi = curl_multi_init();
+		worker->range_eh = malloc(worker->nranges * sizeof(CURL *));
+		for (i = 0; i < worker->nranges; i++)
+			worker->range_eh[i] = curl_easy_init();
+	}
+	__sync_fetch_and_add(&curl_nranged, 1);
+	// the slots stay put until reused, so they are sent without a copy
+	if (req->ctx != NULL)
+	{
+		gfs_zerocopy_init(&zc, req->ctx);
+		req->zc = &zc;
+	}
+
+	for (i = 0; i < worker->nranges; i++)
+	{
+		parts[i].eh = worker->range_eh[i];
+		parts[i].buf = malloc(CURL_RANGE_CHUNK);
+		parts[i].len = 0;
+		if (next < total)
+		{
+			size_t len = total - next < CURL_RANGE_CHUNK ? total - next : CURL_RANGE_CHUNK;
+			part_start(worker->range_multi, &parts[i], url, next, len);
+			next += len;
+		}
+	}
+
+	while (head < total && res == CURLE_OK)
+	{
+		curl_multi_perform(worker->range_multi, &running);
+
+		while ((msg = curl_multi_info_read(worker->range_multi, &nmsgs)) != NULL)
+		{
+			range_part_t *part;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&part);
+			curl_multi_remove_handle(worker->range_multi, part->eh);
+			curl_count(part->eh);
+			part->done = 1;
+
+			if (msg->data.result != CURLE_OK)
+			{
+				fprintf(stderr, "range %zu-%zu failed: %s\n", part->start, part->start + part->len - 1, curl_easy_strerror(msg->data.result));
+				res = msg->data.result;
+			}
+			else if (part->filled != part->len || part->total_len != req->total_len)
+			{
+				// the object changed between the requests
+				fprintf(stderr, "range %zu-%zu: status %ld, %zu bytes of object size %" CURL_FORMAT_CURL_OFF_T "\n",
+						part->start, part->start + part->len - 1, part->status, part->filled, part->total_len);
+				res = CURLE_PARTIAL_FILE;
+			}
+		}
+
+		// drain the reorder buffer in object order
+		while (res == CURLE_OK && head < total)
+		{
+			range_part_t *part = NULL;
+
+			for (i = 0; i < worker->nranges; i++)
+			{
+				if (parts[i].len > 0 && parts[i].start == head)
+					part = &parts[i];
+			}
+			if (part == NULL)
+				break;
+
+			if (part->filled > part->sent)
+			{
+				tee_body(req, part->buf + part->sent, part->filled - part->sent);
+				if (req_send(req, part->buf + part->sent, part->filled - part->sent) < 0)
+				{
+					res = CURLE_SEND_ERROR;
+					break;
+				}
+				head += part->filled - part->sent;
+				part->sent = part->filled;
+			}
+			if (!part->done)
+				break;
+
+			part->len = 0;
+			if (next < total)
+			{
+				size_t len = total - next < CURL_RANGE_CHUNK ? total - next : CURL_RANGE_CHUNK;
+
+				// the kernel may still be sending from the slot
+				if (req->zc != NULL)
+					gfs_zerocopy_reap(req->zc, 1);
+				part_start(worker->range_multi, part, url, next, len);
+				next += len;
+			}
+		}
+
+		if (head < total && res == CURLE_OK)
+		{
+			curl_multi_poll(worker->range_multi, NULL, 0, 1000, NULL);
+		}
+	}
+
+	if (req->zc != NULL)
+	{
+		gfs_zerocopy_reap(req->zc, 1);
+		req->zc = NULL;
+	}
+	for (i = 0; i < worker->nranges; i++)
+	{
+		if (parts[i].len > 0 && !parts[i].done)
+			curl_multi_remove_handle(worker->range_multi, parts[i].eh);
+		free(parts[i].buf);
+	}
+	req->body_len = head;
+
+	return res;
+}
+
+// one request to one origin, a request makes at most two of them
+struct curl_attempt_t
+{
+	curl_request_t *req;
+	CURL *eh;
+	int origin;               // -1 for worker->server
+	int fail_over;            // a server error goes to another origin
+	int running;
+	double started_ms;
+	double header_ms;
+};
+
+// forwards what the client takes without blocking, or all of it with wait,
+// and resumes a paused transfer once half of the buffer is free
+static void req_flush(curl_request_t *req, int wait)
+{
+	while (req->out_off < req->out_len)
+	{
+		size_t pending = req->out_len - req->out_off;
+		ssize_t n = wait ? gfs_send(req->ctx, (void *)(req->out + req->out_off), pending)
+						 : gfs_trysend(req->ctx, req->out + req->out_off, pending);
+
+		if (n < 0)
+		{
+			// the others still want the object when this client hangs up
+			if (req->flight == NULL || flight_nfollowers(req->flight) == 0)
+				req->send_failed = 1;
+			req->client_gone = 1;
+			req->out_off = req->out_len = 0;
+			break;
+		}
+		if (n == 0)
+			break;
+		req->out_off += n;
+	}
+	if (req->out_off == req->out_len)
+	{
+		req->out_off = req->out_len = 0;
+	}
+
+	// a failed transfer only notices when its write callback runs again
+	if (req->paused && (req->client_gone || req->out_len - req->out_off <= CURL_TRANSFER_BUFMAX / 2))
+	{
+		req->paused = 0;
+		curl_easy_pause(req->winner->eh, CURLPAUSE_CONT);
+	}
+}
+
+static size_t attempt_header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	curl_attempt_t *a = (curl_attempt_t *)userdata;
+	curl_request_t *req = a->req;
+	long code;
+
+	// the first attempt to answer takes the request and the other one
+	// aborts; a server error leaves the request to the other origin
+	if (req->winner == NULL)
+	{
+		if (a->fail_over && sscanf(buffer, "HTTP/%*s %ld", &code) == 1 && code >= 500)
+		{
+			return 0;
+		}
+		req->winner = a;
+		a->header_ms = now_ms() - a->started_ms;
+	}
+	if (req->winner != a)
+	{
+		return 0;
+	}
+
+	return header_callback(buffer, size, nitems, req);
+}
+
+static size_t attempt_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	curl_attempt_t *a = (curl_attempt_t *)userdata;
+
+	if (a->req->winner != a)
+	{
+		return 0;
+	}
+
+	return writecb(ptr, size, nmemb, a->req);
+}
+
+static void attempt_start(curl_worker_t *worker, curl_attempt_t *a, int origin, int fail_over, const char *path,
+						  const char *range, struct curl_slist *headers)
+{
+	char url[BUFSIZE];
+
+	a->origin = origin;
+	a->fail_over = fail_over;
+	a->running = 1;
+	a->started_ms = now_ms();
+	a->header_ms = 0;
+
+	snprintf(url, sizeof(url), "%s%s", origin >= 0 ? worker->origins->origins[origin].url : worker->server, path);
+	curl_prepare(a->eh, url);
+	curl_easy_setopt(a->eh, CURLOPT_HEADERFUNCTION, attempt_header_cb);
+	curl_easy_setopt(a->eh, CURLOPT_HEADERDATA, a);
+	curl_easy_setopt(a->eh, CURLOPT_WRITEFUNCTION, attempt_write_cb);
+	curl_easy_setopt(a->eh, CURLOPT_WRITEDATA, a);
+	curl_easy_setopt(a->eh, CURLOPT_PRIVATE, a);
+	if (range != NULL)
+		curl_easy_setopt(a->eh, CURLOPT_RANGE, range);
+	if (headers != NULL)
+		curl_easy_setopt(a->eh, CURLOPT_HTTPHEADER, headers);
+	curl_multi_add_handle(worker->attempt_multi, a->eh);
+}
+
+/*
+ * Fetches path from the best origin.  If no headers arrived after the
+ * hedge delay, the same request goes to the next best origin as well and
+ * whichever answers first is used, the other one is dropped.  An attempt
+ * that fails before answering is retried on the other origin right away.
+ * On return url holds the URL of the answering origin.
+ */
+static CURLcode curl_perform_origins(curl_worker_t *worker, curl_request_t *req, const char *path, const char *range,
+									 struct curl_slist *headers, char *url, size_t url_len)
+{
+	origin_set_t *set = worker->origins;
+	curl_attempt_t attempts[2];
+	long hedge_ms = set != NULL ? origin_hedge_ms(set) : -1;
+	int nstarted = 1, nrunning = 1, hedged = 0;
+	int running, nmsgs, i;
+	CURLcode res = CURLE_OK;
+	CURLMsg *msg;
+
+	if (worker->attempt_multi == NULL)
+	{
+		worker->attempt_multi = curl_multi_init();
+		worker->hedge_eh = curl_easy_init();
+	}
+	attempts[0].req = attempts[1].req = req;
+	attempts[0].eh = worker->eh;
+	attempts[1].eh = worker->hedge_eh;
+	attempts[1].running = 0;
+	// the second attempt is the last resort and takes any answer
+	attempt_start(worker, &attempts[0], set != NULL ? origin_pick(set, -1) : -1, set != NULL && set->n > 1, path,
+				  range, headers);
+
+	while (nrunning > 0)
+	{
+		curl_multi_perform(worker->attempt_multi, &running);
+
+		while ((msg = curl_multi_info_read(worker->attempt_multi, &nmsgs)) != NULL)
+		{
+			curl_attempt_t *a;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&a);
+			curl_multi_remove_handle(worker->attempt_multi, a->eh);
+			curl_count(a->eh);
+			a->running = 0;
+			nrunning--;
+
+			// a loser aborted by its callbacks tells nothing about its origin
+			if (req->winner == a || req->winner == NULL)
+			{
+				res = msg->data.result;
+				if (a->origin >= 0)
+					origin_report(set, a->origin, req->winner == a && res == CURLE_OK, a->header_ms);
+			}
+		}
+
+		// once one attempt answered the other one is cancelled; its origin
+		// took at least this long, or it keeps being picked first
+		for (i = 0; i < 2 && req->winner != NULL; i++)
+		{
+			if (attempts[i].running && req->winner != &attempts[i])
+			{
+				curl_multi_remove_handle(worker->attempt_multi, attempts[i].eh);
+				curl_count(attempts[i].eh);
+				attempts[i].running = 0;
+				nrunning--;
+				origin_report(set, attempts[i].origin, 1, now_ms() - attempts[i].started_ms);
+			}
+		}
+
+		if (req->winner == NULL && nstarted == 1 && set != NULL &&
+			(nrunning == 0 || (hedge_ms >= 0 && now_ms() - attempts[0].started_ms >= hedge_ms)))
+		{
+			int second = origin_pick(set, attempts[0].origin);
+
+			if (second >= 0)
+			{
+				hedged = nrunning > 0;
+				if (hedged)
+					__sync_fetch_and_add(&set->nhedges, 1);
+				attempt_start(worker, &attempts[1], second, 0, path, range, headers);
+				nstarted++;
+				nrunning++;
+			}
+		}
+
+		// the transfer goes on while the client takes its time
+		req_flush(req, 0);
+
+		if (nrunning > 0)
+		{
+			struct curl_waitfd client = {req->ctx != NULL ? req->ctx->socket : -1, CURL_WAIT_POLLOUT, 0};
+			int timeout = 1000;
+
+			if (req->winner == NULL && nstarted == 1 && hedge_ms >= 0)
+			{
+				double left = attempts[0].started_ms + hedge_ms - now_ms();
+				timeout = left > 0 ? (int)left + 1 : 0;
+			}
+			curl_multi_poll(worker->attempt_multi, &client, req->out_len > req->out_off, timeout, NULL);
+		}
+	}
+	// the connection is back in the pool, the rest may block
+	req_flush(req, 1);
+
+	if (hedged && req->winner == &attempts[1])
+	{
+		__sync_fetch_and_add(&set->nhedge_wins, 1);
+	}
+	if (req->winner != NULL && req->winner->origin >= 0)
+	{
+		snprintf(url, url_len, "%s%s", set->origins[req->winner->origin].url, path);
+	}
+	else
+	{
+		snprintf(url, url_len, "%s%s", worker->server, path);
+	}
+
+	return res;
+}
+
+// asks the origin to answer 304 if the cached copy is still current; the
+// conditions go out as plain headers, CURLOPT_TIMECONDITION would make
+// curl drop the body of a 200 the origin sends anyway
+static struct curl_slist *curl_conditional(const char *etag, const char *last_modified)
+{
+	struct curl_slist *headers = NULL;
+	char line[320];
+
+	if (etag[0] != '\0')
+	{
+		snprintf(line, sizeof(line), "If-None-Match: %s", etag);
+		headers = curl_slist_append(headers, line);
+	}
+	if (last_modified[0] != '\0')
+	{
+		snprintf(line, sizeof(line), "If-Modified-Since: %s", last_modified);
+		headers = curl_slist_append(headers, line);
+	}
+
+	return headers;
+}
+
+// settles the disk cache once a transfer teeing into tmppath is over
+// returns 1 if the body went into the cache
+static int cache_finish(curl_worker_t *worker, curl_request_t *req, CURLcode res, const char *path, const char *tmppath)
+{
+	curl_off_t want = req->total_len >= 0 ? req->total_len : req->content_len;
+	int committed = 0;
+
+	if (res == CURLE_OK && req->status == 304)
+	{
+		disk_cache_abort(worker->cache, tmppath);
+		disk_cache_touch(worker->cache, path);
+	}
+	else if (res == CURLE_OK && (req->status == 404 || req->status == 410))
+	{
+		disk_cache_abort(worker->cache, tmppath);
+		disk_cache_remove(worker->cache, path);
+	}
+	// only complete, successful bodies make it into the cache
+	else if (res == CURLE_OK && req->status >= 200 && req->status < 400 && !req->tee_failed &&
+			 (want < 0 || req->tee_len == want))
+	{
+		disk_cache_set_validators(req->tee_fd, req->etag, req->last_modified);
+		disk_cache_commit(worker->cache, path, req->tee_fd, tmppath, req->tee_len);
+		committed = 1;
+	}
+	else
+	{
+		disk_cache_abort(worker->cache, tmppath);
+	}
+	close(req->tee_fd);
+	req->tee_fd = -1;
+
+	return committed;
+}
+
+// stale objects are served right away and revalidated by these threads
+#define CURL_REFRESH_THREADS 2
+
+typedef struct refresh_item_t
+{
+	char *path;
+	char etag[256];
+	char last_modified[64];
+} refresh_item_t;
+
+static steque_t refresh_queue;
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+static curl_worker_t refreshers[CURL_REFRESH_THREADS];
+
+static void curl_refresh(curl_worker_t *worker, refresh_item_t *item)
+{
+	curl_request_t req;
+	struct curl_slist *headers;
+	char url[BUFSIZE];
+	char tmppath[512];
+	CURLcode res;
 
-#define MAX_REQUEST_N 824
-#define BUFSIZE (6200)
+	memset(&req, 0, sizeof(req));
+	req.content_len = -1;
+	req.total_len = -1;
+	if ((req.tee_fd = disk_cache_begin(worker->cache, item->path, tmppath)) < 0)
+	{
+		return;
+	}
 
-static size_t writecb(char *ptr, size_t size, size_t nmemb, void *userdata)
+	headers = curl_conditional(item->etag, item->last_modified);
+	res = curl_perform_origins(worker, &req, item->path, NULL, headers, url, sizeof(url));
+	curl_slist_free_all(headers);
+	printf("refresh %s: %ld\n", item->path, req.status);
+
+	cache_finish(worker, &req, res, item->path, tmppath);
+}
+
+static void *refresh_main(void *arg)
 {
-	gfcontext_t *ctx = (gfcontext_t *)userdata;
-	int numbytes = size * nmemb;
-	gfs_send(ctx, ptr, numbytes);
-	return numbytes;
+	curl_worker_t *worker = (curl_worker_t *)arg;
+	refresh_item_t *item;
+
+	while (1)
+	{
+		pthread_mutex_lock(&refresh_lock);
+		while (steque_isempty(&refresh_queue))
+		{
+			pthread_cond_wait(&refresh_cond, &refresh_lock);
+		}
+		item = steque_pop(&refresh_queue);
+		pthread_mutex_unlock(&refresh_lock);
+
+		curl_refresh(worker, item);
+		disk_cache_release(worker->cache, item->path);
+		free(item->path);
+		free(item);
+	}
+
+	return NULL;
 }
 
-// static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata)
-// {
-// 	int content_len;
-// 	int status;
-// 	gfcontext_t *ctx = (gfcontext_t *)userdata;
-// 	int numbytes = size * nitems;
-// 	// printf("header : %.*s\n", numbytes, buffer);
-// 	if (sscanf(buffer, "HTTP/2 %d", &status) == 1)
-// 	{
-// 		printf("status: %d\n", status);
-// 		if (status == 404)
-// 		{
-// 			gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-// 			return numbytes;
-// 		}
-
-// 		if (status >= 400 && status != 404)
-// 		{
-// 			gfs_sendheader(ctx, GF_ERROR, 0);
-// 			return numbytes;
-// 		}
-// 	}
-
-// 	if (sscanf(buffer, "content-length: %d", &content_len) == 1)
-// 	{
-// 		printf("Content-Length: %d\n", content_len);
-// 		ctx->file_len = content_len;
-// 		gfs_sendheader(ctx, GF_OK, content_len);
-// 		return numbytes;
-// 	}
-// 	return numbytes;
-// }
+void curl_refresh_init(const char *server, origin_set_t *origins, disk_cache_t *cache)
+{
+	pthread_t thread;
 
-ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void *arg)
+	steque_init(&refresh_queue);
+	for (int i = 0; i < CURL_REFRESH_THREADS; i++)
+	{
+		refreshers[i].server = server;
+		refreshers[i].origins = origins;
+		refreshers[i].cache = cache;
+		if ((refreshers[i].eh = curl_easy_init()) == NULL)
+		{
+			fprintf(stderr, "curl_easy_init() failed\n");
+			exit(1);
+		}
+		if (pthread_create(&thread, NULL, refresh_main, &refreshers[i]) != 0)
+		{
+			fprintf(stderr, "Can't create refresh thread %d\n", i);
+			exit(1);
+		}
+	}
+}
+
+// queues a background refresh of a stale object unless one is running
+static void curl_refresh_start(disk_cache_t *cache, const char *path, int fd)
 {
-	(void)ctx;
-	(void)arg;
-	(void)path;
+	refresh_item_t *item;
+
+	if (!disk_cache_claim(cache, path))
+	{
+		return;
+	}
+
+	item = malloc(sizeof(refresh_item_t));
+	item->path = strdup(path);
+	disk_cache_get_validators(fd, item->etag, sizeof(item->etag), item->last_modified, sizeof(item->last_modified));
 
-	char *server = (char *)arg;
+	pthread_mutex_lock(&refresh_lock);
+	steque_enqueue(&refresh_queue, item);
+	pthread_cond_signal(&refresh_cond);
+	pthread_mutex_unlock(&refresh_lock);
+}
+
+// objects a client is likely to request next are fetched into the disk
+// cache by this thread, while the workers leave upstream capacity unused
+// and within a budget of bytes per second
+#define CURL_PREFETCH_THREADS 2
+#define CURL_PREFETCH_QUEUE_MAX 64
+#define CURL_PREFETCH_NEXT PREFETCH_DEPTH // prefetches one request may start
+
+static unsigned long curl_nactive; // client requests fetching from the origin
+static steque_t prefetch_queue;
+static int prefetch_nqueued;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static curl_worker_t prefetchers[CURL_PREFETCH_THREADS];
+static double prefetch_tokens;
+static double prefetch_last;
+static long prefetch_budget;
+static unsigned long prefetch_max_active;
+
+// bytes fetched, *ok set if the object is in the cache now
+static size_t curl_prefetch(curl_worker_t *worker, const char *path, int *ok)
+{
+	curl_request_t req;
 	char url[BUFSIZE];
-	strcpy(url, server);
-	strcat(url, path);
-	printf("url %s\n", url);
+	char tmppath[512];
+	CURLcode res;
+	int fd;
 
-	ctx->bytes_transferred = 0;
-	CURL *eh = curl_easy_init();
-	if (eh)
+	*ok = 0;
+	if ((fd = disk_cache_open(worker->cache, path)) >= 0)
+	{
+		close(fd);
+		return 0;
+	}
+	if (worker->neg != NULL && neg_cache_lookup(worker->neg, path))
+	{
+		return 0;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.content_len = -1;
+	req.total_len = -1;
+	// a client asking meanwhile follows the prefetch instead of fetching
+	if (worker->flights != NULL)
+	{
+		int leader;
+
+		req.flight = flight_join(worker->flights, path, &leader);
+		if (!leader)
+		{
+			flight_release(req.flight);
+			return 0;
+		}
+	}
+
+	if ((req.tee_fd = disk_cache_begin(worker->cache, path, tmppath)) >= 0)
+	{
+		res = curl_perform_origins(worker, &req, path, NULL, NULL, url, sizeof(url));
+		printf("prefetch %s: %ld\n", path, req.status);
+		if (res == CURLE_OK && !req.header_sent && req.status < 400)
+		{
+			send_held_body(&req);
+		}
+		if (res == CURLE_OK && worker->neg != NULL && (req.status == 404 || req.status == 410))
+		{
+			neg_cache_insert(worker->neg, path);
+		}
+		*ok = cache_finish(worker, &req, res, path, tmppath);
+	}
+
+	free(req.buf);
+	if (req.spool != NULL)
+	{
+		fclose(req.spool);
+	}
+	if (req.flight != NULL)
 	{
-		curl_easy_setopt(eh, CURLOPT_URL, url);
-		// curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, header_callback);
-		// curl_easy_setopt(eh, CURLOPT_HEADERDATA, ctx);
-		// curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, writecb);
-		// curl_easy_setopt(eh, CURLOPT_WRITEDATA, ctx);
+		flight_finish(worker->flights, req.flight);
+		flight_release(req.flight);
+	}
 
-		curl_easy_setopt(eh, CURLOPT_NOBODY, 1L);
+	return req.tee_len;
+}
+
+static void *prefetch_main(void *arg)
+{
+	curl_worker_t *worker = (curl_worker_t *)arg;
+	char *path;
+	size_t spent;
+	int ok;
 
-		CURLcode res;
-		res = curl_easy_perform(eh);
+	while (1)
+	{
+		pthread_mutex_lock(&prefetch_lock);
+		while (steque_isempty(&prefetch_queue))
+		{
+			pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+		}
+		path = steque_pop(&prefetch_queue);
+		prefetch_nqueued--;
 
-		if (res != CURLE_OK)
+		// token bucket of one second's budget, clients go first
+		while (1)
 		{
-			fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-			curl_easy_cleanup(eh);
-			return SERVER_FAILURE;
+			double now = now_ms();
+
+			if (prefetch_last > 0)
+				prefetch_tokens += prefetch_budget * (now - prefetch_last) / 1000;
+			if (prefetch_tokens > prefetch_budget)
+				prefetch_tokens = prefetch_budget;
+			prefetch_last = now;
+			if (prefetch_tokens > 0 && __sync_fetch_and_add(&curl_nactive, 0) < prefetch_max_active)
+				break;
+			pthread_mutex_unlock(&prefetch_lock);
+			usleep(10000);
+			pthread_mutex_lock(&prefetch_lock);
 		}
+		pthread_mutex_unlock(&prefetch_lock);
+
+		spent = curl_prefetch(worker, path, &ok);
+		prefetch_done(worker->prefetch, path, ok);
+		free(path);
+
+		pthread_mutex_lock(&prefetch_lock);
+		prefetch_tokens -= spent;
+		pthread_mutex_unlock(&prefetch_lock);
+	}
+
+	return NULL;
+}
 
-		long response_code;
-		res = curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &response_code);
-		printf("Response code: %ld\n", response_code);
-		printf("res %d\n", res);
+void curl_prefetch_init(const char *server, origin_set_t *origins, disk_cache_t *cache, neg_cache_t *neg,
+						flight_table_t *flights, prefetch_t *model, long budget, int max_active)
+{
+	pthread_t thread;
 
-		if (res != CURLE_OK)
+	steque_init(&prefetch_queue);
+	prefetch_budget = budget;
+	prefetch_tokens = budget;
+	prefetch_max_active = max_active;
+	for (int i = 0; i < CURL_PREFETCH_THREADS; i++)
+	{
+		prefetchers[i].server = server;
+		prefetchers[i].origins = origins;
+		prefetchers[i].cache = cache;
+		prefetchers[i].neg = neg;
+		prefetchers[i].flights = flights;
+		prefetchers[i].prefetch = model;
+		if ((prefetchers[i].eh = curl_easy_init()) == NULL)
+		{
+			fprintf(stderr, "curl_easy_init() failed\n");
+			exit(1);
+		}
+		if (pthread_create(&thread, NULL, prefetch_main, &prefetchers[i]) != 0)
 		{
-			fprintf(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
-			curl_easy_cleanup(eh);
-			return SERVER_FAILURE;
+			fprintf(stderr, "Can't create prefetch thread %d\n", i);
+			exit(1);
 		}
+	}
+}
+
+// requests from one address are taken as one client's sequence
+static unsigned long client_id(gfcontext_t *ctx)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	const unsigned char *p = NULL;
+	unsigned long id = 5381;
+	size_t n = 0;
 
-		if (response_code >= 400)
+	if (getpeername(ctx->socket, (struct sockaddr *)&addr, &len) < 0)
+	{
+		return 0;
+	}
+	if (addr.ss_family == AF_INET)
+	{
+		p = (const unsigned char *)&((struct sockaddr_in *)&addr)->sin_addr;
+		n = sizeof(struct in_addr);
+	}
+	else if (addr.ss_family == AF_INET6)
+	{
+		p = (const unsigned char *)&((struct sockaddr_in6 *)&addr)->sin6_addr;
+		n = sizeof(struct in6_addr);
+	}
+	while (n-- > 0)
+	{
+		id = id * 33 + *p++;
+	}
+
+	return id;
+}
+
+// learns from the request and queues prefetches of what may follow it
+static void curl_prefetch_start(prefetch_t *model, gfcontext_t *ctx, const char *path)
+{
+	char *next[CURL_PREFETCH_NEXT];
+	int n = prefetch_observe(model, client_id(ctx), path, next, CURL_PREFETCH_NEXT);
+
+	pthread_mutex_lock(&prefetch_lock);
+	for (int i = 0; i < n; i++)
+	{
+		if (prefetch_nqueued < CURL_PREFETCH_QUEUE_MAX)
 		{
-			gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-			curl_easy_cleanup(eh);
-			return SERVER_FAILURE;
+			steque_enqueue(&prefetch_queue, next[i]);
+			prefetch_nqueued++;
+			continue;
 		}
+		// dropped, the path can be picked again later
+		pthread_mutex_unlock(&prefetch_lock);
+		prefetch_done(model, next[i], 0);
+		free(next[i]);
+		pthread_mutex_lock(&prefetch_lock);
+	}
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_lock);
+}
 
-		curl_off_t cl;
-		res = curl_easy_getinfo(eh, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
+ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void *arg)
+{
+	curl_worker_t *worker = (curl_worker_t *)arg;
+	curl_request_t req;
+	char url[BUFSIZE];
+	char tmppath[512];
+	char range[64];
+	struct curl_slist *headers = NULL;
+	CURLcode res;
+	int fd;
+	int cached_fd = -1;
+
+	if (worker->prefetch != NULL)
+	{
+		curl_prefetch_start(worker->prefetch, ctx, path);
+	}
+
+	if (worker->neg != NULL && neg_cache_lookup(worker->neg, path))
+	{
+		gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+		return 0;
+	}
+
+	snprintf(url, sizeof(url), "%s%s", worker->server, path);
+	printf("url %s\n", url);
+
+	ctx->bytes_transferred = 0;
+	memset(&req, 0, sizeof(req));
+	req.ctx = ctx;
+	req.content_len = -1;
+	req.total_len = -1;
+	req.tee_fd = -1;
+	req.out = worker->out;
+	req.out_cap = worker->out_cap;
 
-		if (res != CURLE_OK)
+	if (worker->cache != NULL)
+	{
+		if ((fd = disk_cache_open(worker->cache, path)) >= 0)
 		{
-			fprintf(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
-			curl_easy_cleanup(eh);
-			return SERVER_FAILURE;
+			disk_fresh_t fresh = disk_cache_freshness(worker->cache, fd);
+
+			if (fresh == DISK_STALE)
+			{
+				curl_refresh_start(worker->cache, path, fd);
+			}
+			if (fresh != DISK_EXPIRED)
+			{
+				printf("disk cache hit %s\n", path);
+				return handle_with_fd(ctx, fd);
+			}
+			// too old to serve unchecked, the origin confirms it first
+			cached_fd = fd;
 		}
+	}
 
-		printf("Download size: %" CURL_FORMAT_CURL_OFF_T "\n", cl);
-		gfs_sendheader(ctx, GF_OK, cl);
-		curl_easy_reset(eh);
-		curl_easy_setopt(eh, CURLOPT_URL, url);
-		curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, writecb);
-		curl_easy_setopt(eh, CURLOPT_WRITEDATA, ctx);
-		res = curl_easy_perform(eh);
-		if (res != CURLE_OK)
+	// a fetch of the same object in progress is shared rather than repeated
+	if (worker->flights != NULL && cached_fd < 0)
+	{
+		int leader;
+
+		req.flight = flight_join(worker->flights, path, &leader);
+		if (!leader)
 		{
-			fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-			curl_easy_cleanup(eh);
-			return SERVER_FAILURE;
+			ssize_t n = flight_follow(req.flight, ctx);
+
+			flight_release(req.flight);
+			if (n != FLIGHT_FETCH)
+			{
+				printf("joined fetch of %s\n", path);
+				return n;
+			}
+			req.flight = NULL;
 		}
+	}
 
-		// if (res == CURLE_HTTP_RETURNED_ERROR)
-		// {
-		// 	fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-		// 	gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-		// 	return -1;
-		// }
+	if (worker->cache != NULL)
+	{
+		req.tee_fd = disk_cache_begin(worker->cache, path, tmppath);
+	}
+
+	// asking for the first chunk only, an origin without range support
+	// answers 200 with the whole object and is streamed as usual
+	if (worker->nranges > 1)
+	{
+		snprintf(range, sizeof(range), "0-%d", CURL_RANGE_CHUNK - 1);
+	}
+	if (cached_fd >= 0)
+	{
+		char etag[256];
+		char last_modified[64];
 
-		// if (res != CURLE_OK)
-		// {
-		// 	fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-		// 	gfs_sendheader(ctx, GF_ERROR, 0);
-		// 	curl_easy_cleanup(eh);
-		// 	return SERVER_FAILURE;
-		// }
+		disk_cache_get_validators(cached_fd, etag, sizeof(etag), last_modified, sizeof(last_modified));
+		headers = curl_conditional(etag, last_modified);
+	}
+	// one GET, the header callback settles the status and length before
+	// the first body byte is forwarded
+	__sync_fetch_and_add(&curl_nactive, 1);
+	res = curl_perform_origins(worker, &req, path, worker->nranges > 1 ? range : NULL, headers, url, sizeof(url));
+	curl_slist_free_all(headers);
+	worker->out = req.out;
+	worker->out_cap = req.out_cap;
+	printf("Response code: %ld\n", req.status);
 
-		// long response_code;
-		// curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &response_code);
-		// if (response_code == 404)
-		// {
-		// 	printf("404\n");
-		// 	gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-		// 	return -1;
-		// }
+	if (res == CURLE_OK && req.status == 304 && cached_fd >= 0)
+	{
+		if (req.tee_fd >= 0)
+			cache_finish(worker, &req, res, path, tmppath);
+		printf("disk cache revalidated %s\n", path);
+		__sync_fetch_and_sub(&curl_nactive, 1);
+		return handle_with_fd(ctx, cached_fd);
+	}
+	if (cached_fd >= 0)
+	{
+		close(cached_fd);
+	}
 
-		curl_easy_cleanup(eh);
+	if (res == CURLE_OK && worker->neg != NULL && (req.status == 404 || req.status == 410))
+	{
+		neg_cache_insert(worker->neg, path);
+	}
+
+	if (res != CURLE_OK)
+	{
+		fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+	}
+	else if (req.status == 206 && !req.header_sent)
+	{
+		fprintf(stderr, "range response without an object size\n");
+	}
+	else if (!req.header_sent)
+	{
+		send_held_body(&req);
+	}
+	else if (req.status == 206 && req.body_len < req.total_len)
+	{
+		res = fetch_ranges(worker, &req, url);
+	}
+	__sync_fetch_and_sub(&curl_nactive, 1);
+
+	free(req.buf);
+	if (req.spool != NULL)
+	{
+		fclose(req.spool);
+	}
+
+	if (req.tee_fd >= 0)
+	{
+		cache_finish(worker, &req, res, path, tmppath);
 	}
+	// after the disk cache commit, so later requests find the object there
+	if (req.flight != NULL)
+	{
+		flight_finish(worker->flights, req.flight);
+		flight_release(req.flight);
+	}
+
+	// nothing reached the client yet, let gfserver report the error
+	if (!req.header_sent)
+	{
+		return SERVER_FAILURE;
+	}
+	gfs_cork(ctx, 0);
 
 	printf("file len %zu bytes transferred %ld\n", ctx->file_len, ctx->bytes_transferred);
 
 	return ctx->bytes_transferred;
 }
 
-/*
- * We provide a dummy version of handle_with_file that invokes handle_with_curl
- * as a convenience for linking.  We recommend you simply modify the proxy to
- * call handle_with_curl directly
+// state of one origin transfer driven by the upstream threads, shared with
+// the async handler running on an event loop
+typedef struct curl_transfer_t
+{
+	gfcontext_t *ctx;
+	CURL *eh;
+	upstream_t *up;
+	int thread;               // upstream thread the transfer runs on
+	pthread_mutex_t lock;
+	long status;
+	curl_off_t content_len;
+	int headers_done;
+	int done;
+	int cancelled;            // the handler gave up, the upstream side frees
+	int paused;               // the write callback returned CURL_WRITEFUNC_PAUSE
+	CURLcode result;
+	int header_sent;
+
+	char *buf;                // received but not yet forwarded
+	size_t buf_len;
+	size_t buf_off;
+	size_t buf_cap;
+	FILE *spool;              // body of unknown length beyond CURL_BUFFER_MAX
+	size_t body_len;
+} curl_transfer_t;
+
+static void transfer_free(curl_transfer_t *t)
+{
+	pthread_mutex_destroy(&t->lock);
+	if (t->spool != NULL)
+		fclose(t->spool);
+	free(t->buf);
+	free(t);
+}
+
+static size_t transfer_header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	curl_transfer_t *t = (curl_transfer_t *)userdata;
+	size_t numbytes = size * nitems;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->cancelled)
+	{
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+	if (parse_header(buffer, numbytes, &t->status, &t->content_len))
+	{
+		t->headers_done = 1;
+		gfs_async_wake(t->ctx);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return numbytes;
+}
+
+static size_t transfer_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	curl_transfer_t *t = (curl_transfer_t *)userdata;
+	size_t numbytes = size * nmemb;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->cancelled)
+	{
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+
+	// error pages are dropped, not forwarded
+	if (t->status < 400)
+	{
+		size_t pending = t->buf_len - t->buf_off;
+
+		// without a length nothing is forwarded before the end, so only a
+		// body of known size can wait for the client
+		if (t->content_len >= 0 && pending > 0 && pending + numbytes > CURL_TRANSFER_BUFMAX &&
+			pending + (t->content_len - t->body_len) > CURL_TRANSFER_TAILMAX)
+		{
+			t->paused = 1;
+			pthread_mutex_unlock(&t->lock);
+			return CURL_WRITEFUNC_PAUSE;
+		}
+
+		// the same bound as the blocking path, the rest goes to a file
+		if (t->content_len < 0 && (t->spool != NULL || t->buf_len + numbytes > CURL_BUFFER_MAX))
+		{
+			if (t->spool == NULL && (t->spool = tmpfile()) == NULL)
+			{
+				perror("tmpfile");
+				pthread_mutex_unlock(&t->lock);
+				return 0;
+			}
+			if (fwrite(ptr, 1, numbytes, t->spool) != numbytes)
+			{
+				perror("fwrite");
+				pthread_mutex_unlock(&t->lock);
+				return 0;
+			}
+			t->body_len += numbytes;
+			pthread_mutex_unlock(&t->lock);
+			return numbytes;
+		}
+
+		if (t->buf_off > 0)
+		{
+			memmove(t->buf, t->buf + t->buf_off, t->buf_len - t->buf_off);
+			t->buf_len -= t->buf_off;
+			t->buf_off = 0;
+		}
+		if (t->buf_len + numbytes > t->buf_cap)
+		{
+			size_t cap = t->buf_cap ? t->buf_cap : BUFSIZE;
+			while (cap < t->buf_len + numbytes)
+				cap *= 2;
+			t->buf = realloc(t->buf, cap);
+			t->buf_cap = cap;
+		}
+		memcpy(t->buf + t->buf_len, ptr, numbytes);
+		t->buf_len += numbytes;
+		t->body_len += numbytes;
+		gfs_async_wake(t->ctx);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return numbytes;
+}
+
+// runs on the upstream thread once the easy handle left its multi handle
+void handle_with_curl_done(CURL *eh, CURLcode result)
+{
+	curl_transfer_t *t;
+
+	curl_easy_getinfo(eh, CURLINFO_PRIVATE, (char **)&t);
+	curl_count(eh);
+	pthread_mutex_lock(&async_free_lock);
+	if (async_nfree < CURL_ASYNC_FREE_MAX)
+	{
+		async_free[async_nfree++] = eh;
+		eh = NULL;
+	}
+	pthread_mutex_unlock(&async_free_lock);
+	if (eh != NULL)
+	{
+		curl_easy_cleanup(eh);
+	}
+
+	pthread_mutex_lock(&t->lock);
+	if (t->cancelled)
+	{
+		pthread_mutex_unlock(&t->lock);
+		transfer_free(t);
+		return;
+	}
+	t->done = 1;
+	t->result = result;
+	// wake while holding the lock so the handler cannot finish in between
+	gfs_async_wake(t->ctx);
+	pthread_mutex_unlock(&t->lock);
+}
+
+// called with the lock held once the handler forwarded some of the buffer
+static void transfer_drained(curl_transfer_t *t)
+{
+	if (t->paused && t->buf_len - t->buf_off <= CURL_TRANSFER_BUFMAX / 2)
+	{
+		t->paused = 0;
+		upstream_resume(t->up, t->thread, t->eh);
+	}
+}
+
+// a spooled body is complete, it is read back through the buffer
+static size_t transfer_refill(curl_transfer_t *t)
+{
+	if (t->spool == NULL)
+		return 0;
+	t->buf_off = 0;
+	t->buf_len = fread(t->buf, 1, t->buf_cap, t->spool);
+	return t->buf_len;
+}
+
+// called by the handler when it stops early, whoever is last frees
+static void transfer_abandon(curl_transfer_t *t)
+{
+	int done;
+
+	pthread_mutex_lock(&t->lock);
+	done = t->done;
+	t->cancelled = 1;
+	// a paused transfer only notices when its write callback runs again
+	if (t->paused)
+	{
+		t->paused = 0;
+		upstream_resume(t->up, t->thread, t->eh);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (done)
+	{
+		transfer_free(t);
+	}
+}
 
- __.__
+/*
+ * Async counterpart of handle_with_curl for the epoll engine.  The transfer
+ * runs on the upstream threads passed as arg, this handler only forwards
+ * what has arrived so far and never blocks.
  */
-ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void *arg)
+gfs_async_t handle_with_curl_async(gfcontext_t *ctx, const char *path, void *arg, void **state)
 {
-	return handle_with_curl(ctx, path, arg);
+	curl_worker_t *worker = (curl_worker_t *)arg;
+	curl_transfer_t *t = *state;
+	char url[BUFSIZE];
+
+	if (t == NULL)
+	{
+		CURL *eh;
+
+		if (worker->neg != NULL && neg_cache_lookup(worker->neg, path))
+		{
+			gfs_async_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+			return GFS_ASYNC_DONE;
+		}
+
+		pthread_mutex_lock(&async_free_lock);
+		eh = async_nfree > 0 ? async_free[--async_nfree] : NULL;
+		pthread_mutex_unlock(&async_free_lock);
+		if (eh == NULL && (eh = curl_easy_init()) == NULL)
+		{
+			return GFS_ASYNC_ERROR;
+		}
+
+		t = calloc(1, sizeof(curl_transfer_t));
+		t->ctx = ctx;
+		t->eh = eh;
+		t->up = worker->up;
+		t->content_len = -1;
+		pthread_mutex_init(&t->lock, NULL);
+
+		// no hedging here, the prober keeps the choice current
+		if (worker->origins != NULL)
+			snprintf(url, sizeof(url), "%s%s", worker->origins->origins[origin_pick(worker->origins, -1)].url, path);
+		else
+			snprintf(url, sizeof(url), "%s%s", worker->server, path);
+		printf("url %s\n", url);
+		// curl does not count the time a transfer is paused as a stall
+		curl_prepare(eh, url);
+		curl_easy_setopt(eh, CURLOPT_PRIVATE, t);
+		curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, transfer_header_cb);
+		curl_easy_setopt(eh, CURLOPT_HEADERDATA, t);
+		curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, transfer_write_cb);
+		curl_easy_setopt(eh, CURLOPT_WRITEDATA, t);
+		curl_easy_setopt(eh, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+		// wait for a multiplexed connection rather than opening another one
+		curl_easy_setopt(eh, CURLOPT_PIPEWAIT, 1L);
+
+		*state = t;
+		// the callbacks may run before upstream_add returns
+		pthread_mutex_lock(&t->lock);
+		t->thread = upstream_add(worker->up, eh);
+		pthread_mutex_unlock(&t->lock);
+		return GFS_ASYNC_WAIT;
+	}
+
+	pthread_mutex_lock(&t->lock);
+
+	if (!t->header_sent)
+	{
+		if (t->done && t->result != CURLE_OK)
+		{
+			fprintf(stderr, "curl transfer failed: %s\n", curl_easy_strerror(t->result));
+			pthread_mutex_unlock(&t->lock);
+			transfer_free(t);
+			return GFS_ASYNC_ERROR;
+		}
+
+		// the status is known with the headers, an unknown length only
+		// once the whole body has been received
+		if (!t->headers_done || (t->status >= 400 && !t->done) || (t->content_len < 0 && !t->done))
+		{
+			pthread_mutex_unlock(&t->lock);
+			return GFS_ASYNC_WAIT;
+		}
+
+		printf("Response code: %ld\n", t->status);
+		if (t->status >= 400)
+		{
+			if (worker->neg != NULL && (t->status == 404 || t->status == 410))
+				neg_cache_insert(worker->neg, path);
+			gfs_async_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+			pthread_mutex_unlock(&t->lock);
+			transfer_free(t);
+			return GFS_ASYNC_DONE;
+		}
+
+		gfs_async_sendheader(ctx, GF_OK, t->content_len >= 0 ? t->content_len : t->body_len);
+		t->header_sent = 1;
+		if (t->spool != NULL)
+			rewind(t->spool);
+	}
+
+	while (t->buf_off < t->buf_len || transfer_refill(t) > 0)
+	{
+		ssize_t n = gfs_async_send(ctx, t->buf + t->buf_off, t->buf_len - t->buf_off);
+		if (n < 0)
+		{
+			pthread_mutex_unlock(&t->lock);
+			transfer_abandon(t);
+			return GFS_ASYNC_ERROR;
+		}
+		if (n == 0)
+		{
+			transfer_drained(t);
+			pthread_mutex_unlock(&t->lock);
+			return GFS_ASYNC_WRITABLE;
+		}
+		t->buf_off += n;
+	}
+	t->buf_off = t->buf_len = 0;
+	transfer_drained(t);
+
+	if (t->done)
+	{
+		CURLcode result = t->result;
+		if (result != CURLE_OK)
+		{
+			fprintf(stderr, "curl transfer failed: %s\n", curl_easy_strerror(result));
+		}
+		pthread_mutex_unlock(&t->lock);
+		transfer_free(t);
+		return result == CURLE_OK ? GFS_ASYNC_DONE : GFS_ASYNC_ERROR;
+	}
+
+	pthread_mutex_unlock(&t->lock);
+	return GFS_ASYNC_WAIT;
 }
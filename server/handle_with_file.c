@@ -1,7 +1,10 @@
 #include "gfserver.h"
+#include "gfserver_epoll.h"
 #include "proxy-student.h"
+#include "gfserver_send.h"
 
 #define BUFSIZE (512)
+#define ASYNC_BUFSIZE (16384)
 
 /*
  * This version of handle_with_file is provided to illustrate the use of
@@ -9,14 +12,11 @@
  */
 ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void* arg){
 	int fildes;
-	size_t file_len, bytes_transferred;
-	ssize_t read_len, write_len;
 	char buffer[BUFSIZE];
 	char *data_dir = arg;
-	struct stat statbuf;
 
 	strncpy(buffer,data_dir, BUFSIZE);
-	strncat(buffer,path, BUFSIZE);
+	strncat(buffer,path, BUFSIZE - strlen(buffer) - 1);
 
 	if( 0 > (fildes = open(buffer, O_RDONLY))){
 		if (errno == ENOENT)
@@ -27,31 +27,133 @@ ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void* arg){
 			return SERVER_FAILURE;
 	}
 
+	return handle_with_fd(ctx, fildes);
+}
+
+/*
+ * Sends an already opened file, also used for disk cache hits.  Closes
+ * fildes.
+ */
+ssize_t handle_with_fd(gfcontext_t *ctx, int fildes){
+	size_t file_len;
+	ssize_t bytes_transferred;
+	struct stat statbuf;
+
 	/* Calculating the file size */
 	if (0 > fstat(fildes, &statbuf)) {
+		close(fildes);
 		return SERVER_FAILURE;
 	}
 
 	file_len = (size_t) statbuf.st_size;
 
+	/* Corked, so the header leaves in the first segment of the body. */
+	gfs_cork(ctx, 1);
 	gfs_sendheader(ctx, GF_OK, file_len);
 
-	/* Sending the file contents chunk by chunk. */
-	bytes_transferred = 0;
-	while(bytes_transferred < file_len){
-		read_len = read(fildes, buffer, BUFSIZE);
-		if (read_len <= 0){
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-			return SERVER_FAILURE;
-		}
-		write_len = gfs_send(ctx, buffer, read_len);
-		if (write_len != read_len){
-			fprintf(stderr, "handle_with_file write error");
-			return SERVER_FAILURE;
-		}
-		bytes_transferred += write_len;
+	/* Streaming the file contents straight to the socket. */
+	bytes_transferred = gfs_sendfile(ctx, fildes, 0, file_len);
+	gfs_cork(ctx, 0);
+	if (bytes_transferred != file_len){
+		fprintf(stderr, "handle_with_file send error, %zd, %zu", bytes_transferred, file_len);
 	}
 
+	close(fildes);
 	return bytes_transferred;
 }
 
+typedef struct file_state_t{
+	int fildes;
+	size_t file_len;
+	off_t bytes_read;
+	int no_sendfile;
+	size_t buf_len;
+	size_t buf_off;
+	char buffer[ASYNC_BUFSIZE];
+} file_state_t;
+
+static gfs_async_t _file_state_done(file_state_t *state, gfs_async_t status){
+	close(state->fildes);
+	free(state);
+	return status;
+}
+
+/*
+ * Event loop version of handle_with_file for gfserver_epoll.  Sends as much
+ * as the socket takes and returns to the loop instead of blocking on it.
+ */
+gfs_async_t handle_with_file_async(gfcontext_t *ctx, const char *path, void* arg, void **statep){
+	file_state_t *state = *statep;
+	char *data_dir = arg;
+
+	if (state == NULL){
+		char buffer[BUFSIZE];
+		struct stat statbuf;
+		int fildes;
+
+		strncpy(buffer,data_dir, BUFSIZE);
+		strncat(buffer,path, BUFSIZE - strlen(buffer) - 1);
+
+		if( 0 > (fildes = open(buffer, O_RDONLY))){
+			if (errno == ENOENT){
+				gfs_async_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+				return GFS_ASYNC_DONE;
+			}
+			return GFS_ASYNC_ERROR;
+		}
+
+		if (0 > fstat(fildes, &statbuf)) {
+			close(fildes);
+			return GFS_ASYNC_ERROR;
+		}
+
+		state = malloc(sizeof(file_state_t));
+		state->fildes = fildes;
+		state->file_len = (size_t) statbuf.st_size;
+		state->bytes_read = 0;
+		state->no_sendfile = 0;
+		state->buf_len = 0;
+		state->buf_off = 0;
+		*statep = state;
+
+		gfs_async_sendheader(ctx, GF_OK, state->file_len);
+	}
+
+	while (ctx->bytes_transferred < state->file_len){
+		ssize_t len;
+
+		// zero copy while the file supports it, buffered otherwise
+		if (!state->no_sendfile){
+			len = gfs_async_sendfile(ctx, state->fildes, &state->bytes_read, state->file_len - state->bytes_read);
+			if (len < 0 && (errno == EINVAL || errno == ENOSYS)){
+				state->no_sendfile = 1;
+				continue;
+			}
+			if (len < 0)
+				return _file_state_done(state, GFS_ASYNC_ERROR);
+			if (len == 0)
+				return GFS_ASYNC_WRITABLE;
+			continue;
+		}
+
+		if (state->buf_off == state->buf_len){
+			len = pread(state->fildes, state->buffer, ASYNC_BUFSIZE, state->bytes_read);
+			if (len <= 0){
+				fprintf(stderr, "handle_with_file_async read error, %zd, %zu, %zu", len, (size_t)state->bytes_read, state->file_len);
+				return _file_state_done(state, GFS_ASYNC_ERROR);
+			}
+			state->bytes_read += len;
+			state->buf_len = len;
+			state->buf_off = 0;
+		}
+
+		len = gfs_async_send(ctx, state->buffer + state->buf_off, state->buf_len - state->buf_off);
+		if (len < 0)
+			return _file_state_done(state, GFS_ASYNC_ERROR);
+		if (len == 0)
+			return GFS_ASYNC_WRITABLE;
+		state->buf_off += len;
+	}
+
+	return _file_state_done(state, GFS_ASYNC_DONE);
+}
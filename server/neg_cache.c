@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "neg_cache.h"
+
+struct neg_entry_t
+{
+	char *key;
+	long long expires;        // CLOCK_MONOTONIC, ms
+	neg_entry_t *hnext;
+	neg_entry_t *next;        // next younger entry
+};
+
+static size_t _hash(const char *key)
+{
+	size_t h = 5381;
+
+	while (*key)
+	{
+		h = h * 33 + (unsigned char)*key++;
+	}
+
+	return h;
+}
+
+static long long _now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// takes the oldest entry out of its stripe, called with the lock held
+static void _drop_oldest(neg_stripe_t *s)
+{
+	neg_entry_t *e = s->oldest;
+	neg_entry_t **pp = &s->buckets[_hash(e->key) / NEG_CACHE_STRIPES % NEG_CACHE_BUCKETS];
+
+	while (*pp != e)
+	{
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+
+	s->oldest = e->next;
+	if (s->oldest == NULL)
+	{
+		s->newest = NULL;
+	}
+	s->count--;
+
+	free(e->key);
+	free(e);
+}
+
+void neg_cache_init(neg_cache_t *cache, size_t max_entries, long ttl_ms)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->ttl_ms = ttl_ms;
+	cache->max_per_stripe = max_entries / NEG_CACHE_STRIPES;
+	if (cache->max_per_stripe == 0)
+	{
+		cache->max_per_stripe = 1;
+	}
+
+	for (int i = 0; i < NEG_CACHE_STRIPES; i++)
+	{
+		pthread_mutex_init(&cache->stripes[i].lock, NULL);
+	}
+}
+
+int neg_cache_lookup(neg_cache_t *cache, const char *key)
+{
+	size_t h = _hash(key);
+	neg_stripe_t *s = &cache->stripes[h % NEG_CACHE_STRIPES];
+	long long now = _now_ms();
+	neg_entry_t *e;
+
+	pthread_mutex_lock(&s->lock);
+	while (s->oldest != NULL && s->oldest->expires <= now)
+	{
+		_drop_oldest(s);
+	}
+
+	for (e = s->buckets[h / NEG_CACHE_STRIPES % NEG_CACHE_BUCKETS]; e != NULL; e = e->hnext)
+	{
+		if (strcmp(e->key, key) == 0)
+			break;
+	}
+	if (e != NULL)
+		s->nhits++;
+	else
+		s->nmisses++;
+	pthread_mutex_unlock(&s->lock);
+
+	return e != NULL;
+}
+
+void neg_cache_insert(neg_cache_t *cache, const char *key)
+{
+	size_t h = _hash(key);
+	neg_stripe_t *s = &cache->stripes[h % NEG_CACHE_STRIPES];
+	neg_entry_t **bucket = &s->buckets[h / NEG_CACHE_STRIPES % NEG_CACHE_BUCKETS];
+	neg_entry_t *e;
+
+	pthread_mutex_lock(&s->lock);
+	// a concurrent miss for the same path may have added it already
+	for (e = *bucket; e != NULL; e = e->hnext)
+	{
+		if (strcmp(e->key, key) == 0)
+		{
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+	}
+
+	if (s->count >= cache->max_per_stripe)
+	{
+		_drop_oldest(s);
+	}
+
+	e = malloc(sizeof(neg_entry_t));
+	e->key = strdup(key);
+	e->expires = _now_ms() + cache->ttl_ms;
+	e->next = NULL;
+	e->hnext = *bucket;
+	*bucket = e;
+
+	if (s->newest != NULL)
+		s->newest->next = e;
+	else
+		s->oldest = e;
+	s->newest = e;
+	s->count++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void neg_cache_stats(neg_cache_t *cache, unsigned long *nhits, unsigned long *nmisses, size_t *count)
+{
+	*nhits = *nmisses = 0;
+	*count = 0;
+
+	for (int i = 0; i < NEG_CACHE_STRIPES; i++)
+	{
+		*nhits += cache->stripes[i].nhits;
+		*nmisses += cache->stripes[i].nmisses;
+		*count += cache->stripes[i].count;
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef __NEG_CACHE_H__
+#define __NEG_CACHE_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Bounded memory cache of paths the origin reported as missing, so repeated
+ * requests for them are answered without an upstream round trip.
+ *
+ * Entries live for a fixed time.  The table is split into stripes with one
+ * lock each, a path always maps to the same stripe.  All entries of a
+ * stripe share the same lifetime, so its insertion order is also its expiry
+ * order: expired and evicted entries are always taken from the old end.
+ */
+
+#define NEG_CACHE_STRIPES 16
+#define NEG_CACHE_BUCKETS 256     // per stripe
+#define NEG_CACHE_MAX 65536       // paths the proxy remembers
+
+typedef struct neg_entry_t neg_entry_t;
+
+typedef struct neg_stripe_t
+{
+	pthread_mutex_t lock;
+	neg_entry_t *buckets[NEG_CACHE_BUCKETS];
+	neg_entry_t *oldest;
+	neg_entry_t *newest;
+	size_t count;
+	unsigned long nhits;
+	unsigned long nmisses;
+} neg_stripe_t;
+
+typedef struct neg_cache_t
+{
+	long ttl_ms;
+	size_t max_per_stripe;
+	neg_stripe_t stripes[NEG_CACHE_STRIPES];
+} neg_cache_t;
+
+void neg_cache_init(neg_cache_t *cache, size_t max_entries, long ttl_ms);
+
+// returns 1 if key was reported missing less than ttl_ms ago
+int neg_cache_lookup(neg_cache_t *cache, const char *key);
+
+void neg_cache_insert(neg_cache_t *cache, const char *key);
+
+// sums the counters of all stripes without taking their locks, so it is
+// safe from a signal handler
+void neg_cache_stats(neg_cache_t *cache, unsigned long *nhits, unsigned long *nmisses, size_t *count);
+
+#endif // __NEG_CACHE_H__
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+#include "origin_set.h"
+
+// hedge delay until enough latencies were seen
+#define ORIGIN_HEDGE_DEFAULT_MS 200
+#define ORIGIN_EWMA_WEIGHT 0.2
+
+static int _by_value(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+// called with the lock held
+static void _update(origin_t *o, int ok, double header_ms)
+{
+	if (ok)
+	{
+		o->ewma_ms = o->ewma_ms == 0 ? header_ms : o->ewma_ms + ORIGIN_EWMA_WEIGHT * (header_ms - o->ewma_ms);
+		o->fails = 0;
+		o->down = 0;
+	}
+	else if (++o->fails >= ORIGIN_FAILS_DOWN)
+	{
+		o->down = 1;
+	}
+}
+
+// called with the lock held, a sort of the sample ring every 16 samples
+static void _update_hedge(origin_set_t *set)
+{
+	double sorted[ORIGIN_SAMPLES];
+	long ms;
+
+	if (set->nsamples < 16 || set->next_sample % 16 != 0)
+	{
+		return;
+	}
+
+	memcpy(sorted, set->samples, set->nsamples * sizeof(double));
+	qsort(sorted, set->nsamples, sizeof(double), _by_value);
+	ms = (long)sorted[(set->nsamples - 1) * set->percentile / 100];
+
+	if (ms < ORIGIN_HEDGE_MIN_MS)
+		ms = ORIGIN_HEDGE_MIN_MS;
+	if (ms > ORIGIN_HEDGE_MAX_MS)
+		ms = ORIGIN_HEDGE_MAX_MS;
+	set->hedge_ms = ms;
+}
+
+void origin_set_init(origin_set_t *set, int percentile)
+{
+	memset(set, 0, sizeof(*set));
+	pthread_mutex_init(&set->lock, NULL);
+	set->percentile = percentile;
+	set->hedge_ms = ORIGIN_HEDGE_DEFAULT_MS;
+}
+
+int origin_set_add(origin_set_t *set, const char *url)
+{
+	if (set->n == ORIGIN_MAX)
+	{
+		return -1;
+	}
+
+	snprintf(set->origins[set->n].url, sizeof(set->origins[set->n].url), "%s", url);
+
+	return set->n++;
+}
+
+static void *_probe_main(void *arg)
+{
+	origin_set_t *set = arg;
+	CURL *eh = curl_easy_init();
+	char url[300];
+
+	while (1)
+	{
+		for (int i = 0; i < set->n; i++)
+		{
+			curl_off_t us = 0;
+			CURLcode res;
+
+			// any HTTP answer means the origin is up
+			snprintf(url, sizeof(url), "%s/", set->origins[i].url);
+			curl_easy_reset(eh);
+			curl_easy_setopt(eh, CURLOPT_URL, url);
+			curl_easy_setopt(eh, CURLOPT_NOBODY, 1L);
+			curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, (long)ORIGIN_PROBE_MS);
+			res = curl_easy_perform(eh);
+			curl_easy_getinfo(eh, CURLINFO_STARTTRANSFER_TIME_T, &us);
+
+			pthread_mutex_lock(&set->lock);
+			if (res != CURLE_OK && !set->origins[i].down && set->origins[i].fails + 1 >= ORIGIN_FAILS_DOWN)
+				printf("origin %s is down: %s\n", set->origins[i].url, curl_easy_strerror(res));
+			else if (res == CURLE_OK && set->origins[i].down)
+				printf("origin %s is back\n", set->origins[i].url);
+			_update(&set->origins[i], res == CURLE_OK, us / 1000.0);
+			pthread_mutex_unlock(&set->lock);
+		}
+		usleep(ORIGIN_PROBE_MS * 1000);
+	}
+
+	return NULL;
+}
+
+void origin_set_start(origin_set_t *set)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, _probe_main, set) != 0)
+	{
+		fprintf(stderr, "Can't create origin prober\n");
+		exit(1);
+	}
+}
+
+int origin_pick(origin_set_t *set, int exclude)
+{
+	int best = -1;
+
+	pthread_mutex_lock(&set->lock);
+	for (int i = 0; i < set->n; i++)
+	{
+		origin_t *o = &set->origins[i];
+
+		if (i == exclude)
+			continue;
+		// up beats down, then the lower latency wins
+		if (best < 0 || (set->origins[best].down && !o->down) ||
+			(set->origins[best].down == o->down && o->ewma_ms < set->origins[best].ewma_ms))
+			best = i;
+	}
+	if (best >= 0)
+	{
+		set->origins[best].nrequests++;
+	}
+	pthread_mutex_unlock(&set->lock);
+
+	return best;
+}
+
+void origin_report(origin_set_t *set, int origin, int ok, double header_ms)
+{
+	pthread_mutex_lock(&set->lock);
+	_update(&set->origins[origin], ok, header_ms);
+	if (ok)
+	{
+		set->samples[set->next_sample] = header_ms;
+		set->next_sample = (set->next_sample + 1) % ORIGIN_SAMPLES;
+		if (set->nsamples < ORIGIN_SAMPLES)
+			set->nsamples++;
+		_update_hedge(set);
+	}
+	pthread_mutex_unlock(&set->lock);
+}
+
+long origin_hedge_ms(origin_set_t *set)
+{
+	long ms;
+
+	if (set->percentile <= 0)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	ms = set->hedge_ms;
+	pthread_mutex_unlock(&set->lock);
+
+	return ms;
+}
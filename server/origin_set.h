@@ -0,0 +1,67 @@
+#ifndef __ORIGIN_SET_H__
+#define __ORIGIN_SET_H__
+
+#include <pthread.h>
+
+/*
+ * The origins a proxy can fetch from, interchangeable copies of the same
+ * content.  Requests go to the healthy origin with the lowest smoothed
+ * time to first header.  A prober thread requests every origin once per
+ * ORIGIN_PROBE_MS, so latencies stay current and an origin that went down
+ * is noticed, and taken back once it answers again.
+ *
+ * The set also keeps the recent header latencies of all requests; the
+ * hedge delay is a percentile of them.
+ */
+
+#define ORIGIN_MAX 8
+#define ORIGIN_SAMPLES 256
+#define ORIGIN_FAILS_DOWN 3       // consecutive failures that mark an origin down
+#define ORIGIN_PROBE_MS 1000
+#define ORIGIN_HEDGE_MIN_MS 2
+#define ORIGIN_HEDGE_MAX_MS 2000
+
+typedef struct origin_t
+{
+	char url[256];
+	double ewma_ms;           // time to first header
+	int fails;
+	int down;
+	unsigned long nrequests;
+} origin_t;
+
+typedef struct origin_set_t
+{
+	int n;
+	origin_t origins[ORIGIN_MAX];
+	pthread_mutex_t lock;
+
+	int percentile;           // of the header latencies, 0 disables hedging
+	double samples[ORIGIN_SAMPLES];
+	int nsamples;
+	int next_sample;
+	long hedge_ms;
+
+	unsigned long nhedges;    // duplicate requests sent
+	unsigned long nhedge_wins; // duplicates that answered first
+} origin_set_t;
+
+void origin_set_init(origin_set_t *set, int percentile);
+
+// returns -1 when the set is full
+int origin_set_add(origin_set_t *set, const char *url);
+
+// starts the prober thread, needs curl_global_init
+void origin_set_start(origin_set_t *set);
+
+// best origin other than exclude (-1 for none), falls back to a down one
+// when nothing else is left; returns -1 if the set has no other origin
+int origin_pick(origin_set_t *set, int exclude);
+
+// outcome of one request, header_ms is only used when ok
+void origin_report(origin_set_t *set, int origin, int ok, double header_ms);
+
+// how long to wait for headers before hedging, -1 if hedging is off
+long origin_hedge_ms(origin_set_t *set);
+
+#endif // __ORIGIN_SET_H__
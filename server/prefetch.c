@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prefetch.h"
+
+typedef struct prefetch_next_t
+{
+	prefetch_node_t *node;
+	unsigned count;
+} prefetch_next_t;
+
+struct prefetch_node_t
+{
+	char *path;
+	prefetch_node_t *hnext;
+	unsigned total;           // transitions out of this path
+	prefetch_next_t next[PREFETCH_NEXT];
+	int pending;              // a prefetch is queued or running
+	int prefetched;           // in the cache because of a prefetch
+};
+
+static size_t _hash(const char *key)
+{
+	size_t h = 5381;
+
+	while (*key)
+	{
+		h = h * 33 + (unsigned char)*key++;
+	}
+
+	return h;
+}
+
+// called with the lock held, returns NULL once the model is full
+static prefetch_node_t *_node(prefetch_t *pf, const char *path)
+{
+	prefetch_node_t **bucket = &pf->buckets[_hash(path) % PREFETCH_BUCKETS];
+	prefetch_node_t *n;
+
+	for (n = *bucket; n != NULL; n = n->hnext)
+	{
+		if (strcmp(n->path, path) == 0)
+			return n;
+	}
+	if (pf->npaths == PREFETCH_MAX_PATHS)
+	{
+		return NULL;
+	}
+
+	n = calloc(1, sizeof(prefetch_node_t));
+	n->path = strdup(path);
+	n->hnext = *bucket;
+	*bucket = n;
+	pf->npaths++;
+
+	return n;
+}
+
+// called with the lock held
+static void _count(prefetch_node_t *from, prefetch_node_t *to)
+{
+	prefetch_next_t *least = &from->next[0];
+	int i;
+
+	for (i = 0; i < PREFETCH_NEXT; i++)
+	{
+		if (from->next[i].node == to)
+			break;
+		if (from->next[i].count < least->count)
+			least = &from->next[i];
+	}
+
+	// a new successor replaces the least frequent one
+	if (i == PREFETCH_NEXT)
+	{
+		from->total -= least->count;
+		least->node = to;
+		least->count = 0;
+		i = least - from->next;
+	}
+	from->next[i].count++;
+	from->total++;
+
+	// old habits fade, so a changed sequence is learned again
+	if (from->total >= PREFETCH_AGE)
+	{
+		from->total = 0;
+		for (i = 0; i < PREFETCH_NEXT; i++)
+		{
+			from->next[i].count /= 2;
+			from->total += from->next[i].count;
+		}
+	}
+}
+
+void prefetch_init(prefetch_t *pf)
+{
+	memset(pf, 0, sizeof(*pf));
+	pthread_mutex_init(&pf->lock, NULL);
+}
+
+int prefetch_observe(prefetch_t *pf, unsigned long client, const char *path, char **next, int max)
+{
+	prefetch_client_t *c = &pf->clients[client % PREFETCH_CLIENTS];
+	prefetch_node_t *n;
+	int count = 0;
+
+	pthread_mutex_lock(&pf->lock);
+	if ((n = _node(pf, path)) == NULL)
+	{
+		pthread_mutex_unlock(&pf->lock);
+		return 0;
+	}
+
+	if (n->prefetched)
+	{
+		n->prefetched = 0;
+		pf->nhits++;
+	}
+	if (c->id == client && c->last != NULL && c->last != n)
+	{
+		_count(c->last, n);
+	}
+	c->id = client;
+	c->last = n;
+
+	// follows the most likely successors, so the objects are in the cache
+	// even when the client asks sooner than the origin answers
+	for (int depth = 0; depth < PREFETCH_DEPTH && count < max; depth++)
+	{
+		prefetch_next_t *best = NULL;
+
+		for (int i = 0; i < PREFETCH_NEXT; i++)
+		{
+			prefetch_next_t *s = &n->next[i];
+
+			if (s->node != NULL && s->node != c->last && s->count >= PREFETCH_MIN_COUNT &&
+				s->count * 100 >= n->total * PREFETCH_MIN_PERCENT && (best == NULL || s->count > best->count))
+				best = s;
+		}
+		if (best == NULL)
+			break;
+
+		n = best->node;
+		if (!n->pending && !n->prefetched)
+		{
+			n->pending = 1;
+			next[count++] = strdup(n->path);
+		}
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	return count;
+}
+
+void prefetch_done(prefetch_t *pf, const char *path, int ok)
+{
+	prefetch_node_t *n;
+
+	pthread_mutex_lock(&pf->lock);
+	if ((n = _node(pf, path)) != NULL)
+	{
+		n->pending = 0;
+		if (ok)
+		{
+			n->prefetched = 1;
+			pf->nprefetches++;
+		}
+	}
+	pthread_mutex_unlock(&pf->lock);
+}
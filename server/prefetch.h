@@ -0,0 +1,58 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Learns which path a client tends to request after another one.  Every
+ * path keeps counts of the paths the same client requested next, the few
+ * most frequent of them are kept.  Once a successor has been seen often
+ * enough and makes up a large enough share of the transitions, a request
+ * for the path names it as worth prefetching, and so on along the most
+ * likely successors up to PREFETCH_DEPTH paths ahead.
+ *
+ * The model also keeps the hit counter: a path prefetched and requested
+ * afterwards is a hit.
+ */
+
+#define PREFETCH_BUCKETS 1024
+#define PREFETCH_MAX_PATHS 16384  // paths the model learns, later ones are ignored
+#define PREFETCH_NEXT 4           // successors kept per path
+#define PREFETCH_CLIENTS 256      // clients whose last request is remembered
+#define PREFETCH_MIN_COUNT 2
+#define PREFETCH_MIN_PERCENT 30   // of the transitions out of a path
+#define PREFETCH_AGE 1024         // transition counts are halved at this total
+#define PREFETCH_DEPTH 4
+
+typedef struct prefetch_node_t prefetch_node_t;
+
+typedef struct prefetch_client_t
+{
+	unsigned long id;
+	prefetch_node_t *last;
+} prefetch_client_t;
+
+typedef struct prefetch_t
+{
+	pthread_mutex_t lock;
+	prefetch_node_t *buckets[PREFETCH_BUCKETS];
+	size_t npaths;
+	prefetch_client_t clients[PREFETCH_CLIENTS];
+
+	unsigned long nprefetches; // objects prefetched
+	unsigned long nhits;      // prefetched objects requested afterwards
+} prefetch_t;
+
+void prefetch_init(prefetch_t *pf);
+
+// records that client requested path; fills next with up to max paths
+// likely requested after it that are not being prefetched already and
+// returns their number, the caller frees them
+int prefetch_observe(prefetch_t *pf, unsigned long client, const char *path, char **next, int max);
+
+// a prefetch of path returned by prefetch_observe ended, ok if the object
+// is in the cache now
+void prefetch_done(prefetch_t *pf, const char *path, int ok);
+
+#endif // __PREFETCH_H__
@@ -5,4 +5,63 @@
  #ifndef __SERVER_STUDENT_H__836
  #define __SERVER_STUDENT_H__836
  
+ #include <curl/curl.h>
+ #include "upstream.h"
+ #include "disk_cache.h"
+ #include "neg_cache.h"
+ #include "origin_set.h"
+ #include "flight.h"
+ #include "prefetch.h"
+ #include "gfserver.h"
+
+ // one per gfserver worker, passed as its GFS_WORKER_ARG so the easy handle
+ // and its connections outlive a single request
+ typedef struct curl_worker_t
+ {
+   CURL *eh;
+   const char *server;
+   origin_set_t *origins; // set when requests pick among several origins
+   CURLM *attempt_multi;
+   CURL *hedge_eh;   // second attempt of a hedged request
+   upstream_t *up;   // set when transfers run on the curl_multi threads
+   disk_cache_t *cache; // set when objects are kept on local disk
+   neg_cache_t *neg; // set when origin 404s are remembered
+   flight_table_t *flights; // set when concurrent fetches are shared
+   prefetch_t *prefetch; // set when likely next objects are prefetched
+
+   int nranges;      // large objects are fetched as this many parallel ranges
+   CURLM *range_multi;
+   CURL **range_eh;
+
+   char *out;        // body waiting for a slow client, kept between requests
+   size_t out_cap;
+ } curl_worker_t;
+
+ // objects larger than one chunk are fetched chunk by chunk in parallel,
+ // a range request for the first chunk tells whether the origin can
+ #define CURL_RANGE_CHUNK (1 << 20)
+ #define CURL_RANGE_MAX_PARTS 16
+
+ // upstream connections opened and requests made by all workers
+ extern unsigned long curl_nconnects;
+ extern unsigned long curl_nrequests;
+ // objects fetched in parallel ranges and the range requests made for them
+ extern unsigned long curl_nranged;
+ extern unsigned long curl_nparts;
+
+ // creates the handles, they share DNS, TLS session and connection caches
+ void curl_workers_init(curl_worker_t *workers, int nworkers, const char *server);
+ void curl_workers_cleanup(curl_worker_t *workers, int nworkers);
+
+ // starts the threads that revalidate stale disk cache objects
+ void curl_refresh_init(const char *server, origin_set_t *origins, disk_cache_t *cache);
+
+ // starts the thread that prefetches into the disk cache, at most budget
+ // bytes per second and only while fewer than max_active requests fetch
+ void curl_prefetch_init(const char *server, origin_set_t *origins, disk_cache_t *cache, neg_cache_t *neg,
+                         flight_table_t *flights, prefetch_t *model, long budget, int max_active);
+
+ // sends an open file, used for local files and disk cache hits
+ ssize_t handle_with_fd(gfcontext_t *ctx, int fildes);
+
  #endif // __SERVER_STUDENT_H__836
\ No newline at end of file
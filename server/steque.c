@@ -17,6 +17,19 @@
 #define STEQUE_FAILURE (-1)
 #endif // STEQUE_FAILURE
 
+unsigned long steque_nallocs = 0;
+
+/* Every steque keeps the nodes it popped chained behind its last item and
+   reuses them in place, so a queue allocates only up to its deepest point
+   and no lock is shared between queues.  The chain from front is the N
+   items followed by the spare nodes; back is the last item, NULL when
+   there is none. */
+
+static steque_node_t* _node_new(){
+  __sync_fetch_and_add(&steque_nallocs, 1);
+  return (steque_node_t*) malloc(sizeof(steque_node_t));
+}
+
 void steque_init(steque_t *this){
   this->front = NULL;
   this->back = NULL;
@@ -26,15 +39,17 @@ void steque_init(steque_t *this){
 void steque_enqueue(steque_t* this, steque_item item){
   steque_node_t* node;
 
-  node = (steque_node_t*) malloc(sizeof(steque_node_t));
-  node->item = item;
-  node->next = NULL;
-  
-  if(this->back == NULL)
-    this->front = node;
-  else
-    this->back->next = node;
+  node = this->back == NULL ? this->front : this->back->next;
+  if (node == NULL){
+    node = _node_new();
+    node->next = NULL;
+    if(this->back == NULL)
+      this->front = node;
+    else
+      this->back->next = node;
+  }
 
+  node->item = item;
   this->back = node;
   this->N++;
 }
@@ -42,13 +57,19 @@ void steque_enqueue(steque_t* this, steque_item item){
 void steque_push(steque_t* this, steque_item item){
   steque_node_t* node;
 
-  node = (steque_node_t*) malloc(sizeof(steque_node_t));
+  if(this->back == NULL){
+    steque_enqueue(this, item);
+    return;
+  }
+
+  node = this->back->next;
+  if (node != NULL)
+    this->back->next = node->next;
+  else
+    node = _node_new();
   node->item = item;
   node->next = this->front;
 
-  if(this->back == NULL)
-    this->back = node;
-  
   this->front = node;
   this->N++;
 }
@@ -65,7 +86,7 @@ steque_item steque_pop(steque_t* this){
   steque_item ans;
   steque_node_t* node;
   
-  if(this->front == NULL){
+  if(this->N == 0){
     fprintf(stderr, "Error: underflow in steque_pop.\n");
     fflush(stderr);
     exit(STEQUE_FAILURE);
@@ -73,28 +94,36 @@ steque_item steque_pop(steque_t* this){
 
   node = this->front;
   ans = node->item;
+  this->N--;
 
-  this->front = this->front->next;
-  if (this->front == NULL) this->back = NULL;
-  free(node);
+  /* the last item's node already heads the spares */
+  if (this->N == 0){
+    this->back = NULL;
+    return ans;
+  }
 
-  this->N--;
+  this->front = node->next;
+  node->next = this->back->next;
+  this->back->next = node;
 
   return ans;
 }
 
 void steque_cycle(steque_t* this){
-  if(this->back == NULL)
+  steque_node_t* node;
+
+  if(this->N < 2)
     return;
   
-  this->back->next = this->front;
-  this->back = this->front;
-  this->front = this->front->next;
-  this->back->next = NULL;
+  node = this->front;
+  this->front = node->next;
+  node->next = this->back->next;
+  this->back->next = node;
+  this->back = node;
 }
 
 steque_item steque_front(steque_t* this){
-  if(this->front == NULL){
+  if(this->N == 0){
     fprintf(stderr, "Error: underflow in steque_front.\n");
     fflush(stderr);
     exit(STEQUE_FAILURE);
@@ -104,6 +133,87 @@ steque_item steque_front(steque_t* this){
 }
 
 void steque_destroy(steque_t* this){
-  while(!steque_isempty(this))
-    steque_pop(this);
+  while(this->front != NULL){
+    steque_node_t* node = this->front;
+    this->front = node->next;
+    free(node);
+  }
+  this->back = NULL;
+  this->N = 0;
+}
+
+void steque_ring_init(steque_ring_t* this, int capacity){
+  this->items = (steque_item*) malloc(capacity * sizeof(steque_item));
+  this->capacity = capacity;
+  this->head = 0;
+  this->N = 0;
+}
+
+int steque_ring_isempty(steque_ring_t* this){
+  return this->N == 0;
+}
+
+int steque_ring_isfull(steque_ring_t* this){
+  return this->N == this->capacity;
+}
+
+int steque_ring_size(steque_ring_t* this){
+  return this->N;
+}
+
+void steque_ring_enqueue(steque_ring_t* this, steque_item item){
+  if(this->N == this->capacity){
+    fprintf(stderr, "Error: overflow in steque_ring_enqueue.\n");
+    fflush(stderr);
+    exit(STEQUE_FAILURE);
+  }
+
+  this->items[(this->head + this->N) % this->capacity] = item;
+  this->N++;
+}
+
+void steque_ring_push(steque_ring_t* this, steque_item item){
+  if(this->N == this->capacity){
+    fprintf(stderr, "Error: overflow in steque_ring_push.\n");
+    fflush(stderr);
+    exit(STEQUE_FAILURE);
+  }
+
+  this->head = (this->head + this->capacity - 1) % this->capacity;
+  this->items[this->head] = item;
+  this->N++;
+}
+
+steque_item steque_ring_pop(steque_ring_t* this){
+  steque_item ans;
+
+  if(this->N == 0){
+    fprintf(stderr, "Error: underflow in steque_ring_pop.\n");
+    fflush(stderr);
+    exit(STEQUE_FAILURE);
+  }
+
+  ans = this->items[this->head];
+  this->head = (this->head + 1) % this->capacity;
+  this->N--;
+
+  return ans;
+}
+
+steque_item steque_ring_front(steque_ring_t* this){
+  if(this->N == 0){
+    fprintf(stderr, "Error: underflow in steque_ring_front.\n");
+    fflush(stderr);
+    exit(STEQUE_FAILURE);
+  }
+
+  return this->items[this->head];
+}
+
+void steque_ring_destroy(steque_ring_t* this){
+  free(this->items);
+  this->items = NULL;
+  this->capacity = 0;
+  this->head = 0;
+  this->N = 0;
 }
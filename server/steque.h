@@ -14,6 +14,17 @@ typedef struct{
   int N;
 }steque_t;
 
+/* Fixed-capacity variant backed by a circular array; never allocates after init */
+typedef struct{
+  steque_item* items;
+  int capacity;
+  int head;
+  int N;
+}steque_ring_t;
+
+/* Number of node allocations made by steque_enqueue/steque_push so far */
+extern unsigned long steque_nallocs;
+
 
 /* Initializes the data structure */
 void steque_init(steque_t* this);
@@ -42,4 +53,31 @@ steque_item steque_front(steque_t* this);
 /* Empties the steque and performs any necessary memory cleanup */
 void steque_destroy(steque_t* this);
 
+/* Initializes the ring to hold at most capacity elements */
+void steque_ring_init(steque_ring_t* this, int capacity);
+
+/* Return 1 if empty, 0 otherwise */
+int steque_ring_isempty(steque_ring_t* this);
+
+/* Return 1 if full, 0 otherwise */
+int steque_ring_isfull(steque_ring_t* this);
+
+/* Returns the number of elements in the ring */
+int steque_ring_size(steque_ring_t* this);
+
+/* Adds an element to the "back" of the ring */
+void steque_ring_enqueue(steque_ring_t* this, steque_item item);
+
+/* Adds an element to the "front" of the ring */
+void steque_ring_push(steque_ring_t* this, steque_item item);
+
+/* Removes an element from the "front" of the ring */
+steque_item steque_ring_pop(steque_ring_t* this);
+
+/* Returns the element at the "front" of the ring without removing it*/
+steque_item steque_ring_front(steque_ring_t* this);
+
+/* Releases the backing array */
+void steque_ring_destroy(steque_ring_t* this);
+
 #endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "upstream.h"
+
+#define UPSTREAM_MAX_EVENTS 256
+
+unsigned long upstream_ntransfers = 0;
+unsigned long upstream_peak = 0;
+unsigned long upstream_nresumes = 0;
+
+struct upstream_thread_t
+{
+	upstream_t *up;
+	CURLM *multi;
+	int epoll_fd;
+	int event_fd;             // new or resumed transfers were queued
+	int timer_fd;             // curl asked to be called back
+	int nrunning;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	steque_t pending;         // easy handles waiting to be added
+	steque_t resumed;         // paused easy handles to continue
+};
+
+static int _socket_cb(CURL *eh, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+	upstream_thread_t *t = userp;
+	struct epoll_event ev;
+
+	if (what == CURL_POLL_REMOVE)
+	{
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		curl_multi_assign(t->multi, fd, NULL);
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (what & CURL_POLL_IN ? EPOLLIN : 0) | (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+
+	// socketp marks sockets that are already in the epoll set
+	if (socketp == NULL)
+	{
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		curl_multi_assign(t->multi, fd, t);
+	}
+	else
+	{
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	}
+
+	return 0;
+}
+
+static int _timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+	upstream_thread_t *t = userp;
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (timeout_ms > 0)
+	{
+		its.it_value.tv_sec = timeout_ms / 1000;
+		its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+	}
+	else if (timeout_ms == 0)
+	{
+		// due now, a zero it_value would disarm the timer instead
+		its.it_value.tv_nsec = 1;
+	}
+	timerfd_settime(t->timer_fd, 0, &its, NULL);
+
+	return 0;
+}
+
+static void _check_done(upstream_thread_t *t)
+{
+	CURLMsg *msg;
+	int left;
+
+	while ((msg = curl_multi_info_read(t->multi, &left)) != NULL)
+	{
+		if (msg->msg == CURLMSG_DONE)
+		{
+			CURL *eh = msg->easy_handle;
+			CURLcode result = msg->data.result;
+
+			curl_multi_remove_handle(t->multi, eh);
+			t->nrunning--;
+			t->up->done_func(eh, result);
+		}
+	}
+}
+
+static void _add_pending(upstream_thread_t *t)
+{
+	uint64_t count;
+
+	if (read(t->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	{
+		perror("read");
+	}
+
+	// the lock is dropped around curl calls, they may run callbacks that
+	// take a transfer's lock, which is held while calling upstream_resume
+	pthread_mutex_lock(&t->lock);
+	while (!steque_isempty(&t->pending))
+	{
+		CURL *eh = steque_pop(&t->pending);
+
+		pthread_mutex_unlock(&t->lock);
+		if (curl_multi_add_handle(t->multi, eh) != CURLM_OK)
+		{
+			fprintf(stderr, "curl_multi_add_handle() failed\n");
+			t->up->done_func(eh, CURLE_FAILED_INIT);
+		}
+		else
+		{
+			t->nrunning++;
+			if (t->nrunning > upstream_peak)
+			{
+				upstream_peak = t->nrunning;
+			}
+		}
+		pthread_mutex_lock(&t->lock);
+	}
+	// unpausing may call the write callback right away, which may pause
+	// again; the handle cannot finish while it is paused
+	while (!steque_isempty(&t->resumed))
+	{
+		CURL *eh = steque_pop(&t->resumed);
+
+		pthread_mutex_unlock(&t->lock);
+		curl_easy_pause(eh, CURLPAUSE_CONT);
+		pthread_mutex_lock(&t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void *_upstream_main(void *arg)
+{
+	upstream_thread_t *t = arg;
+	struct epoll_event events[UPSTREAM_MAX_EVENTS];
+	int running;
+
+	while (1)
+	{
+		int n = epoll_wait(t->epoll_fd, events, UPSTREAM_MAX_EVENTS, -1);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+
+			if (fd == t->event_fd)
+			{
+				_add_pending(t);
+			}
+			else if (fd == t->timer_fd)
+			{
+				uint64_t expirations;
+				if (read(t->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+					perror("read");
+				curl_multi_socket_action(t->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+			}
+			else
+			{
+				int flags = 0;
+				if (events[i].events & EPOLLIN)
+					flags |= CURL_CSELECT_IN;
+				if (events[i].events & EPOLLOUT)
+					flags |= CURL_CSELECT_OUT;
+				if (events[i].events & (EPOLLERR | EPOLLHUP))
+					flags |= CURL_CSELECT_ERR;
+				curl_multi_socket_action(t->multi, fd, flags, &running);
+			}
+		}
+
+		_check_done(t);
+	}
+
+	return NULL;
+}
+
+void upstream_init(upstream_t *up, int nthreads, upstream_done_t done_func)
+{
+	struct epoll_event ev;
+
+	up->nthreads = nthreads;
+	up->done_func = done_func;
+	up->next = 0;
+	up->threads = calloc(nthreads, sizeof(upstream_thread_t));
+
+	for (int i = 0; i < nthreads; i++)
+	{
+		upstream_thread_t *t = &up->threads[i];
+
+		t->up = up;
+		pthread_mutex_init(&t->lock, NULL);
+		steque_init(&t->pending);
+		steque_init(&t->resumed);
+
+		if ((t->epoll_fd = epoll_create1(0)) < 0 ||
+			(t->event_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+			(t->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+		{
+			perror("upstream_init");
+			exit(1);
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = t->event_fd;
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->event_fd, &ev);
+		ev.data.fd = t->timer_fd;
+		epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->timer_fd, &ev);
+
+		t->multi = curl_multi_init();
+		curl_multi_setopt(t->multi, CURLMOPT_SOCKETFUNCTION, _socket_cb);
+		curl_multi_setopt(t->multi, CURLMOPT_SOCKETDATA, t);
+		curl_multi_setopt(t->multi, CURLMOPT_TIMERFUNCTION, _timer_cb);
+		curl_multi_setopt(t->multi, CURLMOPT_TIMERDATA, t);
+		curl_multi_setopt(t->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+		if (pthread_create(&t->thread, NULL, _upstream_main, t) != 0)
+		{
+			fprintf(stderr, "Can't create upstream thread %d\n", i);
+			exit(1);
+		}
+	}
+}
+
+int upstream_add(upstream_t *up, CURL *eh)
+{
+	int thread = __sync_fetch_and_add(&up->next, 1) % up->nthreads;
+	upstream_thread_t *t = &up->threads[thread];
+	uint64_t one = 1;
+
+	__sync_fetch_and_add(&upstream_ntransfers, 1);
+
+	pthread_mutex_lock(&t->lock);
+	steque_enqueue(&t->pending, eh);
+	pthread_mutex_unlock(&t->lock);
+
+	if (write(t->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	{
+		perror("upstream_add");
+	}
+
+	return thread;
+}
+
+void upstream_resume(upstream_t *up, int thread, CURL *eh)
+{
+	upstream_thread_t *t = &up->threads[thread];
+	uint64_t one = 1;
+
+	__sync_fetch_and_add(&upstream_nresumes, 1);
+
+	pthread_mutex_lock(&t->lock);
+	steque_enqueue(&t->resumed, eh);
+	pthread_mutex_unlock(&t->lock);
+
+	if (write(t->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+	{
+		perror("upstream_resume");
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <curl/curl.h>
+#include "steque.h"
+
+/*
+ * Drives origin transfers with curl_multi.  A few threads each own a multi
+ * handle and wait for all of its sockets with epoll, so the number of
+ * concurrent transfers does not depend on the number of threads.  HTTP/2
+ * streams to the same origin are multiplexed over one connection.
+ *
+ * Callers create an easy handle, set CURLOPT_PRIVATE to identify it and
+ * hand it over with upstream_add.  The easy handle's callbacks run on an
+ * upstream thread.  When the transfer is over done_func is called on that
+ * thread, after the handle was removed from its multi handle; from then on
+ * the handle belongs to the caller again.
+ *
+ * A write callback may pause its transfer with CURL_WRITEFUNC_PAUSE; since
+ * only the owning thread may touch the handle, upstream_resume asks that
+ * thread to unpause it.
+ */
+
+typedef void (*upstream_done_t)(CURL *eh, CURLcode result);
+
+typedef struct upstream_thread_t upstream_thread_t;
+
+typedef struct upstream_t
+{
+	int nthreads;
+	upstream_thread_t *threads;
+	upstream_done_t done_func;
+	unsigned int next;
+} upstream_t;
+
+// transfers started and the most that were running at once on one thread
+extern unsigned long upstream_ntransfers;
+extern unsigned long upstream_peak;
+// times a transfer was resumed after its reader fell behind
+extern unsigned long upstream_nresumes;
+
+void upstream_init(upstream_t *up, int nthreads, upstream_done_t done_func);
+
+// may be called from any thread, returns the index of the thread the
+// transfer runs on for upstream_resume
+int upstream_add(upstream_t *up, CURL *eh);
+
+// eh must be paused, may be called from any thread
+void upstream_resume(upstream_t *up, int thread, CURL *eh);
+
+#endif // __UPSTREAM_H__
@@ -1,13 +1,55 @@
 #include "gfserver.h"
+#include "gfserver_epoll.h"
+#include "proxy-student.h"
+#include "gfserver_send.h"
 
 #define USAGE                                                                    \
   "usage:\n"                                                                     \
   "  webproxy [options]\n"                                                       \
   "options:\n"                                                                   \
   "  -s [server]         The server to connect to (Default: GitHub test data)\n" \
+  "                      A local directory is served from disk instead\n"        \
+  "                      Repeat -s to spread requests over several origins\n"   \
   "  -h                  Show this help message\n"                               \
   "  -p [listen_port]    Listen port (Default: 16664)\n"                         \
-  "  -t [thread_count]   Num worker threads (Default is 10, Range is 1-256)\n"
+  "  -t [thread_count]   Num worker threads (Default is 10, Range is 1-256)\n"   \
+  "  -e [loop_count]     Use the epoll engine with loop_count event loops\n"     \
+  "                      (Default is 0, thread per request; Range is 0-256)\n" \
+  "  -r                  Give every event loop its own SO_REUSEPORT listener\n" \
+  "  -k [max_requests]   With -e, let clients send up to max_requests requests\n" \
+  "                      over one connection (Default 0, one per connection)\n" \
+  "  -K [idle_ms]        Close kept-alive connections idle for idle_ms\n"      \
+  "                      (Default 5000)\n"                                      \
+  "  -m [multi_count]    With -e, drive origin transfers from multi_count\n"     \
+  "                      curl_multi threads instead of the workers (Default 0)\n" \
+  "                      without disk cache, ranges, hedging or collapsing\n"   \
+  "  -c [cache_dir]      Keep fetched objects in cache_dir (Default: off)\n"       \
+  "  -C [cache_mb]       Size limit of the disk cache in MB (Default: 64)\n"      \
+  "  -T [fresh_s]        Revalidate cached objects older than fresh_s seconds\n"  \
+  "                      with the origin (Default 0, never)\n"                   \
+  "  -S [max_stale_s]    Serve objects up to max_stale_s seconds past fresh_s\n"  \
+  "                      while they are revalidated in the background (Default 0)\n" \
+  "  -R [range_parts]    Fetch objects over 1 MB as range_parts parallel range\n" \
+  "                      requests (Default 0, off; Range is 0-16)\n"            \
+  "  -n [neg_ttl_ms]     Answer paths the origin reported missing from memory\n" \
+  "                      for neg_ttl_ms milliseconds (Default 0, off)\n"        \
+  "  -H [percentile]     With several origins, repeat a request at another one\n" \
+  "                      when its headers are later than this percentile of\n"   \
+  "                      recent requests (Default 95, 0 is off)\n"              \
+  "  -P [budget_kb]      With -c, prefetch the objects clients are likely to\n"  \
+  "                      request next, up to budget_kb KB/s (Default 0, off)\n"  \
+  "  -z [min_kb]         Send shared and ranged bodies in pieces of at least\n"  \
+  "                      min_kb KB without copying them (Default 0, off)\n"  \
+  "  -Q [target_ms]      With -e, shed requests once their wait for a worker\n" \
+  "                      stays above target_ms (Default 0, off)\n"             \
+  "  -W [max_wait_ms]    With -e, shed requests that waited longer than\n"     \
+  "                      max_wait_ms for a worker (Default 0, off)\n"         \
+  "  -A [max_active]     With -e, workers one client may occupy at once\n"     \
+  "                      (Default 0, no limit)\n"                              \
+  "  -b [rate]           With -e, requests per second one client may make\n"   \
+  "                      (Default 0, no limit)\n"                              \
+  "  -M [min_threads]    With -e, keep min_threads workers while idle and start\n" \
+  "                      up to thread_count under load (Default thread_count)\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
@@ -15,23 +57,115 @@ static struct option gLongOptions[] = {
     {"thread-count", required_argument, NULL, 't'},
     {"port", required_argument, NULL, 'p'},
     {"server", required_argument, NULL, 's'},
+    {"event-loops", required_argument, NULL, 'e'},
+    {"reuseport", no_argument, NULL, 'r'},
+    {"keepalive-max", required_argument, NULL, 'k'},
+    {"keepalive-idle", required_argument, NULL, 'K'},
+    {"multi-threads", required_argument, NULL, 'm'},
+    {"cache-dir", required_argument, NULL, 'c'},
+    {"cache-size", required_argument, NULL, 'C'},
+    {"fresh-time", required_argument, NULL, 'T'},
+    {"max-stale", required_argument, NULL, 'S'},
+    {"range-parts", required_argument, NULL, 'R'},
+    {"negative-ttl", required_argument, NULL, 'n'},
+    {"hedge-percentile", required_argument, NULL, 'H'},
+    {"prefetch-budget", required_argument, NULL, 'P'},
+    {"zerocopy-min", required_argument, NULL, 'z'},
+    {"queue-target", required_argument, NULL, 'Q'},
+    {"queue-max-wait", required_argument, NULL, 'W'},
+    {"client-max-active", required_argument, NULL, 'A'},
+    {"client-rate", required_argument, NULL, 'b'},
+    {"min-threads", required_argument, NULL, 'M'},
     {NULL, 0, NULL, 0}};
 
 #define MAX_REQUEST_LENGTH_N 822
 
 static gfserver_t gfs;
+static gfserver_epoll_t gfs_epoll;
+static unsigned short nloops = 0;
+static int reuseport = 0;
+static int keepalive_max = 0;
+static int keepalive_idle_ms = 5000;
+static curl_worker_t *curl_workers;
+static upstream_t upstream;
+static int nmulti = 0;
+static disk_cache_t disk_cache;
+static const char *cache_dir = NULL;
+static long cache_mb = 64;
+static long fresh_secs = 0;
+static long max_stale_secs = 0;
+static int nranges = 0;
+static neg_cache_t neg_cache;
+static long neg_ttl_ms = 0;
+static origin_set_t origins;
+static const char *origin_urls[ORIGIN_MAX];
+static int norigins = 0;
+static int hedge_percentile = 95;
+static flight_table_t flights;
+static prefetch_t prefetch;
+static long prefetch_kb = 0;
+static long zerocopy_kb = 0;
+static int queue_target_ms = 0;
+static int queue_max_ms = 0;
+static int client_max_active = 0;
+static int client_rate = 0;
+static int min_threads = 0;
+static int blocking_only = 0; // an option only the blocking handler implements
 
 static void _sig_handler(int signo)
 {
+  int i;
+
   if (signo == SIGTERM || signo == SIGINT)
   {
-    gfserver_stop(&gfs);
+    if (nloops > 0)
+      gfserver_epoll_stop(&gfs_epoll);
+    else
+      gfserver_stop(&gfs);
+    printf("upstream connections: %lu for %lu requests\n", curl_nconnects, curl_nrequests);
+    if (cache_dir != NULL)
+    {
+      printf("disk cache: %lu hits, %lu misses, %zu bytes\n", disk_cache.nhits, disk_cache.nmisses, disk_cache.cur_bytes);
+      if (fresh_secs > 0)
+        printf("disk cache: %lu background refreshes, %lu revalidated\n", disk_cache.nrefreshes, disk_cache.nrevalidated);
+    }
+    if (neg_ttl_ms > 0)
+    {
+      unsigned long nhits, nmisses;
+      size_t count;
+      neg_cache_stats(&neg_cache, &nhits, &nmisses, &count);
+      printf("negative cache: %lu hits, %lu misses, %zu paths\n", nhits, nmisses, count);
+    }
+    if (flights.nleaders > 0)
+      printf("collapsed forwarding: %lu fetches, %lu requests joined one\n", flights.nleaders, flights.nfollowers);
+    if (prefetch_kb > 0)
+      printf("prefetch: %lu objects, %lu hits\n", prefetch.nprefetches, prefetch.nhits);
+    if (nranges > 1)
+      printf("range fetches: %lu objects in %lu parts\n", curl_nranged, curl_nparts);
+    if (norigins > 1)
+    {
+      printf("origins: %lu hedges, %lu won\n", origins.nhedges, origins.nhedge_wins);
+      for (i = 0; i < norigins; i++)
+        printf("origin %s: %lu requests%s\n", origins.origins[i].url, origins.origins[i].nrequests, origins.origins[i].down ? ", down" : "");
+    }
+    if (nloops > 0 && gfs_epoll.nqueued > 0)
+      printf("work queue: %lu requests, %.1f ms wait on average, %d waiting, at most %d, %lu shed, %lu over rate\n",
+             gfs_epoll.nqueued, (double)gfs_epoll.queue_ms / gfs_epoll.nqueued, gfs_epoll.queue_depth, gfs_epoll.queue_peak,
+             gfs_epoll.nshed, gfs_epoll.nthrottled);
+    if (nloops > 0 && min_threads > 0)
+      printf("worker pool: %d workers, at most %d, %lu started under load (%lu for slow waits), %lu exited idle\n",
+             gfs_epoll.nworkers, gfs_epoll.nworkers_peak, gfs_epoll.ngrown, gfs_epoll.ngrown_wait, gfs_epoll.nshrunk);
+    if (nmulti > 0)
+      printf("upstream transfers: %lu, at most %lu at once per thread, %lu resumed\n", upstream_ntransfers, upstream_peak, upstream_nresumes);
     exit(signo);
   }
 }
 
 extern ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void *arg);
 extern ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void *arg);
+extern gfs_async_t handle_with_file_async(gfcontext_t *ctx, const char *path, void *arg, void **state);
+extern gfs_async_t handle_with_curl_async(gfcontext_t *ctx, const char *path, void *arg, void **state);
+extern void handle_with_curl_done(CURL *eh, CURLcode result);
 
 int main(int argc, char **argv)
 {
@@ -40,6 +174,8 @@ int main(int argc, char **argv)
   unsigned short port = 16664;
   unsigned short nworkerthreads = 10;
   const char *server = "https://raw.githubusercontent.com/gt-cs6200/image_data";
+  struct stat statbuf;
+  int local;
 
   // disable buffering on stdout so it prints immediately
   setbuf(stdout, NULL);
@@ -56,8 +192,11 @@ int main(int argc, char **argv)
     exit(SERVER_FAILURE);
   }
 
+  // sendfile has no MSG_NOSIGNAL, a client hanging up must not kill us
+  signal(SIGPIPE, SIG_IGN);
+
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:qs:xt:h", gLongOptions, NULL)) != -1)
+  while ((option_char = getopt_long(argc, argv, "p:qs:xt:he:rk:K:m:c:C:T:S:R:n:H:P:z:Q:W:A:b:M:", gLongOptions, NULL)) != -1)
   {
     switch (option_char)
     {
@@ -71,10 +210,78 @@ int main(int argc, char **argv)
       break;
     case 's': // file-path
       server = optarg;
+      if (norigins == ORIGIN_MAX)
+      {
+        fprintf(stderr, "Too many origins\n");
+        exit(__LINE__);
+      }
+      origin_urls[norigins++] = optarg;
       break;
     case 't': // thread-count 820
       nworkerthreads = atoi(optarg);
       break;
+    case 'e': // event-loops
+      nloops = atoi(optarg);
+      break;
+    case 'r': // per loop listeners
+      reuseport = 1;
+      break;
+    case 'k': // requests per connection
+      keepalive_max = atoi(optarg);
+      break;
+    case 'K': // keep-alive idle timeout
+      keepalive_idle_ms = atoi(optarg);
+      break;
+    case 'm': // curl_multi threads
+      nmulti = atoi(optarg);
+      break;
+    case 'c': // disk cache directory
+      cache_dir = optarg;
+      blocking_only = 1;
+      break;
+    case 'C': // disk cache size
+      cache_mb = atol(optarg);
+      blocking_only = 1;
+      break;
+    case 'T': // disk cache freshness
+      fresh_secs = atol(optarg);
+      break;
+    case 'S': // disk cache max stale
+      max_stale_secs = atol(optarg);
+      break;
+    case 'R': // parallel range requests
+      nranges = atoi(optarg);
+      blocking_only = 1;
+      break;
+    case 'n': // negative cache lifetime
+      neg_ttl_ms = atol(optarg);
+      break;
+    case 'H': // hedge percentile
+      hedge_percentile = atoi(optarg);
+      blocking_only = 1;
+      break;
+    case 'P': // prefetch budget
+      prefetch_kb = atol(optarg);
+      blocking_only = 1;
+      break;
+    case 'z': // zero-copy threshold
+      zerocopy_kb = atol(optarg);
+      break;
+    case 'Q': // work queue delay target
+      queue_target_ms = atoi(optarg);
+      break;
+    case 'W': // work queue delay limit
+      queue_max_ms = atoi(optarg);
+      break;
+    case 'A': // workers per client
+      client_max_active = atoi(optarg);
+      break;
+    case 'b': // requests per second per client
+      client_rate = atoi(optarg);
+      break;
+    case 'M': // idle worker pool size
+      min_threads = atoi(optarg);
+      break;
     default:
       fprintf(stderr, "%s", USAGE);
       exit(1);
@@ -102,23 +309,190 @@ int main(int argc, char **argv)
     fprintf(stderr, "Invalid number of worker threads\n");
     exit(__LINE__);
   }
+  if (nloops > 256)
+  {
+    fprintf(stderr, "Invalid number of event loops\n");
+    exit(__LINE__);
+  }
+  if (reuseport && nloops == 0)
+  {
+    fprintf(stderr, "Invalid per loop listeners, requires -e\n");
+    exit(__LINE__);
+  }
+  if (keepalive_max < 0 || (keepalive_max > 0 && nloops == 0) || keepalive_idle_ms < 1)
+  {
+    fprintf(stderr, "Invalid keep-alive settings, requires -e\n");
+    exit(__LINE__);
+  }
+  if (nmulti < 0 || nmulti > 64 || (nmulti > 0 && nloops == 0))
+  {
+    fprintf(stderr, "Invalid number of curl_multi threads, requires -e\n");
+    exit(__LINE__);
+  }
+  if (nmulti > 0 && blocking_only)
+  {
+    fprintf(stderr, "Invalid with -m: -c, -C, -R, -H and -P need the worker threads\n");
+    exit(__LINE__);
+  }
+  if (cache_mb < 1)
+  {
+    fprintf(stderr, "Invalid disk cache size\n");
+    exit(__LINE__);
+  }
+  if (fresh_secs < 0 || max_stale_secs < 0 || ((fresh_secs > 0 || max_stale_secs > 0) && cache_dir == NULL))
+  {
+    fprintf(stderr, "Invalid disk cache freshness, requires -c\n");
+    exit(__LINE__);
+  }
+  if (nranges < 0 || nranges > CURL_RANGE_MAX_PARTS)
+  {
+    fprintf(stderr, "Invalid number of range parts\n");
+    exit(__LINE__);
+  }
+  if (neg_ttl_ms < 0)
+  {
+    fprintf(stderr, "Invalid negative cache lifetime\n");
+    exit(__LINE__);
+  }
+  if (hedge_percentile < 0 || hedge_percentile > 100)
+  {
+    fprintf(stderr, "Invalid hedge percentile\n");
+    exit(__LINE__);
+  }
+  if (prefetch_kb < 0 || (prefetch_kb > 0 && cache_dir == NULL))
+  {
+    fprintf(stderr, "Invalid prefetch budget, requires -c\n");
+    exit(__LINE__);
+  }
+  if (zerocopy_kb < 0)
+  {
+    fprintf(stderr, "Invalid zero-copy threshold\n");
+    exit(__LINE__);
+  }
+  gfs_zerocopy_min = zerocopy_kb * 1024;
+  if (queue_target_ms < 0 || queue_max_ms < 0 || ((queue_target_ms > 0 || queue_max_ms > 0) && nloops == 0))
+  {
+    fprintf(stderr, "Invalid load shedding settings, requires -e\n");
+    exit(__LINE__);
+  }
+  if (client_max_active < 0 || client_rate < 0 || ((client_max_active > 0 || client_rate > 0) && nloops == 0))
+  {
+    fprintf(stderr, "Invalid per client limits, requires -e\n");
+    exit(__LINE__);
+  }
+  if (min_threads < 0 || min_threads > nworkerthreads || (min_threads > 0 && nloops == 0))
+  {
+    fprintf(stderr, "Invalid minimum number of worker threads, requires -e\n");
+    exit(__LINE__);
+  }
+  // the first origin decides between serving files and proxying
+  if (norigins > 0)
+    server = origin_urls[0];
   printf("Server: %s\n", server);
+  local = stat(server, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
   // Initialize libcurl
   curl_global_init(CURL_GLOBAL_ALL);
+  if (!local)
+  {
+    curl_workers = malloc(nworkerthreads * sizeof(curl_worker_t));
+    curl_workers_init(curl_workers, nworkerthreads, server);
+    flight_table_init(&flights);
+    for (i = 0; i < nworkerthreads; i++)
+    {
+      curl_workers[i].nranges = nranges;
+      curl_workers[i].flights = &flights;
+    }
+    if (norigins > 1)
+    {
+      origin_set_init(&origins, hedge_percentile);
+      for (i = 0; i < norigins; i++)
+        origin_set_add(&origins, origin_urls[i]);
+      origin_set_start(&origins);
+      for (i = 0; i < nworkerthreads; i++)
+        curl_workers[i].origins = &origins;
+    }
+    if (neg_ttl_ms > 0)
+    {
+      neg_cache_init(&neg_cache, NEG_CACHE_MAX, neg_ttl_ms);
+      for (i = 0; i < nworkerthreads; i++)
+        curl_workers[i].neg = &neg_cache;
+    }
+    if (cache_dir != NULL)
+    {
+      disk_cache_init(&disk_cache, cache_dir, (size_t)cache_mb << 20);
+      disk_cache.fresh_secs = fresh_secs;
+      disk_cache.max_stale_secs = max_stale_secs;
+      if (fresh_secs > 0)
+        curl_refresh_init(server, norigins > 1 ? &origins : NULL, &disk_cache);
+      for (i = 0; i < nworkerthreads; i++)
+        curl_workers[i].cache = &disk_cache;
+      // prefetching waits while half the workers fetch for clients
+      if (prefetch_kb > 0)
+      {
+        prefetch_init(&prefetch);
+        curl_prefetch_init(server, norigins > 1 ? &origins : NULL, &disk_cache, neg_ttl_ms > 0 ? &neg_cache : NULL,
+                           &flights, &prefetch, prefetch_kb * 1024, nworkerthreads > 1 ? nworkerthreads / 2 : 1);
+        for (i = 0; i < nworkerthreads; i++)
+          curl_workers[i].prefetch = &prefetch;
+      }
+    }
+  }
+  if (!local && nmulti > 0)
+  {
+    upstream_init(&upstream, nmulti, handle_with_curl_done);
+    for (i = 0; i < nworkerthreads; i++)
+      curl_workers[i].up = &upstream;
+  }
+
+  if (nloops > 0)
+  {
+    gfserver_epoll_init(&gfs_epoll, nworkerthreads);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_MAXNPENDING, 303);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_PORT, port);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_NLOOPS, (int)nloops);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_REUSEPORT, reuseport);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_KEEPALIVE_MAX, keepalive_max);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_KEEPALIVE_IDLE_MS, keepalive_idle_ms);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_QUEUE_TARGET_MS, queue_target_ms);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_QUEUE_MAX_MS, queue_max_ms);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_CLIENT_MAX_ACTIVE, client_max_active);
+    gfserver_epoll_setopt(&gfs_epoll, GFS_CLIENT_RATE, client_rate);
+    if (min_threads > 0)
+      gfserver_epoll_setopt(&gfs_epoll, GFS_MIN_THREADS, min_threads);
+    // local files never block for long, serve them from the event loops
+    if (local)
+      gfserver_epoll_setopt(&gfs_epoll, GFS_ASYNC_WORKER_FUNC, handle_with_file_async);
+    else if (nmulti > 0)
+      gfserver_epoll_setopt(&gfs_epoll, GFS_ASYNC_WORKER_FUNC, handle_with_curl_async);
+    else
+      gfserver_epoll_setopt(&gfs_epoll, GFS_WORKER_FUNC, handle_with_curl);
+    for (i = 0; i < nworkerthreads; i++)
+    {
+      gfserver_epoll_setopt(&gfs_epoll, GFS_WORKER_ARG, i, local ? (void *)server : (void *)&curl_workers[i]);
+    }
+    gfserver_epoll_serve(&gfs_epoll);
+    if (!local)
+      curl_workers_cleanup(curl_workers, nworkerthreads);
+    curl_global_cleanup();
+    return -2209;
+  }
+
   // Initialize server structure here
   gfserver_init(&gfs, nworkerthreads);
   // Set server options here
   gfserver_setopt(&gfs, GFS_MAXNPENDING, 303);
-  gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_file);
+  gfserver_setopt(&gfs, GFS_WORKER_FUNC, local ? handle_with_file : handle_with_curl);
   gfserver_setopt(&gfs, GFS_PORT, port);
   // Set up arguments for worker here
   for (i = 0; i < nworkerthreads; i++)
   {
-    gfserver_setopt(&gfs, GFS_WORKER_ARG, i, server);
+    gfserver_setopt(&gfs, GFS_WORKER_ARG, i, local ? (void *)server : (void *)&curl_workers[i]);
   }
   // Invoke the framework - this is an infinite loop and shouldn't return
   gfserver_serve(&gfs);
   // libcurl cleanup
+  if (!local)
+    curl_workers_cleanup(curl_workers, nworkerthreads);
   curl_global_cleanup();
 
   // not reached